@@ -4,57 +4,38 @@
 #include <unistd.h>
 #include <limits.h>
 #include <signal.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <sys/time.h>
-#include "Bank.h" // Provides in-memory, volatile "database" & access methods
+#include "storage.h" // Account storage backends, Bank.c by default
+#include "buffer.h" // Bounded command buffer shared with the worker threads
+#include "logger.h" // Asynchronous, batched writer for the output file
 
 
 #define PROMPT "> "
 #define OUTPUT "< "
-#define MAX_CMD_LEN 125
 #define MAX_FILENAME_LEN 100
 
 
 // CUSTOM STRUCTURES
-// A node in the Linked List data structure for storing commands
-struct node {
-        char cmd[MAX_CMD_LEN]; // Command to be completed
-        int request_id;
-        struct timeval tv_begin;
-        struct node *next;     // Pointer to the next node in the list
-};
-
-struct buffer {
-        struct node *head;    // Points to the first element in Linked List
-};
-
 struct pthread_args {
         struct buffer *cmd_buf;
-        char log_filename[MAX_FILENAME_LEN];
-        int *running;
-};
-
-struct transaction {
-        int account_number;
-        int value;
+        struct logger *log; // output file writer
 };
 
 
 // GLOBAL VARIABLES
-pthread_mutex_t buffer_lock; // Mutex to lock the entire command buffer
 pthread_mutex_t bank_lock; // Mutex to lock the entire command buffer
 
 
 // FUNCTION PROTOTYPES
 void handle_interrupt();
-int extract_cmd(struct buffer *cmd_buffer, struct node *curr_cmd_info);
-void add_cmd(struct buffer *cmd_buffer, char command_to_add[MAX_CMD_LEN], int request_id, struct timeval tv_begin);
 void *thread_routine(void *args);
 int check_input(char *user_in);
-void check(char *cmd, char *log_filename, struct timeval tv_begin, int request_id);
-void trans(char *cmd, char *log_filename, struct timeval tv_begin, int request_id);
+void check(int account_num, struct logger *log, struct timeval tv_begin, int request_id);
+void trans(struct command *cmd, struct logger *log, struct timeval tv_begin, int request_id);
 int parse_check_cmd(char *cmd);
-int parse_trans_cmd(char *cmd, struct transaction transactions[10]);
+int parse_trans_cmd(char *cmd, struct transaction transactions[MAX_TRANSACTIONS]);
 
 // Program the same as appserver, but the locking occurs at the bank level
 // (all accounts) rather than per-account. Reduces thread concurrency.
@@ -68,29 +49,85 @@ void main(int argc, char **argv)
         // Command buffer that main will place user input into and threads
         // will fetch from.
         struct buffer command_buffer;
-        command_buffer.head = NULL; // set linked list to empty
+        char *storage_backend = DEFAULT_STORAGE;
+        int storage_latency_us = DEFAULT_STORAGE_LATENCY_US;
+        int storage_jitter_us = 0;
+        struct logger log;
+        int log_flush_bytes = DEFAULT_LOG_FLUSH_BYTES;
+        int log_flush_ms = DEFAULT_LOG_FLUSH_MS;
+        int buffer_capacity = DEFAULT_BUFFER_CAPACITY;
         int request_id = 1; // The transaction ID given to user
         struct pthread_args args;
         struct timeval tv_begin; // timestamp of when a command begins
+        struct command cmd; // Parsed here, run as is by a worker
 
         // Prevent keyboard interrupts
         signal(SIGINT, handle_interrupt);
 
-        if (argc != 4) {
+        // Optional flags may appear anywhere on the command line
+        static struct option long_opts[] = {
+                {"queue-capacity", required_argument, NULL, 'q'},
+                {"log-flush-bytes", required_argument, NULL, 'b'},
+                {"log-flush-ms", required_argument, NULL, 'f'},
+                {"storage", required_argument, NULL, 's'},
+                {"storage-latency-us", required_argument, NULL, 'L'},
+                {"storage-jitter-us", required_argument, NULL, 'J'},
+                {0, 0, 0, 0}
+        };
+        int opt;
+        while ((opt = getopt_long(argc, argv, "q:b:f:s:L:J:", long_opts, NULL)) != -1) {
+                switch (opt) {
+                case 'q':
+                        buffer_capacity = atoi(optarg);
+                        break;
+                case 'b':
+                        log_flush_bytes = atoi(optarg);
+                        break;
+                case 'f':
+                        log_flush_ms = atoi(optarg);
+                        break;
+                case 's':
+                        storage_backend = optarg;
+                        break;
+                case 'L':
+                        storage_latency_us = atoi(optarg);
+                        break;
+                case 'J':
+                        storage_jitter_us = atoi(optarg);
+                        break;
+                default:
+                        argc = -1; // fall through to the usage message
+                }
+        }
+
+        if (argc - optind != 3) {
                 printf("\nAppServer combined server and client program.\n");
                 printf("\nUSAGE: ./appserver <# of worker threads> "
-                       "<# of accounts> <output file>\n\n");
+                       "<# of accounts> <output file> [options]\n");
+                printf("\n  -q, --queue-capacity <n>  max commands waiting in "
+                       "the command buffer (default %d)\n",
+                       DEFAULT_BUFFER_CAPACITY);
+                printf("  -b, --log-flush-bytes <n> write the log once this "
+                       "many bytes are pending (default %d)\n"
+                       "  -f, --log-flush-ms <n>    write pending log lines at "
+                       "least this often (default %d)\n",
+                       DEFAULT_LOG_FLUSH_BYTES, DEFAULT_LOG_FLUSH_MS);
+                printf("  -s, --storage <backend>   where balances are kept "
+                       "(default %s)\n", DEFAULT_STORAGE);
+                storage_print_backends();
+                printf("  -L, --storage-latency-us <n>  latency backend delay "
+                       "per access (default %d)\n"
+                       "  -J, --storage-jitter-us <n>   latency backend extra "
+                       "random delay (default 0)\n", DEFAULT_STORAGE_LATENCY_US);
+                printf("\n");
                 exit(EXIT_FAILURE);
         }
 
         // Fetch and store command-line arguments
-        num_workerthreads = atoi(argv[1]);
-        num_accts = atoi(argv[2]);
-        strncpy(output_filename, argv[3], sizeof(argv[3]));
-
-        // Create file so users can start tailing immediately
-        FILE *fp = fopen(output_filename, "a");
-        fclose(fp);
+        num_workerthreads = atoi(argv[optind]);
+        num_accts = atoi(argv[optind + 1]);
+        strncpy(output_filename, argv[optind + 2], sizeof(output_filename) - 1);
+        output_filename[sizeof(output_filename) - 1] = '\0';
 
         if (num_workerthreads < 1) {
                 printf("\nWorker threads must be at least 1 or more."
@@ -100,30 +137,51 @@ void main(int argc, char **argv)
                 printf("\nNumber of accounts must be at least 1 or more."
                        " Exiting.\n\n");
                 exit(EXIT_FAILURE);
+        } else if (buffer_capacity < 1) {
+                printf("\nQueue capacity must be at least 1 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (log_flush_bytes < 1 || log_flush_bytes > LOG_MAX_FLUSH_BYTES ||
+                   log_flush_ms < 0) {
+                printf("\nLog flush bytes must be between 1 and %d and flush "
+                       "interval 0 or more. Exiting.\n\n", LOG_MAX_FLUSH_BYTES);
+                exit(EXIT_FAILURE);
+        } else if (storage_latency_us < 0 || storage_jitter_us < 0 ||
+                   storage_select(storage_backend, storage_latency_us,
+                                  storage_jitter_us) == 0) {
+                printf("\nUnknown storage backend or negative latency."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        }
+
+        // Open the log now so users can start tailing immediately
+        if (logger_init(&log, output_filename, log_flush_bytes, log_flush_ms, 0) == 0) {
+                perror("Failed to open output file.");
+                exit(EXIT_FAILURE);
         }
 
         printf("Number of worker threads: %d\n", num_workerthreads);
         printf("Number of accounts: %d\n", num_accts);
+        printf("Storage backend: %s\n", storage_name());
         getcwd(cwd, sizeof(cwd));
         printf("Log location: %s/%s\n", cwd, output_filename);
 
         printf("\nInitializing bank accounts.\n");
-        if (initialize_accounts(num_accts) == 0) {
+        if (storage_initialize(num_accts) == 0) {
                 perror("Failed to init bank accounts.");
                 exit(EXIT_FAILURE);
         }
 
-        printf("Initializing command buffer mutex\n");
-        if (pthread_mutex_init(&buffer_lock, NULL) != 0) {
-                perror("Failed to init command buffer mutex.");
+        printf("Initializing command buffer (capacity %d)\n", buffer_capacity);
+        if (buffer_init(&command_buffer, buffer_capacity) == 0) {
+                perror("Failed to init command buffer.");
                 exit(EXIT_FAILURE);
         }
 
         printf("Spinning up worker threads\n");
         int i = 0;
         args.cmd_buf = &command_buffer;
-        args.running = &running;
-        strcpy(args.log_filename, output_filename);
+        args.log = &log;
         pthread_t thread_ids[num_workerthreads];
         for (i = 0; i < num_workerthreads; i++) {
                 if (pthread_create(&thread_ids[i], NULL, thread_routine,
@@ -147,19 +205,22 @@ void main(int argc, char **argv)
                 if (valid_input > 0) {
                         // Get the time that we received this command (start)
                         gettimeofday(&tv_begin, NULL);
-                        if (valid_input == 1) {
-                                // CHECK
+                        cmd.op = valid_input;
+                        if (valid_input == CMD_CHECK) {
                                 int acc_to_check = parse_check_cmd(user_input);
                                 if (acc_to_check > num_accts || acc_to_check < 1) {
                                         printf("Invalid account number.\n");
                                 } else {
-                                        add_cmd(&command_buffer, user_input, request_id, tv_begin);
+                                        cmd.num_transactions = 1;
+                                        cmd.transactions[0].account_number = acc_to_check;
+                                        cmd.transactions[0].value = 0;
+                                        add_cmd(&command_buffer, &cmd, request_id, tv_begin);
                                         printf("%sID %d\n", OUTPUT, request_id);
                                         request_id++; // increment transaction id for next command
                                 }
                         } else {
                                 // TRANS
-                                struct transaction *transactions = (struct transaction*)malloc(sizeof(struct transaction)*10);
+                                struct transaction *transactions = cmd.transactions;
                                 int num_transactions = parse_trans_cmd(user_input, transactions);
 
                                 int i = 0;
@@ -174,13 +235,13 @@ void main(int argc, char **argv)
                                         i++;
                                 }
                                 if (isValidTransaction) {
-                                        add_cmd(&command_buffer, user_input, request_id, tv_begin);
+                                        cmd.num_transactions = num_transactions;
+                                        add_cmd(&command_buffer, &cmd, request_id, tv_begin);
                                         printf("%sID %d\n", OUTPUT, request_id);
                                         request_id++; // increment transaction id for next command
                                 } else {
                                         printf("Transaction failed, contained invalid account number.\n");
                                 }
-                                free(transactions);
                         }
                 } else if (strncmp(user_input, "END", 3) == 0) {
                         running = 0; // stop all new commands
@@ -192,21 +253,29 @@ void main(int argc, char **argv)
                 }
         }
 
+        // No more commands are coming; workers drain the buffer and exit.
+        buffer_close(&command_buffer);
+
         // Wait (blocks) for worker threads to finish before exiting program.
         for (i = 0; i < num_workerthreads; i++) {
                 pthread_join(thread_ids[i], NULL);
         }
 
+        // Every worker has logged its last line; flush them to the file
+        logger_close(&log);
+
+        buffer_destroy(&command_buffer);
+
         exit(EXIT_SUCCESS);
 }
 
-// Returns 1 if CHECK command, 2 if TRANS command, -1 otherwise
+// Returns CMD_CHECK or CMD_TRANS for those commands, -1 otherwise
 int check_input(char *user_in)
 {
         if (strncmp(user_in, "CHECK ", 6) == 0) {
-                return 1;
+                return CMD_CHECK;
         } else if (strncmp(user_in, "TRANS ", 6) == 0) {
-                return 2;
+                return CMD_TRANS;
         } else {
                 // disallowed request
                 return -1;
@@ -229,25 +298,20 @@ int parse_check_cmd(char *cmd)
         return atoi(num);
 }
 
-void check(char *cmd, char *log_filename, struct timeval tv_begin, int request_id)
+void check(int account_num, struct logger *log, struct timeval tv_begin, int request_id)
 {
-        FILE *fp;
-        int account_num = parse_check_cmd(cmd);
-
         pthread_mutex_lock(&bank_lock);
-        int amount = read_account(account_num);
+        int amount = storage_read(account_num);
         // Time that this command finishes
         struct timeval tv_end;
         gettimeofday(&tv_end, NULL);
         // Append to logfile
-        fp = fopen(log_filename, "a");
-        fprintf(fp, "%d BAL %d TIME %ld.%06ld %ld.%06ld\n", request_id, amount, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
-        fclose(fp);
+        log_line(log, "%d BAL %d TIME %ld.%06ld %ld.%06ld\n", request_id, amount, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
         pthread_mutex_unlock(&bank_lock);
 }
 
 // Returns pointer to array of SORTED (lowest acc num to highest) transaction structs
-int parse_trans_cmd(char *cmd, struct transaction transactions[10])
+int parse_trans_cmd(char *cmd, struct transaction transactions[MAX_TRANSACTIONS])
 {
         // Need to pull account numbers out
         int numbers[20];
@@ -288,11 +352,10 @@ int parse_trans_cmd(char *cmd, struct transaction transactions[10])
         return trans_counter;
 }
 
-void trans(char *cmd, char *log_filename, struct timeval tv_begin, int request_id)
+void trans(struct command *cmd, struct logger *log, struct timeval tv_begin, int request_id)
 {
-        struct transaction *transactions = (struct transaction*)malloc(sizeof(struct transaction)*10);
-        int num_transactions = parse_trans_cmd(cmd, transactions);
-        FILE *fp;
+        struct transaction *transactions = cmd->transactions;
+        int num_transactions = cmd->num_transactions;
         int ISF = 0;
         int current_balance;
         int current_account;
@@ -307,7 +370,7 @@ void trans(char *cmd, char *log_filename, struct timeval tv_begin, int request_i
         // Do the transactions
         for (i = 0; i < num_transactions; i++) {
                 current_account = transactions[i].account_number;
-                current_balance = read_account(current_account);
+                current_balance = storage_read(current_account);
                 trans_value = transactions[i].value;
 
                 predicted_value = current_balance + trans_value;
@@ -321,7 +384,7 @@ void trans(char *cmd, char *log_filename, struct timeval tv_begin, int request_i
         // All accounts had sufficient funds, apply the new balances
         if (ISF == 0) {
                 for (i = 0; i < num_transactions; i++) {
-                        write_account(transactions[i].account_number, new_balances[i]);
+                        storage_write(transactions[i].account_number, new_balances[i]);
                 }
         }
 
@@ -329,20 +392,15 @@ void trans(char *cmd, char *log_filename, struct timeval tv_begin, int request_i
         struct timeval tv_end;
         gettimeofday(&tv_end, NULL);
         // Append to logfile
-        fp = fopen(log_filename, "a");
-
         if (ISF != 0) {
                 // then ISF == account number with insufficient funds
-                fprintf(fp, "%d ISF %d TIME %ld.%06ld %ld.%06ld\n", request_id, ISF, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
+                log_line(log, "%d ISF %d TIME %ld.%06ld %ld.%06ld\n", request_id, ISF, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
         } else {
-                fprintf(fp, "%d OK TIME %ld.%06ld %ld.%06ld\n", request_id, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
+                log_line(log, "%d OK TIME %ld.%06ld %ld.%06ld\n", request_id, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
         }
 
-        fclose(fp);
-
         // Unlock the bank
         pthread_mutex_unlock(&bank_lock);
-        free(transactions);
 }
 
 void handle_interrupt()
@@ -351,91 +409,23 @@ void handle_interrupt()
                "Please use the END command to exit program.\n\n");
 }
 
-// Returns request ID (nonzero) if command extracted,
-// 0 if no command to extract.
-// If command exists and is retrieved from beginning of list,
-// it is placed in the given next_cmd array and is deleted from the
-// Linked List. Head is updated to point to the next command to be processed.
-int extract_cmd(struct buffer *cmd_buffer, struct node *curr_cmd_info)
-{
-        int retval = 0;
-
-        pthread_mutex_lock(&buffer_lock);
-
-        // If there is command in the buffer...
-        if (cmd_buffer->head != NULL) {
-                // *struct1.blah === struct1->blah
-                strcpy(curr_cmd_info->cmd, cmd_buffer->head->cmd);
-                curr_cmd_info->request_id = cmd_buffer->head->request_id;
-                curr_cmd_info->tv_begin = cmd_buffer->head->tv_begin;
-                // Delete the command from the Linked List by resetting
-                // head to next node.
-                struct node *new_next = cmd_buffer->head->next;
-                free(cmd_buffer->head); // free previously malloc-ed pointer
-                cmd_buffer->head = new_next;
-                retval = 1;
-        } else {
-                retval = 0;
-        }
-
-        pthread_mutex_unlock(&buffer_lock);
-
-        return retval;
-}
-
-// Add a node to the end of Linked List and update head. Returns nothing as this
-// should always succeed. Should only be called by the main thread.
-void add_cmd(struct buffer *cmd_buffer, char command_to_add[MAX_CMD_LEN], int request_id, struct timeval tv_begin)
-{
-        pthread_mutex_lock(&buffer_lock);
-
-        // Build new node
-        struct node *node_to_add = (struct node*)malloc(sizeof(struct node));
-        strcpy(node_to_add->cmd, command_to_add);
-        node_to_add->next = NULL; // Node will be placed at the END of the list
-        node_to_add->request_id = request_id;
-        node_to_add->tv_begin = tv_begin;
-
-        // Append the new node to the end of the list
-        struct node *find_end = cmd_buffer->head;
-        if (cmd_buffer->head == NULL) {
-                // Then this is the FIRST command in the buffer
-                cmd_buffer->head = node_to_add;
-        } else {
-                // then this is NOT the first command in the buffer
-                while (find_end->next != NULL) {
-                        find_end = find_end->next;
-                }
-                find_end->next = node_to_add;
-        }
-
-        pthread_mutex_unlock(&buffer_lock);
-}
-
 // This is the function that the worker threads will be assigned.
 void *thread_routine(void *args)
 {
         struct pthread_args *routine_args = (struct pthread_args*) args;
-        int request;
-        int *is_running = routine_args->running;
-        char *log_file_loc = routine_args->log_filename;
+        struct logger *log = routine_args->log;
         struct node current_command_info;
-        while (*is_running) {
-                request = extract_cmd(routine_args->cmd_buf, &current_command_info);
-                if (request) {
-                        if (strncmp(current_command_info.cmd, "CHECK ", 6) == 0) {
-                                check(current_command_info.cmd,
-                                      log_file_loc, current_command_info.tv_begin,
-                                      current_command_info.request_id);
-                        } else if (strncmp(current_command_info.cmd, "TRANS ", 6) == 0) {
-                                trans(current_command_info.cmd, log_file_loc,
-                                      current_command_info.tv_begin,
-                                      current_command_info.request_id);
-                        } else {
-                                // Do nothing, unrecognized command
-                        }
+        // Blocks until a command is available; returns 0 once END has been
+        // given and the buffer is drained.
+        while (extract_cmd(routine_args->cmd_buf, &current_command_info)) {
+                if (current_command_info.cmd.op == CMD_CHECK) {
+                        check(current_command_info.cmd.transactions[0].account_number,
+                              log, current_command_info.tv_begin,
+                              current_command_info.request_id);
                 } else {
-                        // Do nothing
+                        trans(&current_command_info.cmd, log,
+                              current_command_info.tv_begin,
+                              current_command_info.request_id);
                 }
         }
         printf("Thread %ld is exiting.\n", pthread_self());
@@ -4,71 +4,210 @@
 #include <unistd.h>
 #include <limits.h>
 #include <signal.h>
+#include <getopt.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/time.h>
-#include "Bank.h" // Provides in-memory, volatile "database" & access methods
+#include "storage.h" // Account storage backends, Bank.c by default
+#include "iopool.h" // Threads that overlap the storage accesses of a TRANS
+#include "wal.h" // Write-ahead log of committed TRANS with group commit
+#include "snapshot.h" // Periodic copy-on-write snapshots of every balance
+#include "metrics.h" // Per-stage latency histograms for STATS
+#include "lockprof.h" // Opt-in per-account lock contention profile
+#include "command.h" // Parsed, binary form of a CHECK or TRANS
+#include "buffer.h" // Bounded command buffer shared with the worker threads
+#include "logger.h" // Asynchronous, batched writer for the output file
+#include "net.h" // epoll front end for network clients
+#include "wire.h" // Binary encoding used by opted-in network clients
+#include "steal.h" // Per-worker lock-free rings with work stealing
+#include "epoch.h" // Deterministic epoch scheduler, conflict-free waves
+#include "async.h" // Workers that keep many commands in flight as state machines
 
 
 #define PROMPT "> "
 #define OUTPUT "< "
-#define MAX_CMD_LEN 125
 #define MAX_FILENAME_LEN 100
 
+// How the main thread hands commands to the worker threads
+#define DISPATCH_SHARED 0 // One blocking buffer shared by every worker
+#define DISPATCH_STEAL 1  // A ring per worker, idle workers steal from peers
+#define DISPATCH_EPOCH 2  // Epochs of the shared buffer run in lock-free waves
+#define DISPATCH_SHARD 3  // Each worker owns a shard of the accounts
+
+// Outcome of submit_cmd() for one line of input
+#define SUBMIT_QUEUED 0      // Valid command, handed to the workers
+#define SUBMIT_BAD_CHECK 1   // CHECK of an account that doesn't exist
+#define SUBMIT_BAD_TRANS 2   // TRANS touching an account that doesn't exist
+#define SUBMIT_INVALID 3     // Not a CHECK, TRANS, STATS or END command
+#define SUBMIT_END 4
+#define SUBMIT_STATS 5       // Asks for the metrics, answered right away
+#define SUBMIT_LOCKS 6       // Asks for the lock contention profile
+#define SUBMIT_CLOSED 7      // END was given on stdin, no more commands are taken
+
+// Optimistic TRANS attempts before falling back to holding the locks
+#define OCC_MAX_ATTEMPTS 5
+
+// Where async_step_cmd resumes a command (--async)
+#define TASK_NEW 0
+#define TASK_LOCK 1    // Locking its stripes
+#define TASK_READ 2    // Waiting out the latency of its reads
+#define TASK_COMMIT 3  // Entering the snapshot gate
+#define TASK_WAL 4     // Waiting for its WAL record to be durable
+#define TASK_WRITE 5   // Waiting out the latency of its writes
+
 
 // CUSTOM STRUCTURES
-// A node in the Linked List data structure for storing commands
-struct node {
-        char cmd[MAX_CMD_LEN]; // Command to be completed
-        int request_id;
-        struct timeval tv_begin;
-        struct node *next;     // Pointer to the next node in the list
+struct pthread_args {
+        int dispatch_mode;
+        struct buffer *cmd_buf;       // used with DISPATCH_SHARED and _EPOCH
+        struct steal_pool *steal_pool; // used with DISPATCH_STEAL
+        struct epoch_sched *epoch;     // used with DISPATCH_EPOCH
+        struct buffer *inboxes;        // used with DISPATCH_SHARD, one per worker
+        struct async_worker *async_workers; // with --async, one per worker
+        int num_shards;
+        // Finished cross-shard TRANS records, reused so dispatching one
+        // doesn't allocate
+        _Atomic(struct cross_shard_trans *) cross_free;
+        struct lock_table *locks; // account locks
+        struct logger *log; // output file writer
+        int num_accts;
+        // Commands arrive from stdin and the network listener; this keeps
+        // request IDs in the same order the commands are dispatched.
+        pthread_mutex_t submit_lock;
+        int next_request_id;
+        int closed; // Set at END so the workers can drain; under submit_lock
 };
 
-struct buffer {
-        struct node *head;    // Points to the first element in Linked List
+// Each worker gets its own id so it knows which ring it owns
+struct worker_args {
+        int id;
+        struct pthread_args *shared;
 };
 
-struct pthread_args {
-        struct buffer *cmd_buf;
-        struct account *accounts; // pointer to array of accounts
-        char log_filename[MAX_FILENAME_LEN];
-        int *running;
+// A single-account TRANS waiting to be applied by whichever worker next
+// holds its stripe (--combine). Lives on the submitting worker's stack until
+// done is set, which only happens with the stripe write locked.
+struct combine_req {
+        struct transaction transaction;
+        struct node *cmd_info;
+        int done;
+        struct combine_req *next;
 };
 
-struct account {
-        pthread_mutex_t lock;
+// CHECKs take the lock shared so they run side by side; TRANS takes it
+// exclusive. Writers are preferred so a stream of CHECKs can't starve a TRANS.
+// Padded to a cache line so neighbouring stripes never share one.
+struct lock_stripe {
+        _Alignas(CACHE_LINE) pthread_rwlock_t lock;
+        _Atomic(struct combine_req *) pending; // --combine requests, newest first
+};
+
+// Account number n is guarded by stripe (n - 1) % num_stripes. One stripe per
+// account gives per-account locking; a single stripe locks the whole bank.
+struct lock_table {
+        struct lock_stripe *stripes;
+        int num_stripes;
+        // With --occ, bumped every time a TRANS commits a new balance to the
+        // account, so optimistic readers can tell their snapshot went stale.
+        // Only changed while the account's stripe is write locked.
+        atomic_uint *versions;
 };
 
-struct transaction {
-        int account_number;
-        int value;
+// A TRANS whose accounts span several shards. Every owner involved gets a
+// copy of the command pointing here and handles its own accounts: each reads
+// them and reports whether they can take the TRANS, the owner of the lowest
+// shard decides for all, logs it to the WAL, and once every owner has
+// applied (or skipped) its part, writes the log line and puts this back on
+// the free list.
+struct cross_shard_trans {
+        int coordinator;      // Shard that decides
+        int participants;
+        int arrived;          // Owners that have read their balances
+        int decided;
+        int left;             // Owners other than the coordinator done with it
+        int ISF;              // Lowest account that would go negative, or 0
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+        struct cross_shard_trans *next; // While on the free list
 };
 
 
 // GLOBAL VARIABLES
-pthread_mutex_t buffer_lock; // Mutex to lock the entire command buffer
+int cas_fast_path = 0; // Single-account TRANS skip the account locks
+atomic_long trans_cas_count;       // TRANS completed by the lock-free path
+atomic_long trans_locked_count;    // TRANS completed any other way
+atomic_long trans_cas_fallbacks;   // Lock-free attempts that found a held account
+int occ = 0; // TRANS read without locks and validate at commit
+atomic_long occ_commits;           // TRANS finished optimistically
+atomic_long occ_aborts;            // Validations that found a stale read
+atomic_long occ_fallbacks;         // TRANS that gave up and took the locked path
+int combining = 0; // Single-account TRANS are applied in batches per stripe
+atomic_long combine_batches;       // Batches applied by a combining worker
+atomic_long combine_requests;      // TRANS applied in those batches
+int io_threads = 0; // 0 reads and writes the accounts of a TRANS one by one
+struct io_pool io_pool;
+int wal_enabled = 0; // TRANS are logged to the WAL before they are applied
+struct wal wal;
+int snapshots_enabled = 0; // Balances are snapshotted to a file
+struct snapshotter snapshotter;
+struct metrics metrics;
+int lock_profiling = 0; // Account lock acquisitions are profiled
+struct lock_profile lock_profile;
+int deliver_results = 0; // Results also go back to whoever sent the command
+struct net_listener net;
 
 
 // FUNCTION PROTOTYPES
 void handle_interrupt();
-int extract_cmd(struct buffer *cmd_buffer, struct node *curr_cmd_info);
-void add_cmd(struct buffer *cmd_buffer, char command_to_add[MAX_CMD_LEN], int request_id, struct timeval tv_begin);
 void *thread_routine(void *args);
-int check_input(char *user_in);
-void check(struct account *accs, char *cmd, char *log_filename, struct timeval tv_begin, int request_id);
-void trans(struct account *accs, char *cmd, char *log_filename, struct timeval tv_begin, int request_id);
-int parse_check_cmd(char *cmd);
-int parse_trans_cmd(char *cmd, struct transaction transactions[10]);
+void dispatch_cmd(struct pthread_args *args, struct node *cmd_info);
+void shard_dispatch(struct pthread_args *args, struct node *cmd_info);
+struct cross_shard_trans *cross_alloc(struct pthread_args *args);
+void cross_release(struct pthread_args *args, struct cross_shard_trans *cross);
+void trans_cross_shard(int shard, struct pthread_args *args, struct node *cmd_info);
+int next_cmd(struct worker_args *worker, struct node *curr_cmd_info);
+int submit_cmd(struct pthread_args *args, char *user_input, struct client *client, int *request_id);
+int submit_command(struct pthread_args *args, struct command *cmd, struct timeval tv_begin, struct client *client, unsigned int tag, int *request_id);
+int net_submit(void *ctx, struct client *client, char *line, char *reply, int reply_len);
+int net_submit_binary(void *ctx, struct client *client, unsigned char *frame, unsigned char reply[WIRE_RESPONSE_LEN]);
+void check(struct lock_table *locks, struct node *cmd_info, struct logger *log);
+void trans(struct lock_table *locks, struct node *cmd_info, struct logger *log);
+void trans_combined(struct lock_table *locks, struct transaction *transaction, struct logger *log, struct node *cmd_info);
+void combine(struct lock_stripe *stripe, struct logger *log);
+int init_lock_table(struct lock_table *locks, int num_stripes);
+void destroy_lock_table(struct lock_table *locks);
+pthread_rwlock_t *account_lock(struct lock_table *locks, int account_number);
+int trans_stripes(struct lock_table *locks, struct transaction *transactions, int num_transactions, int stripes[10]);
+int trans_single(struct transaction *transaction, struct logger *log, struct node *cmd_info);
+int trans_occ(struct lock_table *locks, struct transaction *transactions, int num_transactions, struct logger *log, struct node *cmd_info, long *storage);
+void log_trans(struct logger *log, int ISF, struct node *cmd_info);
+void finish_cmd(struct logger *log, struct node *cmd_info, int result, int value);
+long read_balances(struct transaction *transactions, int num_transactions, int *balances);
+long write_balances(struct transaction *transactions, int num_transactions, int *balances);
+void wal_commit(struct transaction *transactions, int num_transactions);
+void commit_begin();
+void commit_end();
+void run_cmd(struct lock_table *locks, struct logger *log, struct node *cmd_info);
+void record_queue(struct node *cmd_info);
+int async_step_cmd(void *ctx, struct async_task *task);
+void task_unlock(struct lock_table *locks, struct async_task *task);
+void epoch_run(void *ctx, struct node *cmd_info);
+int cmd_footprint(struct node *cmd_info, int accounts[EPOCH_MAX_ACCOUNTS], int *writes);
+void lock_trans_stripes(struct lock_table *locks, struct transaction *transactions, int num_transactions, int stripes[10], int num_stripes);
+void lock_profile_report(char *out, int len);
+void print_lock_profile();
+void stats_report(char *out, int len);
 
 // Main thread accepts user input and places commands into command buffer
-// (a linked list). The worker threads that the main thread creates place
-// a lock on this buffer, read a command, execute it, and release the buffer.
-// The worker threads lock user accounts in the array of structs when
-// they carry out TRANS or CHECK commands and may lock more than one account
-// at any given time. If an account that is needed is locked, that thread
-// must wait until the account resource becomes available.
+// (a bounded ring). The worker threads that the main thread creates block
+// on this buffer until a command is available, extract it and execute it.
+// The worker threads lock user accounts in the lock table when they carry
+// out TRANS (exclusive) or CHECK (shared) commands and may lock more than one
+// stripe of accounts at any given time. If an account that is needed is
+// locked by a TRANS, that thread must wait until the account resource
+// becomes available.
 // If the user administers the END command, the main thread waits until
-// all worker threads have completed (linked list will be empty) and exits
+// all worker threads have completed (buffer will be empty) and exits
 // successfully.
 void main(int argc, char **argv)
 {
@@ -80,29 +219,319 @@ void main(int argc, char **argv)
         // Command buffer that main will place user input into and threads
         // will fetch from.
         struct buffer command_buffer;
-        command_buffer.head = NULL; // set linked list to empty
-        int request_id = 1; // The transaction ID given to user
+        char *storage_backend = DEFAULT_STORAGE;
+        int storage_latency_us = DEFAULT_STORAGE_LATENCY_US;
+        int storage_jitter_us = 0;
+        struct logger log;
+        int log_flush_bytes = DEFAULT_LOG_FLUSH_BYTES;
+        int log_flush_ms = DEFAULT_LOG_FLUSH_MS;
+        struct steal_pool steal_pool;
+        struct epoch_sched epoch;
+        struct buffer *inboxes = NULL;
+        struct cross_shard_trans *cross = NULL;
+        int inbox_capacity;
+        int i;
+        int epoch_size = DEFAULT_EPOCH_SIZE;
+        int epoch_us = DEFAULT_EPOCH_US;
+        int buffer_capacity = DEFAULT_BUFFER_CAPACITY;
+        int dispatch_mode = DISPATCH_SHARED;
+        struct lock_table locks;
+        int num_stripes = 0; // 0 means one stripe per account
+        char *wal_path = NULL;
+        int durability = DURABILITY_SYNC;
+        char *snapshot_path = NULL;
+        int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+        int *snapshot_balances;
+        unsigned long snapshot_wal_offset = SNAPSHOT_NO_WAL;
+        int snapshot_found = 0;
+        char *metrics_path = NULL;
+        int metrics_interval_ms = DEFAULT_METRICS_INTERVAL_MS;
+        char report[METRICS_REPORT_LEN];
+        int lock_profile_top = 0; // 0 leaves lock profiling off
+        int cache_size = 0; // 0 leaves the balance cache off
+        unsigned long cache_hits, cache_misses;
+        int request_id; // The transaction ID given to user
         struct pthread_args args;
-        struct timeval tv_begin; // timestamp of when a command begins
+        int no_log = 0; // No output file, results only go to the clients
+        int use_uring = 0; // Log writes and network clients go through io_uring
+        int listen_port = -1; // -1 for no TCP listener
+        char *listen_path = NULL;
+        int async_tasks = 0; // 0 runs one command at a time per worker
+        int lanes = 0; // CHECK and TRANS wait in separate lanes, by deadline
+        int check_budget_ms, trans_budget_ms;
+        long dispatched, late;
+        struct async_worker *async_workers = NULL;
 
         // Prevent keyboard interrupts
         signal(SIGINT, handle_interrupt);
 
-        if (argc != 4) {
+        // Optional flags may appear anywhere on the command line
+        static struct option long_opts[] = {
+                {"queue-capacity", required_argument, NULL, 'q'},
+                {"log-flush-bytes", required_argument, NULL, 'b'},
+                {"log-flush-ms", required_argument, NULL, 'f'},
+                {"storage", required_argument, NULL, 's'},
+                {"cas-fast-path", no_argument, NULL, 'F'},
+                {"lock-stripes", required_argument, NULL, 'l'},
+                {"occ", no_argument, NULL, 'o'},
+                {"combine", no_argument, NULL, 'x'},
+                {"io-threads", required_argument, NULL, 'i'},
+                {"wal", required_argument, NULL, 'w'},
+                {"durability", required_argument, NULL, 'D'},
+                {"snapshot", required_argument, NULL, 'c'},
+                {"snapshot-interval", required_argument, NULL, 'C'},
+                {"metrics-file", required_argument, NULL, 'm'},
+                {"metrics-interval-ms", required_argument, NULL, 'M'},
+                {"lock-profile", required_argument, NULL, 'P'},
+                {"cache-size", required_argument, NULL, 'k'},
+                {"storage-latency-us", required_argument, NULL, 'L'},
+                {"storage-jitter-us", required_argument, NULL, 'J'},
+                {"dispatch", required_argument, NULL, 'd'},
+                {"epoch-size", required_argument, NULL, 'e'},
+                {"epoch-us", required_argument, NULL, 'E'},
+                {"listen-port", required_argument, NULL, 'p'},
+                {"listen-unix", required_argument, NULL, 'u'},
+                {"results", no_argument, NULL, 'r'},
+                {"no-log", no_argument, NULL, 'n'},
+                {"io-uring", no_argument, NULL, 'U'},
+                {"async", required_argument, NULL, 'a'},
+                {"lanes", required_argument, NULL, 'W'},
+                {0, 0, 0, 0}
+        };
+        int opt;
+        while ((opt = getopt_long(argc, argv, "q:d:e:E:a:W:b:f:p:u:rnUs:L:J:Fl:oxi:w:D:c:C:m:M:P:k:", long_opts, NULL)) != -1) {
+                switch (opt) {
+                case 'q':
+                        buffer_capacity = atoi(optarg);
+                        break;
+                case 'b':
+                        log_flush_bytes = atoi(optarg);
+                        break;
+                case 'f':
+                        log_flush_ms = atoi(optarg);
+                        break;
+                case 's':
+                        storage_backend = optarg;
+                        break;
+                case 'L':
+                        storage_latency_us = atoi(optarg);
+                        break;
+                case 'J':
+                        storage_jitter_us = atoi(optarg);
+                        break;
+                case 'F':
+                        cas_fast_path = 1;
+                        break;
+                case 'l':
+                        num_stripes = atoi(optarg);
+                        break;
+                case 'o':
+                        occ = 1;
+                        break;
+                case 'x':
+                        combining = 1;
+                        break;
+                case 'i':
+                        io_threads = atoi(optarg);
+                        break;
+                case 'w':
+                        wal_path = optarg;
+                        break;
+                case 'D':
+                        if (strcmp(optarg, "write") == 0) {
+                                durability = DURABILITY_WRITE;
+                        } else if (strcmp(optarg, "sync") == 0) {
+                                durability = DURABILITY_SYNC;
+                        } else {
+                                argc = -1;
+                        }
+                        break;
+                case 'c':
+                        snapshot_path = optarg;
+                        break;
+                case 'C':
+                        snapshot_interval = atoi(optarg);
+                        break;
+                case 'm':
+                        metrics_path = optarg;
+                        break;
+                case 'M':
+                        metrics_interval_ms = atoi(optarg);
+                        break;
+                case 'P':
+                        lock_profile_top = atoi(optarg);
+                        break;
+                case 'k':
+                        cache_size = atoi(optarg);
+                        break;
+                case 'e':
+                        epoch_size = atoi(optarg);
+                        break;
+                case 'E':
+                        epoch_us = atoi(optarg);
+                        break;
+                case 'a':
+                        async_tasks = atoi(optarg);
+                        break;
+                case 'W':
+                        lanes = 1;
+                        if (sscanf(optarg, "%d:%d", &check_budget_ms, &trans_budget_ms) != 2) {
+                                argc = -1;
+                        }
+                        break;
+                case 'p':
+                        listen_port = atoi(optarg);
+                        break;
+                case 'u':
+                        listen_path = optarg;
+                        break;
+                case 'r':
+                        deliver_results = 1;
+                        break;
+                case 'n':
+                        no_log = 1;
+                        break;
+                case 'U':
+                        use_uring = 1;
+                        break;
+                case 'd':
+                        if (strcmp(optarg, "shared") == 0) {
+                                dispatch_mode = DISPATCH_SHARED;
+                        } else if (strcmp(optarg, "steal") == 0) {
+                                dispatch_mode = DISPATCH_STEAL;
+                        } else if (strcmp(optarg, "epoch") == 0) {
+                                dispatch_mode = DISPATCH_EPOCH;
+                        } else if (strcmp(optarg, "shard") == 0) {
+                                dispatch_mode = DISPATCH_SHARD;
+                        } else {
+                                argc = -1;
+                        }
+                        break;
+                default:
+                        argc = -1; // fall through to the usage message
+                }
+        }
+
+        if (argc - optind != (no_log ? 2 : 3)) {
                 printf("\nAppServer combined server and client program.\n");
                 printf("\nUSAGE: ./appserver <# of worker threads> "
-                       "<# of accounts> <output file>\n\n");
+                       "<# of accounts> <output file> [options]\n"
+                       "       ./appserver <# of worker threads> "
+                       "<# of accounts> --results --no-log [options]\n");
+                printf("\n  -q, --queue-capacity <n>  max commands waiting in "
+                       "the command buffer (default %d)\n",
+                       DEFAULT_BUFFER_CAPACITY);
+                printf("  -d, --dispatch <mode>     shared: one buffer for all "
+                       "workers (default)\n"
+                       "                            steal: a ring per worker "
+                       "with work stealing\n"
+                       "                            epoch: batches run in "
+                       "deterministic lock-free waves\n"
+                       "                            shard: each worker owns "
+                       "a shard of the accounts\n");
+                printf("  -e, --epoch-size <n>      most commands in one epoch "
+                       "(default %d)\n"
+                       "  -E, --epoch-us <n>        longest wait to fill an "
+                       "epoch (default %d)\n",
+                       DEFAULT_EPOCH_SIZE, DEFAULT_EPOCH_US);
+                printf("  -a, --async <n>           keep up to n commands in "
+                       "flight per worker, each\n"
+                       "                            waiting on locks and "
+                       "storage without blocking\n"
+                       "                            (default 0, off; shared "
+                       "dispatcher only)\n");
+                printf("  -W, --lanes <c>:<t>       queue CHECK and TRANS "
+                       "separately, earliest deadline\n"
+                       "                            first; a command without "
+                       "DEADLINE <ms> has c\n"
+                       "                            (CHECK) or t (TRANS) ms "
+                       "(shared dispatcher only)\n");
+                printf("  -b, --log-flush-bytes <n> write the log once this "
+                       "many bytes are pending (default %d)\n"
+                       "  -f, --log-flush-ms <n>    write pending log lines at "
+                       "least this often (default %d)\n",
+                       DEFAULT_LOG_FLUSH_BYTES, DEFAULT_LOG_FLUSH_MS);
+                printf("  -p, --listen-port <port>  also accept commands from "
+                       "TCP clients on this port\n"
+                       "  -u, --listen-unix <path>  also accept commands from "
+                       "clients on this Unix socket\n");
+                printf("  -r, --results             also send each result to "
+                       "the client (or stdin)\n"
+                       "                            that submitted the "
+                       "command\n"
+                       "  -n, --no-log              don't write an output "
+                       "file, needs --results\n");
+                printf("  -U, --io-uring            write the log and serve "
+                       "network clients through\n"
+                       "                            io_uring when the kernel "
+                       "has it\n");
+                printf("  -s, --storage <backend>   where balances are kept "
+                       "(default %s)\n", DEFAULT_STORAGE);
+                storage_print_backends();
+                printf("  -L, --storage-latency-us <n>  latency backend delay "
+                       "per access (default %d)\n"
+                       "  -J, --storage-jitter-us <n>   latency backend extra "
+                       "random delay (default 0)\n", DEFAULT_STORAGE_LATENCY_US);
+                printf("  -F, --cas-fast-path       apply single-account TRANS "
+                       "with compare-and-swap\n"
+                       "                            instead of locking "
+                       "(needs --storage atomic,\n"
+                       "                            off with --wal)\n");
+                printf("  -l, --lock-stripes <n>    number of account locks, "
+                       "1 locks the whole bank\n"
+                       "                            (default one per account)\n");
+                printf("  -P, --lock-profile <k>    profile account lock "
+                       "contention; LOCKS and END\n"
+                       "                            list the top k accounts "
+                       "(default off)\n");
+                printf("  -o, --occ                 run TRANS optimistically: "
+                       "read without locks,\n"
+                       "                            lock only to validate "
+                       "and commit\n"
+                       "                            (needs --storage atomic)\n");
+                printf("  -x, --combine             apply queued single-account "
+                       "TRANS on one account\n"
+                       "                            together, one read and "
+                       "one write per batch\n");
+                printf("  -i, --io-threads <n>      threads that read and write "
+                       "the accounts of a\n"
+                       "                            TRANS concurrently "
+                       "(default 0, one by one)\n");
+                printf("  -k, --cache-size <n>      cache up to n balances in "
+                       "front of storage,\n"
+                       "                            written through by TRANS "
+                       "(default 0, off)\n");
+                printf("  -w, --wal <path>          log committed TRANS to a "
+                       "write-ahead log, replayed\n"
+                       "                            at startup\n"
+                       "  -D, --durability <level>  write: WAL handed to the "
+                       "kernel before OK\n"
+                       "                            sync: WAL fdatasync'd "
+                       "before OK (default)\n");
+                printf("  -c, --snapshot <path>     snapshot every balance to "
+                       "this file, and start\n"
+                       "                            from it if it exists\n"
+                       "  -C, --snapshot-interval <s>  seconds between "
+                       "snapshots, 0 only at END\n"
+                       "                            (default %d)\n",
+                       DEFAULT_SNAPSHOT_INTERVAL);
+                printf("  -m, --metrics-file <path> keep the STATS metrics in "
+                       "this file, in the\n"
+                       "                            Prometheus text format\n"
+                       "  -M, --metrics-interval-ms <n>  how often the file is "
+                       "rewritten (default %d)\n",
+                       DEFAULT_METRICS_INTERVAL_MS);
+                printf("\n");
                 exit(EXIT_FAILURE);
         }
 
         // Fetch and store command-line arguments
-        num_workerthreads = atoi(argv[1]);
-        num_accts = atoi(argv[2]);
-        strncpy(output_filename, argv[3], sizeof(argv[3]));
-
-        // Create file so users can start tailing immediately
-        FILE *fp = fopen(output_filename, "a");
-        fclose(fp);
+        num_workerthreads = atoi(argv[optind]);
+        num_accts = atoi(argv[optind + 1]);
+        if (!no_log) {
+                strncpy(output_filename, argv[optind + 2], sizeof(output_filename) - 1);
+                output_filename[sizeof(output_filename) - 1] = '\0';
+        }
 
         if (num_workerthreads < 1) {
                 printf("\nWorker threads must be at least 1 or more."
@@ -112,269 +541,1226 @@ void main(int argc, char **argv)
                 printf("\nNumber of accounts must be at least 1 or more."
                        " Exiting.\n\n");
                 exit(EXIT_FAILURE);
+        } else if (buffer_capacity < 1) {
+                printf("\nQueue capacity must be at least 1 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (log_flush_bytes < 1 || log_flush_bytes > LOG_MAX_FLUSH_BYTES ||
+                   log_flush_ms < 0) {
+                printf("\nLog flush bytes must be between 1 and %d and flush "
+                       "interval 0 or more. Exiting.\n\n", LOG_MAX_FLUSH_BYTES);
+                exit(EXIT_FAILURE);
+        } else if (storage_latency_us < 0 || storage_jitter_us < 0 ||
+                   storage_select(storage_backend, storage_latency_us,
+                                  storage_jitter_us) == 0) {
+                printf("\nUnknown storage backend or negative latency."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (io_threads < 0) {
+                printf("\nI/O threads must be 0 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (num_stripes < 0) {
+                printf("\nLock stripes must be at least 1 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (epoch_size < 1 || epoch_us < 0) {
+                printf("\nEpoch size must be at least 1 and epoch wait 0 "
+                       "or more. Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if ((dispatch_mode == DISPATCH_EPOCH || dispatch_mode == DISPATCH_SHARD) &&
+                   (cas_fast_path || occ)) {
+                printf("\nThe epoch and shard dispatchers run TRANS without "
+                       "locks and can't be\ncombined with --cas-fast-path or "
+                       "--occ. Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (combining && (cas_fast_path || occ ||
+                                 dispatch_mode == DISPATCH_EPOCH ||
+                                 dispatch_mode == DISPATCH_SHARD)) {
+                printf("\nCombining needs the account locks and can't be "
+                       "combined with --cas-fast-path,\n--occ or the epoch "
+                       "and shard dispatchers. Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (cache_size < 0) {
+                printf("\nCache size must be 0 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (cache_size > 0 && (cas_fast_path || occ)) {
+                printf("\nThe balance cache is only kept coherent under the "
+                       "account locks and can't be\ncombined with "
+                       "--cas-fast-path or --occ. Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (lock_profile_top < 0) {
+                printf("\nLock profile top accounts must be 0 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (metrics_interval_ms < 1) {
+                printf("\nMetrics interval must be at least 1 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (snapshot_interval < 0) {
+                printf("\nSnapshot interval must be 0 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (cas_fast_path && !storage_has_cas()) {
+                printf("\nThe CAS fast path needs --storage atomic."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (occ && !storage_has_cas()) {
+                // OCC reads balances while locked TRANS write them; only the
+                // atomic backend makes those unlocked reads well defined
+                printf("\n--occ needs --storage atomic."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (cas_fast_path && occ) {
+                printf("\nThe CAS fast path and --occ can't be combined."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (no_log && !deliver_results) {
+                printf("\n--no-log needs --results, or no result would be "
+                       "reported anywhere. Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (async_tasks < 0) {
+                printf("\nAsync commands in flight must be 0 or more."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (async_tasks > 0 && (dispatch_mode != DISPATCH_SHARED ||
+                                       cas_fast_path || occ || combining ||
+                                       io_threads > 0 || lock_profile_top > 0)) {
+                printf("\n--async runs commands under the account locks from "
+                       "the shared buffer and can't\nbe combined with the "
+                       "steal, epoch or shard dispatchers, --cas-fast-path,\n"
+                       "--occ, --combine, --io-threads or --lock-profile. "
+                       "Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (async_tasks > 0 && !storage_can_defer()) {
+                printf("\n--async needs a backend whose latency it can wait "
+                       "out itself: memory,\nlatency or atomic (--storage "
+                       "latency -L 100000 models Bank.c). Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (lanes && (check_budget_ms < 0 || trans_budget_ms < 0 ||
+                             check_budget_ms > MAX_DEADLINE_MS ||
+                             trans_budget_ms > MAX_DEADLINE_MS)) {
+                printf("\nLane deadlines must be between 0 and %d ms."
+                       " Exiting.\n\n", MAX_DEADLINE_MS);
+                exit(EXIT_FAILURE);
+        } else if (lanes && dispatch_mode != DISPATCH_SHARED) {
+                printf("\nLanes reorder the shared command buffer and can't be "
+                       "combined with the steal,\nepoch or shard dispatchers, "
+                       "which rely on request ID order. Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        } else if (listen_port != -1 && (listen_port < 1 || listen_port > 65535)) {
+                printf("\nListen port must be between 1 and 65535."
+                       " Exiting.\n\n");
+                exit(EXIT_FAILURE);
+        }
+
+        // Open the log now so users can start tailing immediately
+        if (logger_init(&log, no_log ? NULL : output_filename, log_flush_bytes,
+                        log_flush_ms, use_uring) == 0) {
+                perror("Failed to open output file.");
+                exit(EXIT_FAILURE);
         }
 
         printf("Number of worker threads: %d\n", num_workerthreads);
         printf("Number of accounts: %d\n", num_accts);
-        getcwd(cwd, sizeof(cwd));
-        printf("Log location: %s/%s\n", cwd, output_filename);
+        printf("Storage backend: %s\n", storage_name());
+        if (num_stripes == 0 || num_stripes > num_accts) {
+                num_stripes = num_accts;
+        }
+        printf("Account lock stripes: %d\n", num_stripes);
+        if (no_log) {
+                printf("Log location: none, results are only sent to clients\n");
+        } else {
+                getcwd(cwd, sizeof(cwd));
+                printf("Log location: %s/%s\n", cwd, output_filename);
+                if (use_uring) {
+                        printf("Log writes: %s\n", log.use_uring ? "io_uring" :
+                               "write(), io_uring is unavailable");
+                }
+        }
 
-        printf("\nInitializing bank accounts.\n");
-        if (initialize_accounts(num_accts) == 0) {
-                perror("Failed to init bank accounts.");
+        if (snapshot_path != NULL) {
+                snapshot_found = snapshot_map(snapshot_path, num_accts,
+                                              &snapshot_balances,
+                                              &snapshot_wal_offset);
+                if (snapshot_found < 0) {
+                        perror("Failed to map snapshot.");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (snapshot_found) {
+                printf("\nInitializing bank accounts from snapshot %s\n",
+                       snapshot_path);
+                if (storage_initialize_from(snapshot_balances, num_accts) == 0) {
+                        perror("Failed to init bank accounts.");
+                        exit(EXIT_FAILURE);
+                }
+        } else {
+                printf("\nInitializing bank accounts.\n");
+                if (storage_initialize(num_accts) == 0) {
+                        perror("Failed to init bank accounts.");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (wal_path != NULL && snapshot_found &&
+            snapshot_wal_offset == SNAPSHOT_NO_WAL) {
+                // Its balances may already include any TRANS in the WAL
+                fprintf(stderr, "Snapshot %s was taken without --wal, so it "
+                        "can't be used with one.\n", snapshot_path);
                 exit(EXIT_FAILURE);
         }
+        if (wal_path != NULL) {
+                if (!snapshot_found) {
+                        snapshot_wal_offset = 0;
+                }
+                printf("Recovering bank accounts from %s\n", wal_path);
+                if (wal_open(&wal, wal_path, durability, num_accts,
+                             snapshot_wal_offset) == 0) {
+                        perror("Failed to open write-ahead log.");
+                        exit(EXIT_FAILURE);
+                }
+                wal_enabled = 1;
+                // A CAS publishes the balance before it could be logged, so
+                // with the WAL every TRANS takes the locked path
+                if (cas_fast_path) {
+                        printf("CAS fast path: off, --wal logs every TRANS "
+                               "before applying it\n");
+                        cas_fast_path = 0;
+                }
+        }
+        if (snapshot_path != NULL) {
+                if (snapshot_start(&snapshotter, snapshot_path, num_accts,
+                                   snapshot_interval,
+                                   wal_enabled ? &wal : NULL,
+                                   snapshot_wal_offset) == 0) {
+                        perror("Failed to start snapshots.");
+                        exit(EXIT_FAILURE);
+                }
+                snapshots_enabled = 1;
+        }
+        if (cache_size > 0) {
+                if (storage_cache_init(cache_size) == 0) {
+                        perror("Failed to init balance cache.");
+                        exit(EXIT_FAILURE);
+                }
+                printf("Balance cache: %lu accounts\n", storage_cache_size());
+        }
+
+        if (dispatch_mode == DISPATCH_SHARD) {
+                inbox_capacity = buffer_capacity / num_workerthreads;
+                if (inbox_capacity < 1) {
+                        inbox_capacity = 1;
+                }
+                printf("Initializing %d shard inboxes (capacity %d)\n",
+                       num_workerthreads, inbox_capacity);
+                inboxes = (struct buffer*)malloc(sizeof(struct buffer) * num_workerthreads);
+                for (i = 0; i < num_workerthreads; i++) {
+                        if (inboxes == NULL ||
+                            buffer_init(&inboxes[i], inbox_capacity) == 0) {
+                                perror("Failed to init shard inboxes.");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+        } else if (dispatch_mode == DISPATCH_STEAL) {
+                printf("Initializing %d work-stealing rings (capacity %d)\n",
+                       num_workerthreads, buffer_capacity);
+                if (steal_init(&steal_pool, num_workerthreads, buffer_capacity) == 0) {
+                        perror("Failed to init work-stealing rings.");
+                        exit(EXIT_FAILURE);
+                }
+        } else if (lanes) {
+                printf("Initializing CHECK and TRANS lanes (capacity %d each, "
+                       "deadlines %d and %d ms)\n", buffer_capacity,
+                       check_budget_ms, trans_budget_ms);
+                if (buffer_init_lanes(&command_buffer, buffer_capacity,
+                                      check_budget_ms, trans_budget_ms) == 0) {
+                        perror("Failed to init command lanes.");
+                        exit(EXIT_FAILURE);
+                }
+        } else {
+                printf("Initializing command buffer (capacity %d)\n", buffer_capacity);
+                if (buffer_init(&command_buffer, buffer_capacity) == 0) {
+                        perror("Failed to init command buffer.");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        if (io_threads > 0) {
+                printf("Spinning up %d I/O threads\n", io_threads);
+                if (io_pool_init(&io_pool, io_threads) == 0) {
+                        perror("Failed to start I/O threads.");
+                        exit(EXIT_FAILURE);
+                }
+        }
 
-        printf("Initializing command buffer mutex\n");
-        if (pthread_mutex_init(&buffer_lock, NULL) != 0) {
-                perror("Failed to init command buffer mutex.");
+        if (metrics_init(&metrics, num_workerthreads) == 0) {
+                perror("Failed to init metrics.");
                 exit(EXIT_FAILURE);
         }
+        if (metrics_path != NULL) {
+                printf("Writing metrics to %s every %d ms\n", metrics_path,
+                       metrics_interval_ms);
+                if (metrics_start_dump(&metrics, metrics_path, metrics_interval_ms) == 0) {
+                        perror("Failed to start metrics file.");
+                        exit(EXIT_FAILURE);
+                }
+        }
 
         printf("Spinning up worker threads\n");
-        int i = 0;
+        i = 0;
+        args.dispatch_mode = dispatch_mode;
         args.cmd_buf = &command_buffer;
-        args.running = &running;
-        args.accounts = (struct account*)malloc(sizeof(struct account)*num_accts);
-        strcpy(args.log_filename, output_filename);
+        args.steal_pool = &steal_pool;
+        args.epoch = &epoch;
+        args.inboxes = inboxes;
+        args.async_workers = NULL;
+        args.num_shards = num_workerthreads;
+        if (init_lock_table(&locks, num_stripes) == 0) {
+                perror("Failed to init account locks.");
+                exit(EXIT_FAILURE);
+        }
+        if (occ) {
+                locks.versions = (atomic_uint*)calloc(num_accts, sizeof(atomic_uint));
+                if (locks.versions == NULL) {
+                        perror("Failed to init account versions.");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (lock_profile_top > 0) {
+                if (lockprof_init(&lock_profile, num_accts, lock_profile_top) == 0) {
+                        perror("Failed to init lock profile.");
+                        exit(EXIT_FAILURE);
+                }
+                lock_profiling = 1;
+        }
+        args.locks = &locks;
+        args.log = &log;
+        args.num_accts = num_accts;
+        args.next_request_id = 1;
+        args.closed = 0;
+        atomic_init(&args.cross_free, NULL);
+        pthread_mutex_init(&args.submit_lock, NULL);
+        if (dispatch_mode == DISPATCH_EPOCH) {
+                printf("Starting epoch scheduler (up to %d commands or %d us "
+                       "per epoch)\n", epoch_size, epoch_us);
+                if (epoch_init(&epoch, &command_buffer, num_accts, epoch_size,
+                               epoch_us, cmd_footprint, epoch_run, &args) == 0) {
+                        perror("Failed to start epoch scheduler.");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (async_tasks > 0) {
+                printf("Keeping up to %d commands in flight per worker\n",
+                       async_tasks);
+                async_workers = (struct async_worker*)malloc(sizeof(struct async_worker) * num_workerthreads);
+                for (i = 0; i < num_workerthreads; i++) {
+                        if (async_workers == NULL ||
+                            async_init(&async_workers[i], &command_buffer, async_tasks,
+                                       async_step_cmd, &args) == 0) {
+                                perror("Failed to init async workers.");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                args.async_workers = async_workers;
+        }
         pthread_t thread_ids[num_workerthreads];
+        struct worker_args workers[num_workerthreads];
         for (i = 0; i < num_workerthreads; i++) {
+                workers[i].id = i;
+                workers[i].shared = &args;
                 if (pthread_create(&thread_ids[i], NULL, thread_routine,
-                                (void *) &args) != 0) {
+                                (void *) &workers[i]) != 0) {
                         perror("pthread_create() error");
                         exit(EXIT_FAILURE);
                 }
         }
 
+        if (listen_port > 0) {
+                printf("Listening for clients on TCP port %d\n", listen_port);
+                if (net_listen_tcp(&net, listen_port, net_submit, net_submit_binary, &args,
+                                   use_uring) == 0) {
+                        perror("Failed to start network listener.");
+                        exit(EXIT_FAILURE);
+                }
+        } else if (listen_path != NULL) {
+                printf("Listening for clients on %s\n", listen_path);
+                if (net_listen_unix(&net, listen_path, net_submit, net_submit_binary, &args,
+                                    use_uring) == 0) {
+                        perror("Failed to start network listener.");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (use_uring && (listen_port > 0 || listen_path != NULL)) {
+                printf("Network clients: %s\n", net.use_uring ? "io_uring" :
+                       "epoll, io_uring is unavailable");
+        }
+
         printf("Ready to accept input.\n");
 
         // Accept user commands and add them to the command buffer
         while (running) {
                 printf("%s", PROMPT);
-                fgets(user_input, MAX_CMD_LEN, stdin);
-                check_input(user_input);
+                if (fgets(user_input, MAX_CMD_LEN, stdin) == NULL) {
+                        // stdin was closed, nothing more can arrive from it
+                        strcpy(user_input, "END");
+                }
                 // Remove newline character at end of user input from stdin
-                user_input[strlen(user_input) - 1] = '\0';
-                int valid_input = check_input(user_input);
-
-                if (valid_input > 0) {
-                        // Get the time that we received this command (start)
-                        gettimeofday(&tv_begin, NULL);
-                        if (valid_input == 1) {
-                                // CHECK
-                                int acc_to_check = parse_check_cmd(user_input);
-                                if (acc_to_check > num_accts || acc_to_check < 1) {
-                                        printf("Invalid account number.\n");
-                                } else {
-                                        add_cmd(&command_buffer, user_input, request_id, tv_begin);
-                                        printf("%sID %d\n", OUTPUT, request_id);
-                                        request_id++; // increment transaction id for next command
-                                }
-                        } else {
-                                // TRANS
-                                struct transaction *transactions = (struct transaction*)malloc(sizeof(struct transaction)*10);
-                                int num_transactions = parse_trans_cmd(user_input, transactions);
-
-                                int i = 0;
-                                int isValidTransaction = 1;
-                                while (i < num_transactions) {
-                                        if (transactions[i].account_number >
-                                            num_accts ||
-                                            transactions[i].account_number < 1)
-                                        {
-                                                isValidTransaction = 0;
-                                        }
-                                        i++;
-                                }
-                                if (isValidTransaction) {
-                                        add_cmd(&command_buffer, user_input, request_id, tv_begin);
-                                        printf("%sID %d\n", OUTPUT, request_id);
-                                        request_id++; // increment transaction id for next command
-                                } else {
-                                        printf("Transaction failed, contained invalid account number.\n");
-                                }
-                                free(transactions);
-                        }
-                } else if (strncmp(user_input, "END", 3) == 0) {
+                user_input[strcspn(user_input, "\n")] = '\0';
+
+                switch (submit_cmd(&args, user_input, NULL, &request_id)) {
+                case SUBMIT_QUEUED:
+                        printf("%sID %d\n", OUTPUT, request_id);
+                        break;
+                case SUBMIT_BAD_CHECK:
+                        printf("Invalid account number.\n");
+                        break;
+                case SUBMIT_BAD_TRANS:
+                        printf("Transaction failed, contained invalid account number.\n");
+                        break;
+                case SUBMIT_STATS:
+                        stats_report(report, sizeof(report));
+                        printf("%s\n", report);
+                        break;
+                case SUBMIT_LOCKS:
+                        print_lock_profile();
+                        break;
+                case SUBMIT_END:
                         running = 0; // stop all new commands
                         printf("Waiting for all threads to finish and "
                                "exiting.\n");
-                } else {
+                        break;
+                default:
                         printf("%sNot a valid command. Accepts CHECK, TRANS,"
-                               " and END.\n", OUTPUT);
+                               " STATS, LOCKS and END.\n", OUTPUT);
                 }
         }
 
+        // Network clients may still be sending: refuse anything that comes
+        // after this, so no command is queued once the buffer is closed
+        pthread_mutex_lock(&args.submit_lock);
+        args.closed = 1;
+        pthread_mutex_unlock(&args.submit_lock);
+
+        // No more commands are coming; workers drain the buffer and exit.
+        if (dispatch_mode == DISPATCH_SHARD) {
+                for (i = 0; i < num_workerthreads; i++) {
+                        buffer_close(&inboxes[i]);
+                }
+        } else if (dispatch_mode == DISPATCH_STEAL) {
+                steal_close(&steal_pool);
+        } else {
+                buffer_close(&command_buffer);
+        }
+
         // Wait (blocks) for worker threads to finish before exiting program.
         for (i = 0; i < num_workerthreads; i++) {
                 pthread_join(thread_ids[i], NULL);
         }
+        // Every result is posted; send them before disconnecting the clients
+        if (listen_port > 0 || listen_path != NULL) {
+                net_stop(&net);
+        }
 
-        free(args.accounts);
+        // Every worker has logged its last line; flush them to the file
+        logger_close(&log);
+        if (snapshots_enabled) {
+                snapshot_stop(&snapshotter);
+        }
+        if (io_threads > 0) {
+                io_pool_destroy(&io_pool);
+        }
+        if (wal_enabled) {
+                wal_close(&wal);
+        }
+
+        if (cas_fast_path) {
+                printf("TRANS lock-free path: %ld, locked path: %ld "
+                       "(%ld fell back from lock-free)\n",
+                       atomic_load(&trans_cas_count), atomic_load(&trans_locked_count),
+                       atomic_load(&trans_cas_fallbacks));
+        }
+        if (combining) {
+                printf("TRANS combined: %ld in %ld batches (%.1f per batch)\n",
+                       atomic_load(&combine_requests), atomic_load(&combine_batches),
+                       atomic_load(&combine_batches) ?
+                       (double) atomic_load(&combine_requests) / atomic_load(&combine_batches) : 0.0);
+        }
+        if (occ) {
+                printf("OCC commits: %ld, aborts: %ld, fell back to locking: %ld\n",
+                       atomic_load(&occ_commits), atomic_load(&occ_aborts),
+                       atomic_load(&occ_fallbacks));
+        }
+        if (storage_cache_size() > 0) {
+                storage_cache_stats(&cache_hits, &cache_misses);
+                printf("Balance cache hits: %lu, misses: %lu (%.1f%% hit)\n",
+                       cache_hits, cache_misses, cache_hits + cache_misses ?
+                       100.0 * cache_hits / (cache_hits + cache_misses) : 0.0);
+        }
+        if (lock_profiling) {
+                print_lock_profile();
+                lockprof_destroy(&lock_profile);
+        }
+        if (async_workers != NULL) {
+                async_report(async_workers, num_workerthreads);
+                for (i = 0; i < num_workerthreads; i++) {
+                        async_destroy(&async_workers[i]);
+                }
+                free(async_workers);
+        }
+
+        if (dispatch_mode == DISPATCH_SHARD) {
+                for (i = 0; i < num_workerthreads; i++) {
+                        buffer_destroy(&inboxes[i]);
+                }
+                free(inboxes);
+                while ((cross = atomic_load(&args.cross_free)) != NULL) {
+                        atomic_store(&args.cross_free, cross->next);
+                        pthread_cond_destroy(&cross->changed);
+                        pthread_mutex_destroy(&cross->lock);
+                        free(cross);
+                }
+        } else if (dispatch_mode == DISPATCH_STEAL) {
+                printf("Commands stolen by idle workers: %ld\n",
+                       steal_count(&steal_pool));
+                steal_destroy(&steal_pool);
+        } else {
+                if (dispatch_mode == DISPATCH_EPOCH) {
+                        epoch_destroy(&epoch);
+                }
+                if (lanes) {
+                        buffer_lane_stats(&command_buffer, LANE_CHECK, &dispatched, &late);
+                        printf("CHECK lane: %ld dispatched, %ld past their "
+                               "deadline\n", dispatched, late);
+                        buffer_lane_stats(&command_buffer, LANE_TRANS, &dispatched, &late);
+                        printf("TRANS lane: %ld dispatched, %ld past their "
+                               "deadline\n", dispatched, late);
+                }
+                buffer_destroy(&command_buffer);
+        }
+
+        destroy_lock_table(&locks);
+        metrics_destroy(&metrics);
 
         exit(EXIT_SUCCESS);
 }
 
-// Returns 1 if CHECK command, 2 if TRANS command, -1 otherwise
-int check_input(char *user_in)
+// Validates one line of input and, if it is a CHECK or TRANS on existing
+// accounts, assigns it the next request ID (stored in request_id) and hands
+// it to the workers; client is where its result goes, NULL for stdin.
+// Returns one of the SUBMIT_ codes.
+// Safe to call from the main thread and the network listener at once.
+int submit_cmd(struct pthread_args *args, char *user_input, struct client *client, int *request_id)
 {
-        if (strncmp(user_in, "CHECK ", 6) == 0) {
-                return 1;
-        } else if (strncmp(user_in, "TRANS ", 6) == 0) {
-                return 2;
-        } else {
-                // disallowed request
-                return -1;
+        struct command cmd;
+        struct timeval tv_begin; // timestamp of when a command begins
+
+        // Get the time that we received this command (start)
+        gettimeofday(&tv_begin, NULL);
+        if (command_parse(user_input, &cmd) < 0) {
+                if (strncmp(user_input, "END", 3) == 0) {
+                        return SUBMIT_END;
+                } else if (strcmp(user_input, "STATS") == 0) {
+                        return SUBMIT_STATS;
+                } else if (strcmp(user_input, "LOCKS") == 0) {
+                        return SUBMIT_LOCKS;
+                }
+                return SUBMIT_INVALID;
         }
+        return submit_command(args, &cmd, tv_begin, client, 0, request_id);
 }
 
-// Returns account number to check
-int parse_check_cmd(char *cmd)
+// Checks that every account of an already parsed CHECK or TRANS exists and
+// hands it to the workers as is, like submit_cmd. The result goes back to
+// client (NULL for stdin) with tag. Returns SUBMIT_QUEUED, SUBMIT_BAD_CHECK,
+// SUBMIT_BAD_TRANS or, once END was given on stdin, SUBMIT_CLOSED.
+int submit_command(struct pthread_args *args, struct command *cmd, struct timeval tv_begin, struct client *client, unsigned int tag, int *request_id)
 {
-        // Parse command for account number
-        int begin = 6;
-        int end = 6;
-        while(cmd[end] != '\0' && cmd[end] != ' ') {
-                end++;
+        struct node cmd_info;
+        int i;
+
+        for (i = 0; i < cmd->num_transactions; i++) {
+                if (cmd->transactions[i].account_number > args->num_accts ||
+                    cmd->transactions[i].account_number < 1) {
+                        return cmd->op == CMD_CHECK ? SUBMIT_BAD_CHECK : SUBMIT_BAD_TRANS;
+                }
         }
-        char num[(end-begin) + 1];
-        char *begin_arr = &cmd[begin];
-        strncpy((char *) num, begin_arr, (end-begin) + 1);
 
-        return atoi(num);
+        cmd_info.cmd = *cmd;
+        cmd_info.tv_begin = tv_begin;
+        cmd_info.ctx = NULL;
+        cmd_info.client = client;
+        cmd_info.tag = tag;
+        pthread_mutex_lock(&args->submit_lock);
+        if (args->closed) {
+                pthread_mutex_unlock(&args->submit_lock);
+                return SUBMIT_CLOSED;
+        }
+        *request_id = cmd_info.request_id = args->next_request_id++;
+        metrics_submitted(&metrics);
+        dispatch_cmd(args, &cmd_info);
+        pthread_mutex_unlock(&args->submit_lock);
+
+        return SUBMIT_QUEUED;
 }
 
-void check(struct account *accs, char *cmd, char *log_filename, struct timeval tv_begin, int request_id)
+// net_handler for network clients: same commands and replies as stdin,
+// except END only ends that client's connection.
+int net_submit(void *ctx, struct client *client, char *line, char *reply, int reply_len)
 {
-        FILE *fp;
-        int account_num = parse_check_cmd(cmd);
+        struct pthread_args *args = (struct pthread_args*) ctx;
+        int request_id;
 
-        pthread_mutex_lock(&accs[account_num - 1].lock);
-        int amount = read_account(account_num);
-        // Time that this command finishes
-        struct timeval tv_end;
-        gettimeofday(&tv_end, NULL);
-        // Append to logfile
-        fp = fopen(log_filename, "a");
-        fprintf(fp, "%d BAL %d TIME %ld.%06ld %ld.%06ld\n", request_id, amount, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
-        fclose(fp);
-        pthread_mutex_unlock(&accs[account_num - 1].lock);
+        switch (submit_cmd(args, line, client, &request_id)) {
+        case SUBMIT_QUEUED:
+                if (deliver_results) {
+                        net_expect_result(client);
+                }
+                snprintf(reply, reply_len, "ID %d", request_id);
+                return 0;
+        case SUBMIT_BAD_CHECK:
+                snprintf(reply, reply_len, "Invalid account number.");
+                return 0;
+        case SUBMIT_BAD_TRANS:
+                snprintf(reply, reply_len, "Transaction failed, contained "
+                         "invalid account number.");
+                return 0;
+        case SUBMIT_STATS:
+                stats_report(reply, reply_len);
+                return 0;
+        case SUBMIT_LOCKS:
+                lock_profile_report(reply, reply_len);
+                return 0;
+        case SUBMIT_END:
+                snprintf(reply, reply_len, "Goodbye.");
+                return -1;
+        case SUBMIT_CLOSED:
+                snprintf(reply, reply_len, "Server is shutting down.");
+                return -1;
+        default:
+                snprintf(reply, reply_len, "Not a valid command. Accepts "
+                         "CHECK, TRANS, STATS, LOCKS and END.");
+                return 0;
+        }
 }
 
-// Returns pointer to array of SORTED (lowest acc num to highest) transaction structs
-int parse_trans_cmd(char *cmd, struct transaction transactions[10])
+// net_binary_handler for clients speaking the binary protocol: CHECK and
+// TRANS are submitted without any text parsing and acknowledged with their
+// request ID, END closes the connection
+int net_submit_binary(void *ctx, struct client *client, unsigned char *frame, unsigned char reply[WIRE_RESPONSE_LEN])
 {
-        // Need to pull account numbers out
-        int numbers[20];
-        int count = 0;
-        int begin = 6;
-        int end = 6;
+        struct pthread_args *args = (struct pthread_args*) ctx;
+        struct wire_response response;
+        struct command cmd;
+        struct timeval tv_begin;
+        int op = wire_decode_request(frame, &cmd, &response.tag);
+        int submitted;
+
+        gettimeofday(&tv_begin, NULL);
+        response.op = op < 0 ? frame[2] : op;
+        response.request_id = 0;
+        response.value = 0;
+        response.begin_us = tv_begin.tv_sec * 1000000L + tv_begin.tv_usec;
+        response.end_us = 0;
+        if (op == WIRE_END) {
+                response.result = WIRE_OK;
+        } else if (op < 0) {
+                response.result = WIRE_INVALID;
+        } else if ((submitted = submit_command(args, &cmd, tv_begin, client, response.tag,
+                                               &response.request_id)) == SUBMIT_QUEUED) {
+                response.result = WIRE_QUEUED;
+                if (deliver_results) {
+                        net_expect_result(client);
+                }
+        } else if (submitted == SUBMIT_CLOSED) {
+                response.result = WIRE_CLOSED;
+        } else {
+                response.result = WIRE_BAD_ACCOUNT;
+        }
+        wire_encode_response(&response, reply);
+        return op == WIRE_END || response.result == WIRE_CLOSED ? -1 : 0;
+}
+
+// Allocates num_stripes cache-line aligned stripes and initializes their
+// reader/writer locks. Returns 1 if succeeded, 0 if error.
+int init_lock_table(struct lock_table *locks, int num_stripes)
+{
+        pthread_rwlockattr_t attr;
+        int i;
 
-        int cmd_len = strlen(cmd);
+        locks->stripes = (struct lock_stripe*)aligned_alloc(CACHE_LINE,
+                        sizeof(struct lock_stripe)*num_stripes);
+        if (locks->stripes == NULL) {
+                return 0;
+        }
+        locks->num_stripes = num_stripes;
+        locks->versions = NULL;
 
-        while (end < cmd_len) {
-                while (cmd[end] != ' ' && cmd[end] != '\0') {
-                        end++;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr,
+                        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        for (i = 0; i < num_stripes; i++) {
+                atomic_init(&locks->stripes[i].pending, NULL);
+                if (pthread_rwlock_init(&locks->stripes[i].lock, &attr) != 0) {
+                        pthread_rwlockattr_destroy(&attr);
+                        return 0;
                 }
-                char num[(end-begin) + 1];
-                char *begin_arr = &cmd[begin];
-                strncpy((char *) num, begin_arr, (end-begin) + 1);
-                numbers[count] = atoi(num);
+        }
+        pthread_rwlockattr_destroy(&attr);
+        return 1;
+}
+
+void destroy_lock_table(struct lock_table *locks)
+{
+        int i;
+
+        for (i = 0; i < locks->num_stripes; i++) {
+                pthread_rwlock_destroy(&locks->stripes[i].lock);
+        }
+        free(locks->stripes);
+        free(locks->versions);
+}
+
+// Returns the lock guarding the given account
+pthread_rwlock_t *account_lock(struct lock_table *locks, int account_number)
+{
+        return &locks->stripes[(account_number - 1) % locks->num_stripes].lock;
+}
 
-                // Reset for the next number to extract
+// Fills stripes with the distinct stripes touched by a TRANS in ascending
+// order, the order they must be locked in. Returns how many there are.
+int trans_stripes(struct lock_table *locks, struct transaction *transactions, int num_transactions, int stripes[10])
+{
+        int count = 0;
+        int i, j, stripe;
+
+        for (i = 0; i < num_transactions; i++) {
+                stripe = (transactions[i].account_number - 1) % locks->num_stripes;
+                // Insertion sort, skipping stripes already in the list
+                for (j = count; j > 0 && stripes[j - 1] > stripe; j--) {
+                }
+                if (j > 0 && stripes[j - 1] == stripe) {
+                        continue;
+                }
+                memmove(&stripes[j + 1], &stripes[j], sizeof(int) * (count - j));
+                stripes[j] = stripe;
                 count++;
-                end += 1;
-                begin = end;
         }
+        return count;
+}
 
-        int i = 0;
-        int trans_counter = 0;
-
-        // Set the upper limit to 10 transactions...
-        if (count > 20) {
-                count = 20;
-        }
-        for (i = 0; i < count; i += 2) {
-                transactions[trans_counter].account_number = numbers[i];
-                transactions[trans_counter].value = numbers[i+1];
-                trans_counter++;
-        }
-
-        // Need to sort the struct array smallest account_number to biggest
-        int j;
-        struct transaction temp;
-        for (i = 0; i < trans_counter; i++) {
-                for (j = i + 1; j < trans_counter; j++) {
-                        if (transactions[i].account_number > transactions[j].account_number) {
-                                temp = transactions[i];
-                                transactions[i] = transactions[j];
-                                transactions[j] = temp;
-                        }
+// Write locks the stripes from trans_stripes in order. With --lock-profile
+// each one is charged to the first account of the TRANS that it guards.
+void lock_trans_stripes(struct lock_table *locks, struct transaction *transactions, int num_transactions, int stripes[10], int num_stripes)
+{
+        pthread_rwlock_t *lock;
+        int i, j;
+
+        for (i = 0; i < num_stripes; i++) {
+                lock = &locks->stripes[stripes[i]].lock;
+                if (!lock_profiling) {
+                        pthread_rwlock_wrlock(lock);
+                        continue;
                 }
+                for (j = 0; j < num_transactions - 1 &&
+                     (transactions[j].account_number - 1) % locks->num_stripes != stripes[i]; j++) {
+                }
+                lockprof_wrlock(&lock_profile, lock, transactions[j].account_number);
+        }
+}
+
+// Formats the reply to LOCKS
+void lock_profile_report(char *out, int len)
+{
+        if (!lock_profiling) {
+                snprintf(out, len, "Lock profiling is off, start the server "
+                         "with --lock-profile <k>.");
+                return;
+        }
+        lockprof_report(&lock_profile, out, len);
+}
+
+// Prints the reply to LOCKS on stdout, however many accounts it lists
+void print_lock_profile()
+{
+        int len = lock_profiling ? LOCK_PROFILE_LINE_LEN * (lock_profile.top + 2) : 128;
+        char *report = (char*)malloc(len);
+
+        if (report == NULL) {
+                return;
         }
+        lock_profile_report(report, len);
+        printf("%s\n", report);
+        free(report);
+}
+
+// Formats the reply to STATS: the metrics, plus the balance cache hit rate
+// on a last line of its own when the cache is on
+void stats_report(char *out, int len)
+{
+        unsigned long hits, misses;
+        int n = metrics_report(&metrics, out, len);
+
+        if (storage_cache_size() == 0 || n >= len - 1) {
+                return;
+        }
+        storage_cache_stats(&hits, &misses);
+        snprintf(out + n, len - n, "\ncache %lu accounts, hits %lu, misses %lu "
+                 "(%.1f%% hit)", storage_cache_size(), hits, misses,
+                 hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+void check(struct lock_table *locks, struct node *cmd_info, struct logger *log)
+{
+        int account_num = cmd_info->cmd.transactions[0].account_number;
+        long started = metrics_now();
 
-        return trans_counter;
+        // Without a lock table the epoch scheduler keeps TRANS off the account
+        if (locks == NULL) {
+        } else if (lock_profiling) {
+                lockprof_rdlock(&lock_profile, account_lock(locks, account_num), account_num);
+        } else {
+                pthread_rwlock_rdlock(account_lock(locks, account_num));
+        }
+        metrics_record(STAGE_LOCK, metrics_now() - started);
+        started = metrics_now();
+        int amount = storage_read(account_num);
+        metrics_record(STAGE_STORAGE, metrics_now() - started);
+        finish_cmd(log, cmd_info, WIRE_BAL, amount);
+        if (locks != NULL) {
+                pthread_rwlock_unlock(account_lock(locks, account_num));
+        }
 }
 
-void trans(struct account *accs, char *cmd, char *log_filename, struct timeval tv_begin, int request_id)
+void trans(struct lock_table *locks, struct node *cmd_info, struct logger *log)
 {
-        struct transaction *transactions = (struct transaction*)malloc(sizeof(struct transaction)*10);
-        int num_transactions = parse_trans_cmd(cmd, transactions);
-        FILE *fp;
+        struct transaction *transactions = cmd_info->cmd.transactions;
+        int num_transactions = cmd_info->cmd.num_transactions;
         int ISF = 0;
-        int current_balance;
-        int current_account;
-        int trans_value;
-        int predicted_value;
         int new_balances[num_transactions];
+        int stripes[10];
+        int num_stripes = 0;
+        long started;
+        long storage = 0; // Reads and writes, including any OCC attempts
+
+        if (cas_fast_path && num_transactions == 1 &&
+            trans_single(transactions, log, cmd_info)) {
+                return;
+        }
+        if (occ && trans_occ(locks, transactions, num_transactions, log,
+                             cmd_info, &storage)) {
+                metrics_record(STAGE_STORAGE, storage);
+                return;
+        }
+        if (combining && num_transactions == 1) {
+                trans_combined(locks, transactions, log, cmd_info);
+                return;
+        }
 
-        // Lock all the accounts, starting with smallest account number
+        // Lock every stripe the accounts fall in, each once, lowest first.
+        // Without a lock table the epoch scheduler already keeps every other
+        // command off these accounts.
         int i = 0;
-        for (i = 0; i < num_transactions; i++) {
-                pthread_mutex_lock(&accs[transactions[i].account_number - 1].lock);
+        started = metrics_now();
+        if (locks != NULL) {
+                num_stripes = trans_stripes(locks, transactions, num_transactions, stripes);
+                lock_trans_stripes(locks, transactions, num_transactions, stripes, num_stripes);
+        }
+        // Keep the lock-free path off these accounts until we are done
+        if (cas_fast_path) {
+                for (i = 0; i < num_transactions; i++) {
+                        storage_hold(transactions[i].account_number);
+                }
         }
+        metrics_record(STAGE_LOCK, metrics_now() - started);
 
         // Do the transactions
+        storage += read_balances(transactions, num_transactions, new_balances);
         for (i = 0; i < num_transactions; i++) {
-                current_account = transactions[i].account_number;
-                current_balance = read_account(current_account);
-                trans_value = transactions[i].value;
-
-                predicted_value = current_balance + trans_value;
-                if (predicted_value < 0 && ISF == 0) {
-                        ISF = current_account;
-                } else {
-                        new_balances[i] = predicted_value;
+                new_balances[i] += transactions[i].value;
+                if (new_balances[i] < 0 && ISF == 0) {
+                        ISF = transactions[i].account_number;
                 }
         }
 
         // All accounts had sufficient funds, apply the new balances
         if (ISF == 0) {
+                commit_begin();
+                wal_commit(transactions, num_transactions);
+                storage += write_balances(transactions, num_transactions, new_balances);
+                commit_end();
                 for (i = 0; i < num_transactions; i++) {
-                        write_account(transactions[i].account_number, new_balances[i]);
+                        if (locks != NULL && locks->versions != NULL) {
+                                atomic_fetch_add_explicit(&locks->versions[transactions[i].account_number - 1],
+                                                          1, memory_order_release);
+                        }
                 }
         }
+        metrics_record(STAGE_STORAGE, storage);
 
+        log_trans(log, ISF, cmd_info);
+
+        // Unlock all the accounts
+        if (cas_fast_path) {
+                for (i = 0; i < num_transactions; i++) {
+                        storage_release(transactions[i].account_number);
+                }
+        }
+        for (i = 0; i < num_stripes; i++) {
+                pthread_rwlock_unlock(&locks->stripes[stripes[i]].lock);
+        }
+        atomic_fetch_add_explicit(&trans_locked_count, 1, memory_order_relaxed);
+}
+
+// Reads the balance of every account in the TRANS into balances, all at once
+// through the I/O threads when there are any. Balances found in the cache are
+// never handed to them. Returns how long it took; callers add up a command's
+// reads and writes into its one STAGE_STORAGE sample.
+long read_balances(struct transaction *transactions, int num_transactions, int *balances)
+{
+        int IDs[num_transactions];
+        int missed[num_transactions];
+        int values[num_transactions];
+        long started = metrics_now();
+        int i, num_missed = 0;
+
+        for (i = 0; i < num_transactions; i++) {
+                IDs[i] = transactions[i].account_number;
+        }
+        if (io_threads > 0) {
+                for (i = 0; i < num_transactions; i++) {
+                        if (!storage_lookup(IDs[i], &balances[i])) {
+                                missed[num_missed++] = i;
+                        }
+                }
+                for (i = 0; i < num_missed; i++) {
+                        IDs[i] = IDs[missed[i]];
+                }
+                io_pool_read(&io_pool, IDs, values, num_missed);
+                for (i = 0; i < num_missed; i++) {
+                        balances[missed[i]] = values[i];
+                }
+        } else {
+                for (i = 0; i < num_transactions; i++) {
+                        balances[i] = storage_read(IDs[i]);
+                }
+        }
+        return metrics_now() - started;
+}
+
+// Writes balances[i] to the i-th account of the TRANS, all at once through
+// the I/O threads when there are any. Returns how long it took, like
+// read_balances.
+long write_balances(struct transaction *transactions, int num_transactions, int *balances)
+{
+        int IDs[num_transactions];
+        long started = metrics_now();
+        int i;
+
+        for (i = 0; i < num_transactions; i++) {
+                IDs[i] = transactions[i].account_number;
+        }
+        if (io_threads > 0) {
+                io_pool_write(&io_pool, IDs, balances, num_transactions);
+        } else {
+                for (i = 0; i < num_transactions; i++) {
+                        storage_write(IDs[i], balances[i]);
+                }
+        }
+        return metrics_now() - started;
+}
+
+// Logs the deltas of a TRANS that is about to be applied to the write-ahead
+// log and waits (with whatever other TRANS commit meanwhile) until they are
+// as durable as --durability asks. Does nothing without --wal.
+void wal_commit(struct transaction *transactions, int num_transactions)
+{
+        int IDs[num_transactions];
+        int deltas[num_transactions];
+        long started = metrics_now();
+        int i;
+
+        if (!wal_enabled) {
+                return;
+        }
+        for (i = 0; i < num_transactions; i++) {
+                IDs[i] = transactions[i].account_number;
+                deltas[i] = transactions[i].value;
+        }
+        wal_wait(&wal, wal_append(&wal, IDs, deltas, num_transactions));
+        metrics_record(STAGE_WAL, metrics_now() - started);
+}
+
+// Bracket the WAL record and balance writes of a TRANS, so a snapshot has
+// either all of a TRANS or none of it. Do nothing without --snapshot.
+void commit_begin()
+{
+        if (snapshots_enabled) {
+                snapshot_commit_begin(&snapshotter);
+        }
+}
+
+void commit_end()
+{
+        if (snapshots_enabled) {
+                snapshot_commit_end(&snapshotter);
+        }
+}
+
+// Reports OK, or ISF if ISF names an account, for a TRANS that finished now
+void log_trans(struct logger *log, int ISF, struct node *cmd_info)
+{
+        // then ISF == account number with insufficient funds
+        finish_cmd(log, cmd_info, ISF != 0 ? WIRE_ISF : WIRE_OK, ISF);
+}
+
+// Reports a CHECK or TRANS that finished now: appends its line to the output
+// file and, with --results, hands the result to whoever submitted it, the
+// network listener for a client or stdout for stdin. value is the balance
+// for WIRE_BAL and the account for WIRE_ISF.
+void finish_cmd(struct logger *log, struct node *cmd_info, int result, int value)
+{
+        struct wire_response response;
+        char line[WIRE_TEXT_LEN];
         // Time that this command finishes
         struct timeval tv_end;
         gettimeofday(&tv_end, NULL);
+        long started = metrics_now();
+
+        response.op = cmd_info->cmd.op;
+        response.result = result;
+        response.tag = cmd_info->tag;
+        response.request_id = cmd_info->request_id;
+        response.value = value;
+        response.begin_us = cmd_info->tv_begin.tv_sec * 1000000L + cmd_info->tv_begin.tv_usec;
+        response.end_us = tv_end.tv_sec * 1000000L + tv_end.tv_usec;
+        wire_format_text(&response, line, sizeof(line));
         // Append to logfile
-        fp = fopen(log_filename, "a");
+        log_line(log, "%s\n", line);
+        if (deliver_results) {
+                if (cmd_info->client == NULL) {
+                        printf("%s%s\n", OUTPUT, line);
+                } else {
+                        net_post_result(&net, cmd_info->client, &response);
+                }
+        }
+        metrics_record(STAGE_LOG, metrics_now() - started);
+}
 
-        if (ISF != 0) {
-                // then ISF == account number with insufficient funds
-                fprintf(fp, "%d ISF %d TIME %ld.%06ld %ld.%06ld\n", request_id, ISF, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
-        } else {
-                fprintf(fp, "%d OK TIME %ld.%06ld %ld.%06ld\n", request_id, tv_begin.tv_sec, tv_begin.tv_usec, tv_end.tv_sec, tv_end.tv_usec);
+// Optimistic TRANS. Each attempt reads every balance and its version without
+// locking (--occ needs the atomic backend, so those reads are atomic loads),
+// decides OK or ISF from that snapshot, then write locks the stripes only to
+// check that no version moved and to apply the new balances. A stale
+// snapshot aborts the attempt and it starts over. Returns 1 if the command
+// was completed and logged, 0 after OCC_MAX_ATTEMPTS aborts, leaving the
+// caller to run it under the locks. Either way the time every attempt spent
+// reading and writing balances is added to *storage.
+int trans_occ(struct lock_table *locks, struct transaction *transactions, int num_transactions, struct logger *log, struct node *cmd_info, long *storage)
+{
+        unsigned int seen[num_transactions];
+        int new_balances[num_transactions];
+        int stripes[10];
+        int num_stripes = trans_stripes(locks, transactions, num_transactions, stripes);
+        int attempt, i, ISF, valid;
+        atomic_uint *version;
+        long started;
+
+        for (attempt = 0; attempt < OCC_MAX_ATTEMPTS; attempt++) {
+                // Read phase, no locks held
+                ISF = 0;
+                for (i = 0; i < num_transactions; i++) {
+                        version = &locks->versions[transactions[i].account_number - 1];
+                        seen[i] = atomic_load_explicit(version, memory_order_acquire);
+                }
+                *storage += read_balances(transactions, num_transactions, new_balances);
+                for (i = 0; i < num_transactions; i++) {
+                        new_balances[i] += transactions[i].value;
+                        if (new_balances[i] < 0 && ISF == 0) {
+                                ISF = transactions[i].account_number;
+                        }
+                }
+
+                // Validate and commit phase
+                started = metrics_now();
+                lock_trans_stripes(locks, transactions, num_transactions, stripes, num_stripes);
+                metrics_record(STAGE_LOCK, metrics_now() - started);
+                valid = 1;
+                for (i = 0; i < num_transactions && valid; i++) {
+                        version = &locks->versions[transactions[i].account_number - 1];
+                        valid = atomic_load_explicit(version, memory_order_acquire) == seen[i];
+                }
+                if (valid) {
+                        if (ISF == 0) {
+                                commit_begin();
+                                wal_commit(transactions, num_transactions);
+                                *storage += write_balances(transactions, num_transactions,
+                                                           new_balances);
+                                commit_end();
+                                for (i = 0; i < num_transactions; i++) {
+                                        atomic_fetch_add_explicit(&locks->versions[transactions[i].account_number - 1],
+                                                                  1, memory_order_release);
+                                }
+                        }
+                        log_trans(log, ISF, cmd_info);
+                }
+                for (i = 0; i < num_stripes; i++) {
+                        pthread_rwlock_unlock(&locks->stripes[stripes[i]].lock);
+                }
+
+                if (valid) {
+                        atomic_fetch_add_explicit(&occ_commits, 1, memory_order_relaxed);
+                        return 1;
+                }
+                atomic_fetch_add_explicit(&occ_aborts, 1, memory_order_relaxed);
         }
 
-        fclose(fp);
+        atomic_fetch_add_explicit(&occ_fallbacks, 1, memory_order_relaxed);
+        return 0;
+}
 
-        // Unlock all the accounts
-        for (i = 0; i < num_transactions; i++) {
-                pthread_mutex_unlock(&accs[transactions[i].account_number - 1].lock);
+// Flat-combining TRANS on one account (--combine). The request is published
+// on its stripe's pending list before the stripe is write locked. Whoever
+// gets the lock first applies every request published so far, so by the time
+// the others get it their TRANS is usually done and they only unlock.
+void trans_combined(struct lock_table *locks, struct transaction *transaction, struct logger *log, struct node *cmd_info)
+{
+        int stripes[10] = { (transaction->account_number - 1) % locks->num_stripes };
+        struct lock_stripe *stripe = &locks->stripes[stripes[0]];
+        struct combine_req req;
+        long started;
+
+        req.transaction = *transaction;
+        req.cmd_info = cmd_info;
+        req.done = 0;
+        req.next = atomic_load_explicit(&stripe->pending, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&stripe->pending, &req.next, &req,
+                                                      memory_order_release,
+                                                      memory_order_relaxed)) {
+        }
+
+        started = metrics_now();
+        lock_trans_stripes(locks, transaction, 1, stripes, 1);
+        metrics_record(STAGE_LOCK, metrics_now() - started);
+        if (!req.done) {
+                combine(stripe, log);
+        }
+        pthread_rwlock_unlock(&stripe->lock);
+        atomic_fetch_add_explicit(&trans_locked_count, 1, memory_order_relaxed);
+}
+
+// Applies every request on the stripe's pending list, which must be write
+// locked. Each account is read once and written once; in between the
+// requests are applied in request ID order, each one OK or ISF on its own
+// against the running balance, and each gets its own log line.
+void combine(struct lock_stripe *stripe, struct logger *log)
+{
+        struct combine_req *head = atomic_exchange_explicit(&stripe->pending, NULL,
+                                                            memory_order_acquire);
+        struct combine_req *req;
+        int n = 0;
+        int i, j, num_accounts = 0, num_changed = 0, num_ok = 0;
+        long started, storage;
+
+        for (req = head; req != NULL; req = req->next) {
+                n++;
+        }
+        struct combine_req *reqs[n];
+        struct transaction accounts[n]; // Distinct accounts, amounts unused
+        int balances[n];
+        int changed[n];
+        int slot[n];                    // Index of each request's account
+        int ISF[n];
+        int IDs[n];
+        int deltas[n];
+
+        // Insertion sort by request ID; each worker has at most one request
+        // pending, so n is small
+        for (req = head, j = 0; req != NULL; req = req->next, j++) {
+                for (i = j; i > 0 && reqs[i - 1]->cmd_info->request_id > req->cmd_info->request_id; i--) {
+                        reqs[i] = reqs[i - 1];
+                }
+                reqs[i] = req;
+        }
+
+        for (i = 0; i < n; i++) {
+                for (j = 0; j < num_accounts &&
+                     accounts[j].account_number != reqs[i]->transaction.account_number; j++) {
+                }
+                if (j == num_accounts) {
+                        accounts[num_accounts] = reqs[i]->transaction;
+                        changed[num_accounts++] = 0;
+                }
+                slot[i] = j;
+        }
+        storage = read_balances(accounts, num_accounts, balances);
+        for (i = 0; i < n; i++) {
+                if (balances[slot[i]] + reqs[i]->transaction.value < 0) {
+                        ISF[i] = reqs[i]->transaction.account_number;
+                        continue;
+                }
+                ISF[i] = 0;
+                balances[slot[i]] += reqs[i]->transaction.value;
+                changed[slot[i]] = 1;
+                IDs[num_ok] = reqs[i]->transaction.account_number;
+                deltas[num_ok] = reqs[i]->transaction.value;
+                num_ok++;
+        }
+
+        if (num_ok > 0) {
+                commit_begin();
+                if (wal_enabled) {
+                        // One record per TRANS, one wait for all of them
+                        started = metrics_now();
+                        for (i = 0; i < num_ok - 1; i++) {
+                                wal_append(&wal, &IDs[i], &deltas[i], 1);
+                        }
+                        wal_wait(&wal, wal_append(&wal, &IDs[i], &deltas[i], 1));
+                        metrics_record(STAGE_WAL, metrics_now() - started);
+                }
+                // Only write the accounts some request changed
+                for (j = 0; j < num_accounts; j++) {
+                        if (changed[j]) {
+                                accounts[num_changed] = accounts[j];
+                                balances[num_changed++] = balances[j];
+                        }
+                }
+                storage += write_balances(accounts, num_changed, balances);
+                commit_end();
+        }
+        for (i = 0; i < n; i++) {
+                // Every request in the batch waited on the same reads and writes
+                metrics_record(STAGE_STORAGE, storage);
+                log_trans(log, ISF[i], reqs[i]->cmd_info);
+                reqs[i]->done = 1;
         }
-        free(transactions);
+        atomic_fetch_add_explicit(&combine_batches, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&combine_requests, n, memory_order_relaxed);
+}
+
+// Lock-free path for a TRANS on one account: a compare-and-swap loop on the
+// balance that applies the same ISF rule as trans(). Returns 1 if the command
+// was completed and logged, 0 if a locked TRANS holds the account and the
+// caller should take the locked path instead. Never used with the WAL, which
+// has to log a TRANS before its balance changes.
+int trans_single(struct transaction *transaction, struct logger *log, struct node *cmd_info)
+{
+        long started;
+        int result;
+
+        commit_begin();
+        started = metrics_now();
+        result = storage_try_add(transaction->account_number, transaction->value);
+        metrics_record(STAGE_STORAGE, metrics_now() - started);
+        commit_end();
+        if (result == STORAGE_HELD) {
+                atomic_fetch_add_explicit(&trans_cas_fallbacks, 1, memory_order_relaxed);
+                return 0;
+        }
+
+        log_trans(log, result == STORAGE_ISF ? transaction->account_number : 0,
+                  cmd_info);
+        atomic_fetch_add_explicit(&trans_cas_count, 1, memory_order_relaxed);
+        return 1;
 }
 
 void handle_interrupt()
@@ -383,94 +1769,419 @@ void handle_interrupt()
                "Please use the END command to exit program.\n\n");
 }
 
-// Returns request ID (nonzero) if command extracted,
-// 0 if no command to extract.
-// If command exists and is retrieved from beginning of list,
-// it is placed in the given next_cmd array and is deleted from the
-// Linked List. Head is updated to point to the next command to be processed.
-int extract_cmd(struct buffer *cmd_buffer, struct node *curr_cmd_info)
-{
-        int retval = 0;
-
-        pthread_mutex_lock(&buffer_lock);
-
-        // If there is command in the buffer...
-        if (cmd_buffer->head != NULL) {
-                // *struct1.blah === struct1->blah
-                strcpy(curr_cmd_info->cmd, cmd_buffer->head->cmd);
-                curr_cmd_info->request_id = cmd_buffer->head->request_id;
-                curr_cmd_info->tv_begin = cmd_buffer->head->tv_begin;
-                // Delete the command from the Linked List by resetting
-                // head to next node.
-                struct node *new_next = cmd_buffer->head->next;
-                free(cmd_buffer->head); // free previously malloc-ed pointer
-                cmd_buffer->head = new_next;
-                retval = 1;
+// Hands a validated command to the workers using the selected dispatch mode.
+// Callers must hold submit_lock.
+void dispatch_cmd(struct pthread_args *args, struct node *cmd_info)
+{
+        if (args->dispatch_mode == DISPATCH_SHARD) {
+                shard_dispatch(args, cmd_info);
+        } else if (args->dispatch_mode == DISPATCH_STEAL) {
+                steal_push(args->steal_pool, cmd_info);
         } else {
-                retval = 0;
+                add_node(args->cmd_buf, cmd_info);
         }
+}
 
-        pthread_mutex_unlock(&buffer_lock);
+// DISPATCH_SHARD: account a lives on shard (a - 1) % num_shards. A command
+// whose accounts all live on one shard goes to that owner alone; otherwise
+// every owner involved gets a copy tied to one cross_shard_trans. Called with
+// submit_lock held, so every inbox sees cross-shard TRANS in the same order
+// and owners waiting on each other can never wait in a cycle.
+void shard_dispatch(struct pthread_args *args, struct node *cmd_info)
+{
+        struct command *cmd = &cmd_info->cmd;
+        struct cross_shard_trans *cross;
+        int shards[MAX_TRANSACTIONS];
+        int count = 1;
+        int i, j, shard;
 
-        return retval;
+        // Every command names at least one account
+        shards[0] = (cmd->transactions[0].account_number - 1) % args->num_shards;
+        for (i = 1; i < cmd->num_transactions; i++) {
+                shard = (cmd->transactions[i].account_number - 1) % args->num_shards;
+                // Insertion sort, skipping shards already in the list
+                for (j = count; j > 0 && shards[j - 1] > shard; j--) {
+                }
+                if (j > 0 && shards[j - 1] == shard) {
+                        continue;
+                }
+                memmove(&shards[j + 1], &shards[j], sizeof(int) * (count - j));
+                shards[j] = shard;
+                count++;
+        }
+
+        if (count == 1) {
+                add_node(&args->inboxes[shards[0]], cmd_info);
+                return;
+        }
+        cross = cross_alloc(args);
+        cross->coordinator = shards[0];
+        cross->participants = count;
+        cross->arrived = 0;
+        cross->decided = 0;
+        cross->left = 0;
+        cross->ISF = 0;
+        cmd_info->ctx = cross;
+        for (i = 0; i < count; i++) {
+                add_node(&args->inboxes[shards[i]], cmd_info);
+        }
 }
 
-// Add a node to the end of Linked List and update head. Returns nothing as this
-// should always succeed. Should only be called by the main thread.
-void add_cmd(struct buffer *cmd_buffer, char command_to_add[MAX_CMD_LEN], int request_id, struct timeval tv_begin)
+// Takes a cross_shard_trans from the free list, or allocates one if every
+// record is in use. Called with submit_lock held, so it is the only popper.
+struct cross_shard_trans *cross_alloc(struct pthread_args *args)
 {
-        pthread_mutex_lock(&buffer_lock);
+        struct cross_shard_trans *cross = atomic_load_explicit(&args->cross_free,
+                                                               memory_order_acquire);
 
-        // Build new node
-        struct node *node_to_add = (struct node*)malloc(sizeof(struct node));
-        strcpy(node_to_add->cmd, command_to_add);
-        node_to_add->next = NULL; // Node will be placed at the END of the list
-        node_to_add->request_id = request_id;
-        node_to_add->tv_begin = tv_begin;
+        // Coordinators only ever push meanwhile, so if the head is unchanged
+        // its next is too and this can't suffer from ABA
+        while (cross != NULL &&
+               !atomic_compare_exchange_weak_explicit(&args->cross_free, &cross,
+                                                      cross->next,
+                                                      memory_order_acquire,
+                                                      memory_order_acquire)) {
+        }
+        if (cross != NULL) {
+                return cross;
+        }
+        cross = (struct cross_shard_trans*)malloc(sizeof(struct cross_shard_trans));
+        if (cross == NULL) {
+                perror("Failed to dispatch cross-shard TRANS");
+                exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&cross->lock, NULL);
+        pthread_cond_init(&cross->changed, NULL);
+        return cross;
+}
 
-        // Append the new node to the end of the list
-        struct node *find_end = cmd_buffer->head;
-        if (cmd_buffer->head == NULL) {
-                // Then this is the FIRST command in the buffer
-                cmd_buffer->head = node_to_add;
-        } else {
-                // then this is NOT the first command in the buffer
-                while (find_end->next != NULL) {
-                        find_end = find_end->next;
+// Puts a finished cross_shard_trans back on the free list
+void cross_release(struct pthread_args *args, struct cross_shard_trans *cross)
+{
+        cross->next = atomic_load_explicit(&args->cross_free, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&args->cross_free, &cross->next,
+                                                      cross, memory_order_release,
+                                                      memory_order_relaxed)) {
+        }
+}
+
+// One owner's part of a cross-shard TRANS: reads and updates only the
+// accounts on its own shard, agreeing with the other owners on OK or ISF so
+// the TRANS is still applied to all of its accounts or to none
+void trans_cross_shard(int shard, struct pthread_args *args, struct node *cmd_info)
+{
+        struct cross_shard_trans *cross = (struct cross_shard_trans*) cmd_info->ctx;
+        struct transaction *transactions = cmd_info->cmd.transactions;
+        struct transaction mine[MAX_TRANSACTIONS];
+        int num_transactions = cmd_info->cmd.num_transactions;
+        int new_balances[MAX_TRANSACTIONS];
+        int num_mine = 0;
+        int ISF = 0;
+        int coordinating = shard == cross->coordinator;
+        long started = metrics_now();
+        long storage;
+        int i;
+
+        // Only the coordinator counts the command, so STATS sees it once
+        if (coordinating) {
+                record_queue(cmd_info);
+        }
+        for (i = 0; i < num_transactions; i++) {
+                if ((transactions[i].account_number - 1) % args->num_shards == shard) {
+                        mine[num_mine++] = transactions[i];
+                }
+        }
+        storage = read_balances(mine, num_mine, new_balances);
+        for (i = 0; i < num_mine; i++) {
+                new_balances[i] += mine[i].value;
+                if (new_balances[i] < 0 && ISF == 0) {
+                        ISF = mine[i].account_number;
+                }
+        }
+
+        pthread_mutex_lock(&cross->lock);
+        if (ISF != 0 && (cross->ISF == 0 || ISF < cross->ISF)) {
+                cross->ISF = ISF;
+        }
+        cross->arrived++;
+        pthread_cond_broadcast(&cross->changed);
+
+        if (!coordinating) {
+                while (!cross->decided) {
+                        pthread_cond_wait(&cross->changed, &cross->lock);
+                }
+                ISF = cross->ISF;
+                pthread_mutex_unlock(&cross->lock);
+                if (ISF == 0) {
+                        write_balances(mine, num_mine, new_balances);
                 }
-                find_end->next = node_to_add;
+                // The coordinator may free cross as soon as this is unlocked
+                pthread_mutex_lock(&cross->lock);
+                cross->left++;
+                pthread_cond_broadcast(&cross->changed);
+                pthread_mutex_unlock(&cross->lock);
+                return;
         }
 
-        pthread_mutex_unlock(&buffer_lock);
+        while (cross->arrived < cross->participants) {
+                pthread_cond_wait(&cross->changed, &cross->lock);
+        }
+        ISF = cross->ISF;
+        pthread_mutex_unlock(&cross->lock);
+
+        // Every shard can take it: log it before any shard applies it
+        if (ISF == 0) {
+                commit_begin();
+                wal_commit(transactions, num_transactions);
+        }
+        pthread_mutex_lock(&cross->lock);
+        cross->decided = 1;
+        pthread_cond_broadcast(&cross->changed);
+        pthread_mutex_unlock(&cross->lock);
+        if (ISF == 0) {
+                storage += write_balances(mine, num_mine, new_balances);
+        }
+
+        pthread_mutex_lock(&cross->lock);
+        while (cross->left < cross->participants - 1) {
+                pthread_cond_wait(&cross->changed, &cross->lock);
+        }
+        pthread_mutex_unlock(&cross->lock);
+        if (ISF == 0) {
+                commit_end();
+        }
+        log_trans(args->log, ISF, cmd_info);
+        atomic_fetch_add_explicit(&trans_locked_count, 1, memory_order_relaxed);
+
+        cross_release(args, cross);
+        // The coordinator's own accounts stand for the command's storage time
+        metrics_record(STAGE_STORAGE, storage);
+        metrics_record(STAGE_SERVICE, metrics_now() - started);
+        metrics_record(STAGE_TOTAL, metrics_since(&cmd_info->tv_begin));
+}
+
+// Blocks until a command is available for this worker; returns 0 once END
+// has been given and every queued command has been handed out.
+int next_cmd(struct worker_args *worker, struct node *curr_cmd_info)
+{
+        struct pthread_args *args = worker->shared;
+
+        if (args->dispatch_mode == DISPATCH_SHARD) {
+                return extract_cmd(&args->inboxes[worker->id], curr_cmd_info);
+        } else if (args->dispatch_mode == DISPATCH_STEAL) {
+                return steal_pop(args->steal_pool, worker->id, curr_cmd_info);
+        }
+        return extract_cmd(args->cmd_buf, curr_cmd_info);
 }
 
 // This is the function that the worker threads will be assigned.
 void *thread_routine(void *args)
 {
-        struct pthread_args *routine_args = (struct pthread_args*) args;
-        int request;
-        int *is_running = routine_args->running;
-        char *log_file_loc = routine_args->log_filename;
+        struct worker_args *worker = (struct worker_args*) args;
+        struct pthread_args *routine_args = worker->shared;
         struct node current_command_info;
-        while (*is_running) {
-                request = extract_cmd(routine_args->cmd_buf, &current_command_info);
-                if (request) {
-                        if (strncmp(current_command_info.cmd, "CHECK ", 6) == 0) {
-                                check(routine_args->accounts,
-                                      current_command_info.cmd, log_file_loc,
-                                      current_command_info.tv_begin,
-                                      current_command_info.request_id);
-                        } else if (strncmp(current_command_info.cmd, "TRANS ", 6) == 0) {
-                                trans(routine_args->accounts,
-                                      current_command_info.cmd, log_file_loc,
-                                      current_command_info.tv_begin,
-                                      current_command_info.request_id);
+        struct lock_table *locks = routine_args->locks;
+
+        // A shard owner is the only thread that touches its accounts
+        if (routine_args->dispatch_mode == DISPATCH_SHARD) {
+                locks = NULL;
+        }
+
+        metrics_bind(&metrics, worker->id);
+        if (routine_args->dispatch_mode == DISPATCH_EPOCH) {
+                epoch_worker(routine_args->epoch);
+        } else if (routine_args->async_workers != NULL) {
+                async_run(&routine_args->async_workers[worker->id]);
+        } else {
+                while (next_cmd(worker, &current_command_info)) {
+                        if (current_command_info.ctx != NULL) {
+                                trans_cross_shard(worker->id, routine_args,
+                                                  &current_command_info);
                         } else {
-                                // Do nothing, unrecognized command
+                                run_cmd(locks, routine_args->log,
+                                        &current_command_info);
                         }
-                } else {
-                        // Do nothing
                 }
         }
         printf("Thread %ld is exiting.\n", pthread_self());
 }
+
+// Runs one CHECK or TRANS and records how long it waited and ran. A NULL
+// lock table runs it without locks, for the epoch scheduler.
+void run_cmd(struct lock_table *locks, struct logger *log, struct node *cmd_info)
+{
+        long started = metrics_now();
+
+        record_queue(cmd_info);
+        if (cmd_info->cmd.op == CMD_CHECK) {
+                check(locks, cmd_info, log);
+        } else {
+                trans(locks, cmd_info, log);
+        }
+        metrics_record(STAGE_SERVICE, metrics_now() - started);
+        metrics_record(STAGE_TOTAL, metrics_since(&cmd_info->tv_begin));
+}
+
+// async_step for --async: runs a CHECK or TRANS like check() and trans(), as
+// a state machine that returns instead of blocking so its worker can run
+// other commands meanwhile. Stripes are only tried, lowest first, and kept
+// while the task waits, so tasks waiting on a stripe can't wait in a cycle.
+// Reads and writes happen at once and the task then sleeps out their
+// latency with the accounts still locked, all of a TRANS's reads (or writes)
+// overlapping. The WAL is polled: a task finding no flush in progress leads
+// one, covering everything its worker has committed meanwhile.
+int async_step_cmd(void *ctx, struct async_task *task)
+{
+        struct pthread_args *args = (struct pthread_args*) ctx;
+        struct lock_table *locks = args->locks;
+        struct node *cmd_info = &task->cmd_info;
+        struct transaction *transactions = cmd_info->cmd.transactions;
+        int num_transactions = cmd_info->cmd.num_transactions;
+        int IDs[MAX_TRANSACTIONS];
+        int deltas[MAX_TRANSACTIONS];
+        pthread_rwlock_t *lock;
+        int delay, longest, i;
+
+        switch (task->state) {
+        case TASK_NEW:
+                record_queue(cmd_info);
+                task->started = metrics_now();
+                task->stage_started = task->started;
+                // A CHECK's one account is locked the same way, only shared
+                task->num_stripes = trans_stripes(locks, transactions, num_transactions,
+                                                  task->stripes);
+                task->locked = 0;
+                task->state = TASK_LOCK;
+                // fall through
+        case TASK_LOCK:
+                for (; task->locked < task->num_stripes; task->locked++) {
+                        lock = &locks->stripes[task->stripes[task->locked]].lock;
+                        if ((cmd_info->cmd.op == CMD_CHECK ?
+                             pthread_rwlock_tryrdlock(lock) :
+                             pthread_rwlock_trywrlock(lock)) != 0) {
+                                return ASYNC_RETRY;
+                        }
+                }
+                metrics_record(STAGE_LOCK, metrics_now() - task->stage_started);
+                task->stage_started = metrics_now();
+                longest = 0;
+                for (i = 0; i < num_transactions; i++) {
+                        delay = storage_read_deferred(transactions[i].account_number,
+                                                      &task->balances[i]);
+                        if (delay > longest) {
+                                longest = delay;
+                        }
+                }
+                async_sleep_us(task, longest);
+                task->state = TASK_READ;
+                return ASYNC_SLEEP;
+        case TASK_READ:
+                task->storage = metrics_now() - task->stage_started;
+                if (cmd_info->cmd.op == CMD_CHECK) {
+                        finish_cmd(args->log, cmd_info, WIRE_BAL, task->balances[0]);
+                        break;
+                }
+                task->ISF = 0;
+                for (i = 0; i < num_transactions; i++) {
+                        task->balances[i] += transactions[i].value;
+                        if (task->balances[i] < 0 && task->ISF == 0) {
+                                task->ISF = transactions[i].account_number;
+                        }
+                }
+                if (task->ISF != 0) {
+                        log_trans(args->log, task->ISF, cmd_info);
+                        break;
+                }
+                task->state = TASK_COMMIT;
+                // fall through
+        case TASK_COMMIT:
+                if (snapshots_enabled && !snapshot_commit_try(&snapshotter)) {
+                        return ASYNC_RETRY;
+                }
+                task->stage_started = metrics_now();
+                if (wal_enabled) {
+                        for (i = 0; i < num_transactions; i++) {
+                                IDs[i] = transactions[i].account_number;
+                                deltas[i] = transactions[i].value;
+                        }
+                        task->lsn = wal_append(&wal, IDs, deltas, num_transactions);
+                }
+                task->state = TASK_WAL;
+                // fall through
+        case TASK_WAL:
+                if (wal_enabled) {
+                        if (!wal_poll(&wal, task->lsn)) {
+                                return ASYNC_RETRY;
+                        }
+                        metrics_record(STAGE_WAL, metrics_now() - task->stage_started);
+                }
+                task->stage_started = metrics_now();
+                longest = 0;
+                for (i = 0; i < num_transactions; i++) {
+                        delay = storage_write_deferred(transactions[i].account_number,
+                                                       task->balances[i]);
+                        if (delay > longest) {
+                                longest = delay;
+                        }
+                }
+                async_sleep_us(task, longest);
+                task->state = TASK_WRITE;
+                return ASYNC_SLEEP;
+        case TASK_WRITE:
+                task->storage += metrics_now() - task->stage_started;
+                commit_end();
+                log_trans(args->log, 0, cmd_info);
+                break;
+        }
+
+        task_unlock(locks, task);
+        if (cmd_info->cmd.op == CMD_TRANS) {
+                atomic_fetch_add_explicit(&trans_locked_count, 1, memory_order_relaxed);
+        }
+        metrics_record(STAGE_STORAGE, task->storage);
+        metrics_record(STAGE_SERVICE, metrics_now() - task->started);
+        metrics_record(STAGE_TOTAL, metrics_since(&cmd_info->tv_begin));
+        return ASYNC_DONE;
+}
+
+// Unlocks every stripe a finished async task locked
+void task_unlock(struct lock_table *locks, struct async_task *task)
+{
+        int i;
+
+        for (i = 0; i < task->locked; i++) {
+                pthread_rwlock_unlock(&locks->stripes[task->stripes[i]].lock);
+        }
+}
+
+// Records how long a command waited for a worker, overall and for its class
+void record_queue(struct node *cmd_info)
+{
+        long waited = metrics_since(&cmd_info->tv_begin);
+
+        metrics_record(STAGE_QUEUE, waited);
+        metrics_record(cmd_info->cmd.op == CMD_CHECK ? STAGE_QUEUE_CHECK :
+                       STAGE_QUEUE_TRANS, waited);
+}
+
+// epoch_execute for the epoch scheduler: the wave it belongs to already
+// keeps every conflicting command away, so no account is locked
+void epoch_run(void *ctx, struct node *cmd_info)
+{
+        struct pthread_args *args = (struct pthread_args*) ctx;
+
+        run_cmd(NULL, args->log, cmd_info);
+}
+
+// epoch_footprint for the epoch scheduler: a CHECK reads its account, a
+// TRANS may write all of its accounts
+int cmd_footprint(struct node *cmd_info, int accounts[EPOCH_MAX_ACCOUNTS], int *writes)
+{
+        int i;
+
+        for (i = 0; i < cmd_info->cmd.num_transactions; i++) {
+                accounts[i] = cmd_info->cmd.transactions[i].account_number;
+        }
+        *writes = cmd_info->cmd.op == CMD_TRANS;
+        return cmd_info->cmd.num_transactions;
+}
@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include "async.h"
+
+
+static long now_ns()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Sets deadline, for extract_cmd_timed, to the CLOCK_REALTIME moment that
+// CLOCK_MONOTONIC reaches wake_ns, or to now if it already has
+static void realtime_deadline(struct timespec *deadline, long wake_ns)
+{
+        long wait_ns = wake_ns - now_ns();
+
+        clock_gettime(CLOCK_REALTIME, deadline);
+        if (wait_ns > 0) {
+                deadline->tv_nsec += wait_ns % 1000000000L;
+                deadline->tv_sec += wait_ns / 1000000000L + deadline->tv_nsec / 1000000000L;
+                deadline->tv_nsec %= 1000000000L;
+        }
+}
+
+// Steps every task that is due. Finished ones are moved behind the last one
+// in flight. Returns how many are still in flight and sets *wake_ns to when
+// the next one is due.
+static int step_tasks(struct async_worker *worker, int num_active, long *wake_ns)
+{
+        struct async_task *task;
+        long now = now_ns();
+        long wake = LONG_MAX;
+        int i = 0;
+
+        while (i < num_active) {
+                task = worker->active[i];
+                if (task->wake_ns > now) {
+                        if (task->wake_ns < wake) {
+                                wake = task->wake_ns;
+                        }
+                        i++;
+                        continue;
+                }
+                worker->steps++;
+                switch (worker->step(worker->ctx, task)) {
+                case ASYNC_DONE:
+                        worker->active[i] = worker->active[--num_active];
+                        worker->active[num_active] = task;
+                        worker->commands++;
+                        continue;
+                case ASYNC_RETRY:
+                        worker->retries++;
+                        task->backoff_us = task->backoff_us == 0 ? ASYNC_RETRY_US :
+                                           task->backoff_us * 2;
+                        if (task->backoff_us > ASYNC_RETRY_MAX_US) {
+                                task->backoff_us = ASYNC_RETRY_MAX_US;
+                        }
+                        task->wake_ns = now + task->backoff_us * 1000L;
+                        break;
+                default:
+                        task->backoff_us = 0;
+                }
+                if (task->wake_ns < wake) {
+                        wake = task->wake_ns;
+                }
+                i++;
+        }
+        *wake_ns = wake;
+        return num_active;
+}
+
+// Worker side: runs commands from the input buffer, up to max_tasks at once,
+// until the buffer is closed and drained and every task has finished
+void async_run(struct async_worker *worker)
+{
+        struct async_task *task;
+        struct timespec deadline;
+        long wake;
+        int num_active = 0;
+        int closed = 0;
+        int taken, got;
+
+        while (!closed || num_active > 0) {
+                num_active = step_tasks(worker, num_active, &wake);
+
+                // Take in new commands: wait for the first only until a task
+                // is due (for as long as it takes when idle), then only take
+                // what is already queued
+                taken = 0;
+                while (!closed && num_active < worker->max_tasks) {
+                        task = worker->active[num_active];
+                        if (num_active == 0) {
+                                got = extract_cmd(worker->input, &task->cmd_info);
+                        } else {
+                                realtime_deadline(&deadline, taken ? 0 : wake);
+                                got = extract_cmd_timed(worker->input, &task->cmd_info, &deadline);
+                        }
+                        if (got == 0) {
+                                closed = 1;
+                        } else if (got < 0) {
+                                break;
+                        } else {
+                                task->state = 0;
+                                task->wake_ns = 0;
+                                task->backoff_us = 0;
+                                num_active++;
+                                taken++;
+                        }
+                }
+                if (num_active > worker->peak) {
+                        worker->peak = num_active;
+                }
+
+                // Full, or nothing more is coming: sleep until a task is due
+                if (taken == 0 && num_active > 0 &&
+                    (closed || num_active == worker->max_tasks)) {
+                        deadline.tv_sec = wake / 1000000000L;
+                        deadline.tv_nsec = wake % 1000000000L;
+                        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                               &deadline, NULL) == EINTR) {
+                        }
+                }
+        }
+}
+
+// Makes a task that returns ASYNC_SLEEP due us microseconds from now
+void async_sleep_us(struct async_task *task, int us)
+{
+        task->wake_ns = now_ns() + us * 1000L;
+}
+
+// Sets up one worker's tasks; commands are taken from input.
+// Returns 1 if succeeded, 0 if error.
+int async_init(struct async_worker *worker, struct buffer *input, int max_tasks,
+               async_step step, void *ctx)
+{
+        int i;
+
+        worker->input = input;
+        worker->max_tasks = max_tasks;
+        worker->step = step;
+        worker->ctx = ctx;
+        worker->commands = 0;
+        worker->steps = 0;
+        worker->retries = 0;
+        worker->peak = 0;
+        worker->tasks = (struct async_task*)malloc(sizeof(struct async_task) * max_tasks);
+        worker->active = (struct async_task**)malloc(sizeof(struct async_task*) * max_tasks);
+        if (worker->tasks == NULL || worker->active == NULL) {
+                return 0;
+        }
+        for (i = 0; i < max_tasks; i++) {
+                worker->active[i] = &worker->tasks[i];
+        }
+        return 1;
+}
+
+// Prints how many commands the n workers ran and how far they overlapped.
+// Call once every worker has returned from async_run.
+void async_report(struct async_worker *workers, int n)
+{
+        long commands = 0, steps = 0, retries = 0;
+        int peak = 0;
+        int i;
+
+        for (i = 0; i < n; i++) {
+                commands += workers[i].commands;
+                steps += workers[i].steps;
+                retries += workers[i].retries;
+                if (workers[i].peak > peak) {
+                        peak = workers[i].peak;
+                }
+        }
+        printf("Async commands: %ld in %ld steps (%.1f per command), "
+               "%ld retries, up to %d in flight on one worker\n",
+               commands, steps, commands ? (double) steps / commands : 0.0,
+               retries, peak);
+}
+
+void async_destroy(struct async_worker *worker)
+{
+        free(worker->tasks);
+        free(worker->active);
+}
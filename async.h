@@ -0,0 +1,66 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "buffer.h"
+#include "command.h"
+
+// What a step function returns
+#define ASYNC_DONE 0   // The command has finished; its task is free again
+#define ASYNC_SLEEP 1  // Step again once wake_ns has passed
+#define ASYNC_RETRY 2  // Waiting on a lock or another thread; step again soon
+
+// How long a task that returned ASYNC_RETRY waits before it is stepped
+// again. Doubled on every retry in a row, up to ASYNC_RETRY_MAX_US, so tasks
+// stuck behind a lock held for a slow storage access don't spin.
+#define ASYNC_RETRY_US 20
+#define ASYNC_RETRY_MAX_US 1000
+
+
+// One command in flight on an async worker. Nothing survives on the stack
+// between steps, so the step function keeps what it needs here.
+struct async_task {
+        struct node cmd_info;
+        int state;            // Where the step function resumes, 0 when new
+        long wake_ns;         // CLOCK_MONOTONIC time to step again
+        int backoff_us;       // Wait before the next retry, 0 after progress
+        // Scratch space for the step function
+        long started;
+        long stage_started;
+        long storage;         // Reads plus writes, one STAGE_STORAGE sample
+        unsigned long lsn;
+        int num_stripes;
+        int locked;           // Stripes locked so far
+        int stripes[MAX_TRANSACTIONS];
+        int balances[MAX_TRANSACTIONS];
+        int ISF;
+};
+
+// Advances a task as far as it can go without blocking
+typedef int (*async_step)(void *ctx, struct async_task *task);
+
+// Runs up to max_tasks commands from input at once on one worker thread.
+// Each is a state machine driven by the step function; whenever one would
+// wait, on storage latency, an account lock or the WAL, the worker steps
+// the others or takes in new commands instead of sleeping.
+struct async_worker {
+        struct buffer *input;
+        int max_tasks;
+        async_step step;
+        void *ctx;
+        struct async_task *tasks;
+        struct async_task **active; // In flight first, then the free tasks
+        long commands;
+        long steps;
+        long retries;
+        int peak;             // Most tasks that were in flight at once
+};
+
+
+int async_init(struct async_worker *worker, struct buffer *input, int max_tasks,
+               async_step step, void *ctx);
+void async_run(struct async_worker *worker);
+void async_sleep_us(struct async_task *task, int us);
+void async_report(struct async_worker *workers, int n);
+void async_destroy(struct async_worker *worker);
+
+#endif
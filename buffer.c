@@ -0,0 +1,288 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+
+// Orders the commands of a lane: earliest deadline first, then request ID
+static int before(struct node *a, struct node *b)
+{
+        return a->deadline_us < b->deadline_us ||
+               (a->deadline_us == b->deadline_us && a->request_id < b->request_id);
+}
+
+static void heap_push(struct lane *lane, struct node *node)
+{
+        int i = lane->count++;
+
+        while (i > 0 && before(node, &lane->heap[(i - 1) / 2])) {
+                lane->heap[i] = lane->heap[(i - 1) / 2];
+                i = (i - 1) / 2;
+        }
+        lane->heap[i] = *node;
+}
+
+static void heap_pop(struct lane *lane, struct node *out)
+{
+        struct node *last;
+        int i = 0;
+        int child;
+
+        *out = lane->heap[0];
+        last = &lane->heap[--lane->count];
+        while ((child = 2 * i + 1) < lane->count) {
+                if (child + 1 < lane->count &&
+                    before(&lane->heap[child + 1], &lane->heap[child])) {
+                        child++;
+                }
+                if (!before(&lane->heap[child], last)) {
+                        break;
+                }
+                lane->heap[i] = lane->heap[child];
+                i = child;
+        }
+        lane->heap[i] = *last;
+}
+
+// Sets up what a ring and a buffer with lanes have in common.
+// Returns 1 if succeeded, 0 if error.
+static int init_common(struct buffer *cmd_buffer, int capacity)
+{
+        cmd_buffer->capacity = capacity;
+        cmd_buffer->head = 0;
+        cmd_buffer->count = 0;
+        cmd_buffer->closed = 0;
+
+        if (pthread_mutex_init(&cmd_buffer->lock, NULL) != 0 ||
+            pthread_cond_init(&cmd_buffer->not_empty, NULL) != 0 ||
+            pthread_cond_init(&cmd_buffer->not_full, NULL) != 0) {
+                return 0;
+        }
+        return 1;
+}
+
+// Allocates a ring that holds up to capacity commands.
+// Returns 1 if succeeded, 0 if error.
+int buffer_init(struct buffer *cmd_buffer, int capacity)
+{
+        cmd_buffer->slots = (struct node*)malloc(sizeof(struct node)*capacity);
+        if (cmd_buffer->slots == NULL) {
+                return 0;
+        }
+        cmd_buffer->num_lanes = 0;
+        if (init_common(cmd_buffer, capacity) == 0) {
+                free(cmd_buffer->slots);
+                return 0;
+        }
+        return 1;
+}
+
+// Frees the first num_lanes lanes, as set up by buffer_init_lanes
+static void free_lanes(struct buffer *cmd_buffer, int num_lanes)
+{
+        int i;
+
+        for (i = 0; i < num_lanes; i++) {
+                pthread_cond_destroy(&cmd_buffer->lanes[i].not_full);
+                free(cmd_buffer->lanes[i].heap);
+        }
+}
+
+// Sets up a buffer that keeps CHECK and TRANS in a lane each, of up to
+// capacity commands, so a burst of one class can't fill the other's lane.
+// Every command gets a deadline: what its DEADLINE asks for, or else its
+// lane's budget, after it was read. Extraction takes the earliest deadline
+// of either lane, so a class with a shorter budget goes ahead of commands of
+// the other that haven't waited the difference yet, but never starves them.
+// Returns 1 if succeeded, 0 if error.
+int buffer_init_lanes(struct buffer *cmd_buffer, int capacity, int check_budget_ms, int trans_budget_ms)
+{
+        struct lane *lane;
+        int i;
+
+        cmd_buffer->slots = NULL;
+        cmd_buffer->num_lanes = NUM_LANES;
+        for (i = 0; i < NUM_LANES; i++) {
+                lane = &cmd_buffer->lanes[i];
+                lane->heap = (struct node*)malloc(sizeof(struct node) * capacity);
+                if (lane->heap == NULL) {
+                        free_lanes(cmd_buffer, i);
+                        return 0;
+                }
+                if (pthread_cond_init(&lane->not_full, NULL) != 0) {
+                        free(lane->heap);
+                        free_lanes(cmd_buffer, i);
+                        return 0;
+                }
+                lane->count = 0;
+                lane->budget_us = (i == LANE_CHECK ? check_budget_ms : trans_budget_ms) * 1000L;
+                lane->dispatched = 0;
+                lane->late = 0;
+        }
+        if (init_common(cmd_buffer, capacity) == 0) {
+                free_lanes(cmd_buffer, NUM_LANES);
+                return 0;
+        }
+        return 1;
+}
+
+// Sets *dispatched to the number of commands extracted from a lane so far
+// and *late to how many of them were past their deadline by then
+void buffer_lane_stats(struct buffer *cmd_buffer, int lane, long *dispatched, long *late)
+{
+        pthread_mutex_lock(&cmd_buffer->lock);
+        *dispatched = cmd_buffer->lanes[lane].dispatched;
+        *late = cmd_buffer->lanes[lane].late;
+        pthread_mutex_unlock(&cmd_buffer->lock);
+}
+
+// Marks the buffer as closed. Workers keep extracting until the buffer is
+// drained and then extract_cmd returns 0 so they can exit.
+void buffer_close(struct buffer *cmd_buffer)
+{
+        pthread_mutex_lock(&cmd_buffer->lock);
+        cmd_buffer->closed = 1;
+        pthread_cond_broadcast(&cmd_buffer->not_empty);
+        pthread_mutex_unlock(&cmd_buffer->lock);
+}
+
+void buffer_destroy(struct buffer *cmd_buffer)
+{
+        free_lanes(cmd_buffer, cmd_buffer->num_lanes);
+        pthread_cond_destroy(&cmd_buffer->not_full);
+        pthread_cond_destroy(&cmd_buffer->not_empty);
+        pthread_mutex_destroy(&cmd_buffer->lock);
+        free(cmd_buffer->slots);
+}
+
+// Moves the next command into curr_cmd_info: the head of the ring or, with
+// lanes, the earliest deadline of the lanes' heads. Called with the lock held
+// and at least one command queued.
+static void take_cmd(struct buffer *cmd_buffer, struct node *curr_cmd_info)
+{
+        struct lane *lane = NULL;
+        struct timeval now;
+        int i;
+
+        cmd_buffer->count--;
+        if (cmd_buffer->num_lanes == 0) {
+                *curr_cmd_info = cmd_buffer->slots[cmd_buffer->head];
+                cmd_buffer->head = (cmd_buffer->head + 1) % cmd_buffer->capacity;
+                pthread_cond_signal(&cmd_buffer->not_full);
+                return;
+        }
+        for (i = 0; i < cmd_buffer->num_lanes; i++) {
+                if (cmd_buffer->lanes[i].count > 0 &&
+                    (lane == NULL || before(&cmd_buffer->lanes[i].heap[0], &lane->heap[0]))) {
+                        lane = &cmd_buffer->lanes[i];
+                }
+        }
+        heap_pop(lane, curr_cmd_info);
+        lane->dispatched++;
+        gettimeofday(&now, NULL);
+        if (now.tv_sec * 1000000L + now.tv_usec > curr_cmd_info->deadline_us) {
+                lane->late++;
+        }
+        pthread_cond_signal(&lane->not_full);
+}
+
+// Returns 1 if a command was extracted into curr_cmd_info, 0 if the buffer
+// has been closed and every command has been handed out.
+// Blocks while the buffer is empty and still open.
+int extract_cmd(struct buffer *cmd_buffer, struct node *curr_cmd_info)
+{
+        int retval = 0;
+
+        pthread_mutex_lock(&cmd_buffer->lock);
+
+        while (cmd_buffer->count == 0 && !cmd_buffer->closed) {
+                pthread_cond_wait(&cmd_buffer->not_empty, &cmd_buffer->lock);
+        }
+
+        if (cmd_buffer->count > 0) {
+                take_cmd(cmd_buffer, curr_cmd_info);
+                retval = 1;
+        }
+
+        pthread_mutex_unlock(&cmd_buffer->lock);
+
+        return retval;
+}
+
+// Like extract_cmd, but gives up at deadline (CLOCK_REALTIME). Returns 1 if
+// a command was extracted, 0 if the buffer is closed and empty, -1 if the
+// deadline passed first.
+int extract_cmd_timed(struct buffer *cmd_buffer, struct node *curr_cmd_info, struct timespec *deadline)
+{
+        int retval = -1;
+
+        pthread_mutex_lock(&cmd_buffer->lock);
+
+        while (cmd_buffer->count == 0 && !cmd_buffer->closed) {
+                if (pthread_cond_timedwait(&cmd_buffer->not_empty, &cmd_buffer->lock,
+                                           deadline) == ETIMEDOUT) {
+                        break;
+                }
+        }
+
+        if (cmd_buffer->count > 0) {
+                take_cmd(cmd_buffer, curr_cmd_info);
+                retval = 1;
+        } else if (cmd_buffer->closed) {
+                retval = 0;
+        }
+
+        pthread_mutex_unlock(&cmd_buffer->lock);
+
+        return retval;
+}
+
+// Add a command to the tail of the ring. Blocks while the ring is full.
+// Returns nothing as this should always succeed.
+void add_cmd(struct buffer *cmd_buffer, struct command *command_to_add, int request_id, struct timeval tv_begin)
+{
+        struct node node_to_add;
+
+        node_to_add.cmd = *command_to_add;
+        node_to_add.request_id = request_id;
+        node_to_add.tv_begin = tv_begin;
+        node_to_add.ctx = NULL;
+        node_to_add.client = NULL;
+        node_to_add.tag = 0;
+        add_node(cmd_buffer, &node_to_add);
+}
+
+// Like add_cmd, for a node the dispatcher has already filled in. With lanes
+// it goes to its class's lane and only blocks while that lane is full.
+void add_node(struct buffer *cmd_buffer, struct node *node_to_add)
+{
+        struct lane *lane;
+        struct node queued;
+
+        pthread_mutex_lock(&cmd_buffer->lock);
+
+        if (cmd_buffer->num_lanes > 0) {
+                lane = &cmd_buffer->lanes[node_to_add->cmd.op == CMD_CHECK ?
+                                          LANE_CHECK : LANE_TRANS];
+                while (lane->count == cmd_buffer->capacity) {
+                        pthread_cond_wait(&lane->not_full, &cmd_buffer->lock);
+                }
+                queued = *node_to_add;
+                // At most MAX_DEADLINE_MS either way, so this can't overflow
+                queued.deadline_us = queued.tv_begin.tv_sec * 1000000L + queued.tv_begin.tv_usec +
+                                     (queued.cmd.deadline_ms > 0 ?
+                                      queued.cmd.deadline_ms * 1000L : lane->budget_us);
+                heap_push(lane, &queued);
+        } else {
+                while (cmd_buffer->count == cmd_buffer->capacity) {
+                        pthread_cond_wait(&cmd_buffer->not_full, &cmd_buffer->lock);
+                }
+
+                int tail = (cmd_buffer->head + cmd_buffer->count) % cmd_buffer->capacity;
+                cmd_buffer->slots[tail] = *node_to_add;
+        }
+        cmd_buffer->count++;
+
+        pthread_cond_signal(&cmd_buffer->not_empty);
+        pthread_mutex_unlock(&cmd_buffer->lock);
+}
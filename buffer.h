@@ -0,0 +1,69 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include "command.h"
+
+#define MAX_CMD_LEN 125 // Longest line of input
+#define DEFAULT_BUFFER_CAPACITY 1024
+
+// Lanes of a buffer set up with buffer_init_lanes
+#define LANE_CHECK 0
+#define LANE_TRANS 1
+#define NUM_LANES 2
+
+
+// A command waiting in the command buffer
+struct node {
+        struct command cmd;   // Command to be completed, already parsed
+        int request_id;
+        struct timeval tv_begin;
+        void *ctx;            // Attached by the dispatcher, usually NULL
+        void *client;         // Network client that sent it, NULL for stdin
+        unsigned int tag;     // Binary client's tag for the command
+        long deadline_us;     // Set by a buffer with lanes, since the epoch
+};
+
+// One lane of a buffer with lanes: a binary min-heap of the commands of one
+// class, earliest deadline first
+struct lane {
+        struct node *heap;
+        int count;
+        long budget_us;       // Deadline, after it was read, of a command that sets none
+        long dispatched;
+        long late;            // Extracted after their deadline had passed
+        pthread_cond_t not_full;
+};
+
+// Bounded ring of commands shared by the main thread (producer) and the
+// worker threads (consumers). Producers block while the ring is full and
+// consumers block while it is empty, so idle workers sleep on a condition
+// variable instead of spinning on the lock. With lanes, CHECK and TRANS wait
+// in a lane each instead of the ring and are extracted by deadline.
+struct buffer {
+        struct node *slots;   // Ring storage, capacity elements long
+        int capacity;         // Per lane with lanes
+        int head;             // Index of the next command to extract
+        int count;            // Number of commands currently queued, all lanes
+        int num_lanes;        // 0 for a plain ring
+        struct lane lanes[NUM_LANES];
+        int closed;           // Set once no more commands will be added
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+};
+
+
+int buffer_init(struct buffer *cmd_buffer, int capacity);
+int buffer_init_lanes(struct buffer *cmd_buffer, int capacity, int check_budget_ms, int trans_budget_ms);
+void buffer_lane_stats(struct buffer *cmd_buffer, int lane, long *dispatched, long *late);
+void buffer_close(struct buffer *cmd_buffer);
+void buffer_destroy(struct buffer *cmd_buffer);
+int extract_cmd(struct buffer *cmd_buffer, struct node *curr_cmd_info);
+int extract_cmd_timed(struct buffer *cmd_buffer, struct node *curr_cmd_info, struct timespec *deadline);
+void add_cmd(struct buffer *cmd_buffer, struct command *command_to_add, int request_id, struct timeval tv_begin);
+void add_node(struct buffer *cmd_buffer, struct node *node_to_add);
+
+#endif
@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "command.h"
+
+
+// Returns CMD_CHECK or CMD_TRANS for those commands, -1 otherwise
+int check_input(char *user_in)
+{
+        if (strncmp(user_in, "CHECK ", 6) == 0) {
+                return CMD_CHECK;
+        } else if (strncmp(user_in, "TRANS ", 6) == 0) {
+                return CMD_TRANS;
+        } else {
+                // disallowed request
+                return -1;
+        }
+}
+
+// Returns account number to check
+int parse_check_cmd(char *cmd)
+{
+        // Parse command for account number
+        int begin = 6;
+        int end = 6;
+        while(cmd[end] != '\0' && cmd[end] != ' ') {
+                end++;
+        }
+        char num[(end-begin) + 1];
+        char *begin_arr = &cmd[begin];
+        strncpy((char *) num, begin_arr, (end-begin) + 1);
+
+        return atoi(num);
+}
+
+// Fills transactions SORTED (lowest acc num to highest) and returns how many.
+// Returns -1 if there isn't at least one account/amount pair, a pair is
+// missing its amount, there are more than MAX_TRANSACTIONS pairs or an account
+// appears twice.
+int parse_trans_cmd(char *cmd, struct transaction transactions[MAX_TRANSACTIONS])
+{
+        // Need to pull account numbers out
+        int numbers[MAX_TRANSACTIONS * 2];
+        int count = 0;
+        int begin = 6;
+        int end = 6;
+
+        int cmd_len = strlen(cmd);
+
+        while (end < cmd_len) {
+                while (cmd[end] != ' ' && cmd[end] != '\0') {
+                        end++;
+                }
+                if (count == MAX_TRANSACTIONS * 2) {
+                        return -1;
+                }
+                char num[(end-begin) + 1];
+                char *begin_arr = &cmd[begin];
+                strncpy((char *) num, begin_arr, (end-begin) + 1);
+                numbers[count] = atoi(num);
+
+                // Reset for the next number to extract
+                count++;
+                end += 1;
+                begin = end;
+        }
+
+        int i = 0;
+        int trans_counter = 0;
+
+        if (count == 0 || count % 2 != 0) {
+                return -1;
+        }
+        for (i = 0; i < count; i += 2) {
+                transactions[trans_counter].account_number = numbers[i];
+                transactions[trans_counter].value = numbers[i+1];
+                trans_counter++;
+        }
+
+        // Need to sort the struct array smallest account_number to biggest
+        int j;
+        struct transaction temp;
+        for (i = 0; i < trans_counter; i++) {
+                for (j = i + 1; j < trans_counter; j++) {
+                        if (transactions[i].account_number > transactions[j].account_number) {
+                                temp = transactions[i];
+                                transactions[i] = transactions[j];
+                                transactions[j] = temp;
+                        }
+                }
+        }
+
+        // Sorted, so an account named twice sits next to itself
+        for (i = 1; i < trans_counter; i++) {
+                if (transactions[i].account_number == transactions[i-1].account_number) {
+                        return -1;
+                }
+        }
+
+        return trans_counter;
+}
+
+// Parses one line of input into cmd. A CHECK or TRANS may end in
+// "DEADLINE <ms>": how soon after being read it should reach a worker (see
+// buffer_init_lanes). Returns CMD_CHECK or CMD_TRANS, or -1 if it is neither,
+// a TRANS's pairs are malformed (see parse_trans_cmd) or its deadline isn't
+// a whole number from 1 to MAX_DEADLINE_MS ending the line. Account numbers
+// aren't checked.
+int command_parse(char *line, struct command *cmd)
+{
+        char *deadline = strstr(line, " DEADLINE ");
+        char *end;
+        long ms;
+
+        cmd->deadline_ms = 0;
+        if (deadline != NULL) {
+                errno = 0;
+                ms = strtol(deadline + strlen(" DEADLINE "), &end, 10);
+                if (errno != 0 || end == deadline + strlen(" DEADLINE ") ||
+                    *end != '\0' || ms < 1 || ms > MAX_DEADLINE_MS) {
+                        cmd->op = -1;
+                        return cmd->op;
+                }
+                cmd->deadline_ms = (int) ms;
+                // Hide it from the parsers below, which read to the end
+                *deadline = '\0';
+        }
+        cmd->op = check_input(line);
+        if (cmd->op == CMD_CHECK) {
+                cmd->num_transactions = 1;
+                cmd->transactions[0].account_number = parse_check_cmd(line);
+                cmd->transactions[0].value = 0;
+        } else if (cmd->op == CMD_TRANS) {
+                cmd->num_transactions = parse_trans_cmd(line, cmd->transactions);
+                if (cmd->num_transactions < 1) {
+                        cmd->op = -1;
+                }
+        }
+        if (deadline != NULL) {
+                *deadline = ' ';
+        }
+        return cmd->op;
+}
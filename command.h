@@ -0,0 +1,36 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <limits.h>
+
+// Commands are parsed and validated once, when they are submitted, and travel
+// to the workers in this binary form instead of as text.
+
+#define CMD_CHECK 1
+#define CMD_TRANS 2
+#define MAX_TRANSACTIONS 10 // Account/amount pairs one TRANS may carry
+#define MAX_DEADLINE_MS (INT_MAX / 1000) // Deadline still fits an int in us
+
+
+struct transaction {
+        int account_number;
+        int value;
+};
+
+// A CHECK has one transaction, whose value is unused. A TRANS has
+// num_transactions of them on distinct accounts; appserver sorts them by
+// account number.
+struct command {
+        int op;               // CMD_CHECK or CMD_TRANS
+        int num_transactions;
+        int deadline_ms;      // From DEADLINE, 0 to use its lane's default
+        struct transaction transactions[MAX_TRANSACTIONS];
+};
+
+
+int check_input(char *user_in);
+int parse_check_cmd(char *cmd);
+int parse_trans_cmd(char *cmd, struct transaction transactions[MAX_TRANSACTIONS]);
+int command_parse(char *line, struct command *cmd);
+
+#endif
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "epoch.h"
+
+#define CLAIM_INDEX_MASK 0xffffffffUL
+
+
+// Collects the next epoch into cmds: blocks for its first command, then takes
+// whatever else arrives within the window. Returns the number of commands,
+// 0 once the buffer is closed and drained.
+static int gather(struct epoch_sched *sched)
+{
+        struct timespec deadline;
+        int n;
+
+        if (extract_cmd(sched->input, &sched->cmds[0]) == 0) {
+                return 0;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += sched->window_us * 1000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        for (n = 1; n < sched->max_size; n++) {
+                if (extract_cmd_timed(sched->input, &sched->cmds[n], &deadline) != 1) {
+                        break;
+                }
+        }
+        return n;
+}
+
+// Assigns each of the n commands its wave and groups them by wave in order
+static void schedule(struct epoch_sched *sched, int n)
+{
+        int accounts[EPOCH_MAX_ACCOUNTS];
+        int i, j, k, a, w, writes, count, start;
+        unsigned int e;
+
+        sched->epoch_number++;
+        if (sched->epoch_number == 0) {
+                // Wrapped around: make every stamp stale again
+                memset(sched->stamp, 0, sizeof(unsigned int) * sched->num_accts);
+                sched->epoch_number = 1;
+        }
+        e = sched->epoch_number;
+
+        sched->num_waves = 0;
+        for (i = 0; i < n; i++) {
+                k = sched->footprint(&sched->cmds[i], accounts, &writes);
+                w = 0;
+                for (j = 0; j < k; j++) {
+                        a = accounts[j] - 1;
+                        if (sched->stamp[a] != e) {
+                                sched->stamp[a] = e;
+                                sched->last_write[a] = 0;
+                                sched->last_read[a] = 0;
+                        }
+                        if (sched->last_write[a] > w) {
+                                w = sched->last_write[a];
+                        }
+                        if (writes && sched->last_read[a] > w) {
+                                w = sched->last_read[a];
+                        }
+                }
+                w++;
+                for (j = 0; j < k; j++) {
+                        a = accounts[j] - 1;
+                        if (writes) {
+                                sched->last_write[a] = w;
+                        } else if (sched->last_read[a] < w) {
+                                sched->last_read[a] = w;
+                        }
+                }
+                sched->wave[i] = w;
+                if (w > sched->num_waves) {
+                        sched->num_waves = w;
+                }
+        }
+
+        // Counting sort by wave. Afterwards wave w is order[wave_start[w - 1]]
+        // up to order[wave_start[w]], each in request ID order.
+        memset(sched->wave_start, 0, sizeof(int) * (sched->num_waves + 1));
+        for (i = 0; i < n; i++) {
+                sched->wave_start[sched->wave[i]]++;
+        }
+        start = 0;
+        for (w = 1; w <= sched->num_waves; w++) {
+                count = sched->wave_start[w];
+                sched->wave_start[w] = start;
+                start += count;
+        }
+        for (i = 0; i < n; i++) {
+                sched->order[sched->wave_start[sched->wave[i]]++] = i;
+        }
+}
+
+// Publishes order[begin..end) to the workers and waits until all of it ran
+static void run_wave(struct epoch_sched *sched, int begin, int end)
+{
+        pthread_mutex_lock(&sched->lock);
+        sched->generation++;
+        sched->end = end;
+        sched->wave_size = end - begin;
+        atomic_store(&sched->finished, 0);
+        atomic_store(&sched->claim, ((sched->generation & CLAIM_INDEX_MASK) << 32) | begin);
+        pthread_cond_broadcast(&sched->go);
+        while (atomic_load(&sched->finished) < sched->wave_size) {
+                pthread_cond_wait(&sched->done, &sched->lock);
+        }
+        pthread_mutex_unlock(&sched->lock);
+}
+
+// Scheduler thread: gathers, schedules and runs epochs until the buffer is
+// closed and drained, then lets the workers go
+static void *sched_routine(void *arg)
+{
+        struct epoch_sched *sched = (struct epoch_sched *) arg;
+        int n, w;
+
+        while ((n = gather(sched)) > 0) {
+                schedule(sched, n);
+                for (w = 1; w <= sched->num_waves; w++) {
+                        run_wave(sched, sched->wave_start[w - 1], sched->wave_start[w]);
+                }
+                sched->epochs++;
+                sched->waves += sched->num_waves;
+                sched->commands += n;
+        }
+
+        pthread_mutex_lock(&sched->lock);
+        sched->closing = 1;
+        pthread_cond_broadcast(&sched->go);
+        pthread_mutex_unlock(&sched->lock);
+        return NULL;
+}
+
+// Sets up the scheduler for a bank of num_accts accounts and starts its
+// thread, which reads commands from input.
+// Returns 1 if succeeded, 0 if error.
+int epoch_init(struct epoch_sched *sched, struct buffer *input, int num_accts,
+               int max_size, int window_us, epoch_footprint footprint,
+               epoch_execute execute, void *ctx)
+{
+        sched->input = input;
+        sched->max_size = max_size;
+        sched->window_us = window_us;
+        sched->footprint = footprint;
+        sched->execute = execute;
+        sched->ctx = ctx;
+        sched->num_accts = num_accts;
+        sched->epoch_number = 0;
+        sched->generation = 0;
+        sched->closing = 0;
+        sched->epochs = 0;
+        sched->waves = 0;
+        sched->commands = 0;
+        atomic_init(&sched->claim, 0);
+        atomic_init(&sched->finished, 0);
+
+        sched->cmds = (struct node*)malloc(sizeof(struct node) * max_size);
+        sched->wave = (int*)malloc(sizeof(int) * max_size);
+        sched->order = (int*)malloc(sizeof(int) * max_size);
+        sched->wave_start = (int*)malloc(sizeof(int) * (max_size + 1));
+        sched->stamp = (unsigned int*)calloc(num_accts, sizeof(unsigned int));
+        sched->last_write = (int*)malloc(sizeof(int) * num_accts);
+        sched->last_read = (int*)malloc(sizeof(int) * num_accts);
+        if (sched->cmds == NULL || sched->wave == NULL || sched->order == NULL ||
+            sched->wave_start == NULL || sched->stamp == NULL ||
+            sched->last_write == NULL || sched->last_read == NULL) {
+                return 0;
+        }
+
+        if (pthread_mutex_init(&sched->lock, NULL) != 0 ||
+            pthread_cond_init(&sched->go, NULL) != 0 ||
+            pthread_cond_init(&sched->done, NULL) != 0 ||
+            pthread_create(&sched->thread, NULL, sched_routine, sched) != 0) {
+                return 0;
+        }
+        return 1;
+}
+
+// Worker side: runs commands of each published wave until the scheduler
+// closes. Called by every worker thread.
+void epoch_worker(struct epoch_sched *sched)
+{
+        unsigned long seen = 0;
+        unsigned long claim, gen;
+        int end, size;
+
+        pthread_mutex_lock(&sched->lock);
+        for (;;) {
+                while (sched->generation == seen && !sched->closing) {
+                        pthread_cond_wait(&sched->go, &sched->lock);
+                }
+                if (sched->generation == seen) {
+                        break;
+                }
+                seen = sched->generation;
+                end = sched->end;
+                size = sched->wave_size;
+                pthread_mutex_unlock(&sched->lock);
+
+                gen = (seen & CLAIM_INDEX_MASK) << 32;
+                claim = atomic_load(&sched->claim);
+                while ((claim & ~CLAIM_INDEX_MASK) == gen &&
+                       (int) (claim & CLAIM_INDEX_MASK) < end) {
+                        if (!atomic_compare_exchange_weak(&sched->claim, &claim, claim + 1)) {
+                                continue;
+                        }
+                        sched->execute(sched->ctx,
+                                       &sched->cmds[sched->order[claim & CLAIM_INDEX_MASK]]);
+                        if (atomic_fetch_add(&sched->finished, 1) + 1 == size) {
+                                pthread_mutex_lock(&sched->lock);
+                                pthread_cond_signal(&sched->done);
+                                pthread_mutex_unlock(&sched->lock);
+                        }
+                        claim = atomic_load(&sched->claim);
+                }
+
+                pthread_mutex_lock(&sched->lock);
+        }
+        pthread_mutex_unlock(&sched->lock);
+}
+
+// Waits for the scheduler thread, which exits once the input buffer is
+// closed and drained, and prints how well commands were batched
+void epoch_destroy(struct epoch_sched *sched)
+{
+        pthread_join(sched->thread, NULL);
+        printf("Epochs: %ld, waves: %ld, commands: %ld (%.1f per wave)\n",
+               sched->epochs, sched->waves, sched->commands,
+               sched->waves ? (double) sched->commands / sched->waves : 0.0);
+        pthread_cond_destroy(&sched->done);
+        pthread_cond_destroy(&sched->go);
+        pthread_mutex_destroy(&sched->lock);
+        free(sched->cmds);
+        free(sched->wave);
+        free(sched->order);
+        free(sched->wave_start);
+        free(sched->stamp);
+        free(sched->last_write);
+        free(sched->last_read);
+}
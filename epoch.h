@@ -0,0 +1,78 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "buffer.h"
+
+#define DEFAULT_EPOCH_SIZE 256
+#define DEFAULT_EPOCH_US 200
+#define EPOCH_MAX_ACCOUNTS 10 // Accounts one command can touch
+
+
+// Fills accounts with the accounts a command touches and returns how many.
+// Sets *writes if the command may change them.
+typedef int (*epoch_footprint)(struct node *cmd, int accounts[EPOCH_MAX_ACCOUNTS], int *writes);
+
+// Runs one command without taking any account lock
+typedef void (*epoch_execute)(void *ctx, struct node *cmd);
+
+// Deterministic batch scheduler. A scheduler thread gathers commands from
+// the buffer into an epoch (until it holds max_size commands or window_us
+// has passed since the first), then places every command in a wave one past
+// the last earlier command it conflicts with: a TRANS conflicts with any
+// command on the same account, a CHECK only with a TRANS. Commands of one
+// wave touch disjoint accounts, so the workers run them in parallel without
+// locks; waves run one after another. Conflicting commands therefore run in
+// request ID order and the outcome is the same as running the whole input
+// serially, on every run.
+struct epoch_sched {
+        struct buffer *input;
+        int max_size;
+        int window_us;
+        epoch_footprint footprint;
+        epoch_execute execute;
+        void *ctx;
+
+        // Current epoch
+        struct node *cmds;
+        int *wave;            // Wave of each command, from 1
+        int *order;           // Command indexes grouped by wave
+        int *wave_start;      // Where each wave begins in order
+        int num_waves;
+
+        // Last wave that wrote/read each account, valid when its stamp
+        // matches the epoch number, so nothing is cleared between epochs
+        int num_accts;
+        unsigned int *stamp;
+        int *last_write;
+        int *last_read;
+        unsigned int epoch_number;
+
+        // Hand-off of one wave to the workers. claim packs the generation in
+        // its high half and the next index into order in its low half, so a
+        // worker still finishing one wave can never claim from the next.
+        pthread_mutex_t lock;
+        pthread_cond_t go;
+        pthread_cond_t done;
+        unsigned long generation;
+        int end;              // End of the published wave in order
+        int wave_size;
+        atomic_ulong claim;
+        atomic_int finished;
+        int closing;
+        pthread_t thread;
+
+        long epochs;
+        long waves;
+        long commands;
+};
+
+
+int epoch_init(struct epoch_sched *sched, struct buffer *input, int num_accts,
+               int max_size, int window_us, epoch_footprint footprint,
+               epoch_execute execute, void *ctx);
+void epoch_worker(struct epoch_sched *sched);
+void epoch_destroy(struct epoch_sched *sched);
+
+#endif
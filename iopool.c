@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include "iopool.h"
+#include "storage.h"
+
+
+static void run_job(struct io_job *job)
+{
+        if (job->write) {
+                storage_write(job->ID, *job->value);
+        } else {
+                *job->value = storage_read(job->ID);
+        }
+}
+
+static void *io_routine(void *args)
+{
+        struct io_pool *pool = (struct io_pool*) args;
+        struct io_job *job;
+        struct io_batch *batch;
+
+        for (;;) {
+                pthread_mutex_lock(&pool->lock);
+                while (pool->head == NULL && !pool->stopping) {
+                        pthread_cond_wait(&pool->not_empty, &pool->lock);
+                }
+                if (pool->head == NULL) {
+                        pthread_mutex_unlock(&pool->lock);
+                        break;
+                }
+                job = pool->head;
+                pool->head = job->next;
+                if (pool->head == NULL) {
+                        pool->tail = NULL;
+                }
+                pthread_mutex_unlock(&pool->lock);
+
+                // The job lives on the submitter's stack, so read the batch
+                // pointer before the submitter can wake and return
+                batch = job->batch;
+                run_job(job);
+                pthread_mutex_lock(&batch->lock);
+                if (--batch->remaining == 0) {
+                        pthread_cond_signal(&batch->done);
+                }
+                pthread_mutex_unlock(&batch->lock);
+        }
+        return NULL;
+}
+
+// Starts num_threads I/O threads. Returns 1 if succeeded, 0 if error.
+int io_pool_init(struct io_pool *pool, int num_threads)
+{
+        int i;
+
+        pool->head = NULL;
+        pool->tail = NULL;
+        pool->stopping = 0;
+        pool->num_threads = num_threads;
+        pool->threads = (pthread_t*)malloc(sizeof(pthread_t)*num_threads);
+        if (pool->threads == NULL ||
+            pthread_mutex_init(&pool->lock, NULL) != 0 ||
+            pthread_cond_init(&pool->not_empty, NULL) != 0) {
+                return 0;
+        }
+        for (i = 0; i < num_threads; i++) {
+                if (pthread_create(&pool->threads[i], NULL, io_routine,
+                                   (void *) pool) != 0) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+// Finishes every queued job and joins the I/O threads
+void io_pool_destroy(struct io_pool *pool)
+{
+        int i;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = 1;
+        pthread_cond_broadcast(&pool->not_empty);
+        pthread_mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->num_threads; i++) {
+                pthread_join(pool->threads[i], NULL);
+        }
+        pthread_cond_destroy(&pool->not_empty);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+}
+
+// Queues all but the first access for the I/O threads, does the first one
+// on the calling thread and returns once every access has finished
+static void run_batch(struct io_pool *pool, int write, int *IDs, int *values, int n)
+{
+        struct io_job jobs[n];
+        struct io_batch batch;
+        int i;
+
+        if (n == 0) {
+                return;
+        }
+        batch.remaining = n - 1;
+        pthread_mutex_init(&batch.lock, NULL);
+        pthread_cond_init(&batch.done, NULL);
+
+        for (i = 0; i < n; i++) {
+                jobs[i].write = write;
+                jobs[i].ID = IDs[i];
+                jobs[i].value = &values[i];
+                jobs[i].batch = &batch;
+                jobs[i].next = (i + 1 < n) ? &jobs[i + 1] : NULL;
+        }
+        if (n > 1) {
+                pthread_mutex_lock(&pool->lock);
+                if (pool->tail == NULL) {
+                        pool->head = &jobs[1];
+                } else {
+                        pool->tail->next = &jobs[1];
+                }
+                pool->tail = &jobs[n - 1];
+                pthread_cond_broadcast(&pool->not_empty);
+                pthread_mutex_unlock(&pool->lock);
+        }
+
+        run_job(&jobs[0]);
+
+        pthread_mutex_lock(&batch.lock);
+        while (batch.remaining > 0) {
+                pthread_cond_wait(&batch.done, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        pthread_cond_destroy(&batch.done);
+        pthread_mutex_destroy(&batch.lock);
+}
+
+// values[i] = storage_read(IDs[i]) for every i, with the reads overlapped
+void io_pool_read(struct io_pool *pool, int *IDs, int *values, int n)
+{
+        run_batch(pool, 0, IDs, values, n);
+}
+
+// storage_write(IDs[i], values[i]) for every i, with the writes overlapped
+void io_pool_write(struct io_pool *pool, int *IDs, int *values, int n)
+{
+        run_batch(pool, 1, IDs, values, n);
+}
@@ -0,0 +1,42 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <pthread.h>
+
+
+// One storage access waiting for an I/O thread
+struct io_job {
+        int write;            // 1 for storage_write, 0 for storage_read
+        int ID;
+        int *value;           // Value to write, or where to put the read
+        struct io_batch *batch;
+        struct io_job *next;
+};
+
+// The accesses one caller issued together; the caller sleeps on done until
+// remaining reaches 0
+struct io_batch {
+        int remaining;
+        pthread_mutex_t lock;
+        pthread_cond_t done;
+};
+
+// Small pool of threads that carry out storage accesses so the accounts of
+// one TRANS are read (and later written) concurrently instead of one by one.
+struct io_pool {
+        struct io_job *head;  // FIFO of queued jobs
+        struct io_job *tail;
+        int stopping;
+        int num_threads;
+        pthread_t *threads;
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+};
+
+
+int io_pool_init(struct io_pool *pool, int num_threads);
+void io_pool_destroy(struct io_pool *pool);
+void io_pool_read(struct io_pool *pool, int *IDs, int *values, int n);
+void io_pool_write(struct io_pool *pool, int *IDs, int *values, int n);
+
+#endif
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+
+// Load generator for appserver and appserver-coarse. Starts the server with
+// its stdin connected to a pipe, writes a generated workload of CHECK/TRANS
+// commands followed by END, then reads the TIME stamps back out of the
+// server's output file and prints one CSV row of throughput and latency.
+
+#define MAX_LEGS 10
+#define MAX_LINE_LEN 256
+#define DEFAULT_REQUESTS 200
+#define DEFAULT_ACCOUNTS 100
+#define DEFAULT_THREADS 4
+
+#define SKEW_UNIFORM 0
+#define SKEW_ZIPF 1
+
+
+// CUSTOM STRUCTURES
+struct workload {
+        char *server;         // Path to the server binary
+        char **server_extra;  // Extra server arguments (after --)
+        int num_extra;
+        int threads;
+        int accounts;
+        int requests;
+        int check_pct;        // Percentage of commands that are CHECKs
+        int legs;             // Accounts per TRANS
+        int max_amount;       // TRANS amounts are in [-max_amount, max_amount]
+        int skew;
+        double zipf_s;        // Zipf exponent
+        unsigned int seed;
+        int keep_log;
+        int histogram;        // Print a latency histogram to stderr
+};
+
+struct results {
+        int completed;
+        int isf;
+        double seconds;       // First command received to last one finished
+        long *latencies_us;   // One per completed command, sorted
+};
+
+
+// FUNCTION PROTOTYPES
+void usage();
+double *build_zipf_cdf(int accounts, double s);
+int pick_account(struct workload *w, double *zipf_cdf);
+void generate(struct workload *w, FILE *server_in);
+int run_server(struct workload *w, char *log_filename);
+int parse_log(char *log_filename, struct results *r, int requests);
+int compare_long(const void *a, const void *b);
+long percentile(struct results *r, double p);
+void print_histogram(struct results *r);
+
+
+int main(int argc, char **argv)
+{
+        struct workload w;
+        struct results r;
+        char log_filename[64];
+        char *skew_name;
+
+        w.server = "./appserver";
+        w.server_extra = NULL;
+        w.num_extra = 0;
+        w.threads = DEFAULT_THREADS;
+        w.accounts = DEFAULT_ACCOUNTS;
+        w.requests = DEFAULT_REQUESTS;
+        w.check_pct = 50;
+        w.legs = 1;
+        w.max_amount = 100;
+        w.skew = SKEW_UNIFORM;
+        w.zipf_s = 0.99;
+        w.seed = 1;
+        w.keep_log = 0;
+        w.histogram = 0;
+
+        static struct option long_opts[] = {
+                {"server", required_argument, NULL, 'S'},
+                {"threads", required_argument, NULL, 't'},
+                {"accounts", required_argument, NULL, 'a'},
+                {"requests", required_argument, NULL, 'n'},
+                {"check-pct", required_argument, NULL, 'c'},
+                {"legs", required_argument, NULL, 'l'},
+                {"max-amount", required_argument, NULL, 'm'},
+                {"skew", required_argument, NULL, 'k'},
+                {"zipf-s", required_argument, NULL, 'z'},
+                {"seed", required_argument, NULL, 's'},
+                {"keep-log", no_argument, NULL, 'K'},
+                {"histogram", no_argument, NULL, 'H'},
+                {"csv-header", no_argument, NULL, 'C'},
+                {0, 0, 0, 0}
+        };
+        int opt;
+        while ((opt = getopt_long(argc, argv, "S:t:a:n:c:l:m:k:z:s:KHC",
+                                  long_opts, NULL)) != -1) {
+                switch (opt) {
+                case 'S':
+                        w.server = optarg;
+                        break;
+                case 't':
+                        w.threads = atoi(optarg);
+                        break;
+                case 'a':
+                        w.accounts = atoi(optarg);
+                        break;
+                case 'n':
+                        w.requests = atoi(optarg);
+                        break;
+                case 'c':
+                        w.check_pct = atoi(optarg);
+                        break;
+                case 'l':
+                        w.legs = atoi(optarg);
+                        break;
+                case 'm':
+                        w.max_amount = atoi(optarg);
+                        break;
+                case 'k':
+                        if (strcmp(optarg, "uniform") == 0) {
+                                w.skew = SKEW_UNIFORM;
+                        } else if (strcmp(optarg, "zipf") == 0) {
+                                w.skew = SKEW_ZIPF;
+                        } else {
+                                usage();
+                        }
+                        break;
+                case 'z':
+                        w.zipf_s = atof(optarg);
+                        break;
+                case 's':
+                        w.seed = atoi(optarg);
+                        break;
+                case 'K':
+                        w.keep_log = 1;
+                        break;
+                case 'H':
+                        w.histogram = 1;
+                        break;
+                case 'C':
+                        printf("server,threads,accounts,requests,check_pct,"
+                               "legs,skew,completed,isf,seconds,throughput_rps,"
+                               "mean_ms,p50_ms,p99_ms,p999_ms,max_ms\n");
+                        exit(EXIT_SUCCESS);
+                default:
+                        usage();
+                }
+        }
+        // Anything after -- is passed through to the server
+        w.server_extra = &argv[optind];
+        w.num_extra = argc - optind;
+
+        if (w.threads < 1 || w.accounts < 1 || w.requests < 1 ||
+            w.check_pct < 0 || w.check_pct > 100 || w.legs < 1 ||
+            w.legs > MAX_LEGS || w.max_amount < 0) {
+                usage();
+        }
+
+        snprintf(log_filename, sizeof(log_filename), "loadgen-%d.log", getpid());
+        if (run_server(&w, log_filename) != 0) {
+                fprintf(stderr, "Server did not exit cleanly.\n");
+                exit(EXIT_FAILURE);
+        }
+        if (parse_log(log_filename, &r, w.requests) == 0) {
+                fprintf(stderr, "Failed to read %s\n", log_filename);
+                exit(EXIT_FAILURE);
+        }
+        if (!w.keep_log) {
+                unlink(log_filename);
+        }
+        if (r.completed < w.requests) {
+                fprintf(stderr, "Only %d of %d commands completed.\n",
+                        r.completed, w.requests);
+        }
+
+        double mean = 0;
+        int i;
+        for (i = 0; i < r.completed; i++) {
+                mean += r.latencies_us[i];
+        }
+        mean = r.completed > 0 ? mean / r.completed : 0;
+
+        skew_name = w.skew == SKEW_ZIPF ? "zipf" : "uniform";
+        printf("%s,%d,%d,%d,%d,%d,%s,%d,%d,%.6f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+               w.server, w.threads, w.accounts, w.requests, w.check_pct,
+               w.legs, skew_name, r.completed, r.isf, r.seconds,
+               r.seconds > 0 ? r.completed / r.seconds : 0,
+               mean / 1000.0, percentile(&r, 0.50) / 1000.0,
+               percentile(&r, 0.99) / 1000.0, percentile(&r, 0.999) / 1000.0,
+               r.completed > 0 ? r.latencies_us[r.completed - 1] / 1000.0 : 0);
+
+        if (w.histogram) {
+                print_histogram(&r);
+        }
+
+        free(r.latencies_us);
+        exit(EXIT_SUCCESS);
+}
+
+void usage()
+{
+        fprintf(stderr, "\nUSAGE: ./loadgen [options] [-- <server options>]\n"
+                "\n  -S, --server <path>     server binary (default ./appserver)"
+                "\n  -t, --threads <n>       server worker threads (default %d)"
+                "\n  -a, --accounts <n>      server accounts (default %d)"
+                "\n  -n, --requests <n>      commands to send (default %d)"
+                "\n  -c, --check-pct <n>     percent of commands that are CHECK"
+                " (default 50)"
+                "\n  -l, --legs <n>          accounts per TRANS, 1 to %d"
+                " (default 1)"
+                "\n  -m, --max-amount <n>    TRANS amounts in [-n, n]"
+                " (default 100)"
+                "\n  -k, --skew <kind>       uniform or zipf (default uniform)"
+                "\n  -z, --zipf-s <s>        zipf exponent (default 0.99)"
+                "\n  -s, --seed <n>          random seed (default 1)"
+                "\n  -K, --keep-log          keep the server's output file"
+                "\n  -H, --histogram         print a latency histogram to stderr"
+                "\n  -C, --csv-header        print the CSV header and exit\n\n",
+                DEFAULT_THREADS, DEFAULT_ACCOUNTS, DEFAULT_REQUESTS, MAX_LEGS);
+        exit(EXIT_FAILURE);
+}
+
+// Cumulative distribution over accounts 1..accounts where account k is
+// picked with probability proportional to 1 / k^s
+double *build_zipf_cdf(int accounts, double s)
+{
+        double *cdf = (double*)malloc(sizeof(double)*accounts);
+        double total = 0;
+        int i;
+
+        if (cdf == NULL) {
+                perror("Failed to allocate the zipf distribution");
+                exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < accounts; i++) {
+                total += 1.0 / pow(i + 1, s);
+                cdf[i] = total;
+        }
+        for (i = 0; i < accounts; i++) {
+                cdf[i] /= total;
+        }
+        return cdf;
+}
+
+// Returns an account number between 1 and accounts
+int pick_account(struct workload *w, double *zipf_cdf)
+{
+        if (w->skew == SKEW_UNIFORM) {
+                return rand() % w->accounts + 1;
+        }
+
+        double u = (double) rand() / ((double) RAND_MAX + 1);
+        int lo = 0;
+        int hi = w->accounts - 1;
+        while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (zipf_cdf[mid] < u) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo + 1;
+}
+
+// Writes the workload, one command per line, followed by END
+void generate(struct workload *w, FILE *server_in)
+{
+        double *zipf_cdf = NULL;
+        int used[MAX_LEGS];
+        int i, j, k, acc, dup;
+
+        if (w->skew == SKEW_ZIPF) {
+                zipf_cdf = build_zipf_cdf(w->accounts, w->zipf_s);
+        }
+        srand(w->seed);
+
+        for (i = 0; i < w->requests; i++) {
+                if (rand() % 100 < w->check_pct) {
+                        fprintf(server_in, "CHECK %d\n", pick_account(w, zipf_cdf));
+                        continue;
+                }
+
+                fprintf(server_in, "TRANS");
+                // Legs must name distinct accounts, so there are at most as
+                // many legs as accounts
+                for (j = 0; j < w->legs && j < w->accounts; j++) {
+                        do {
+                                acc = pick_account(w, zipf_cdf);
+                                dup = 0;
+                                for (k = 0; k < j; k++) {
+                                        dup |= used[k] == acc;
+                                }
+                        } while (dup);
+                        used[j] = acc;
+                        fprintf(server_in, " %d %d", acc,
+                                rand() % (2 * w->max_amount + 1) - w->max_amount);
+                }
+                fprintf(server_in, "\n");
+        }
+        fprintf(server_in, "END\n");
+        free(zipf_cdf);
+}
+
+// Starts the server, feeds it the workload and waits for it to exit.
+// Returns 0 if the server exited successfully.
+int run_server(struct workload *w, char *log_filename)
+{
+        char threads[16], accounts[16];
+        char *server_argv[w->num_extra + 5];
+        int fds[2];
+        int status, i;
+        pid_t pid;
+
+        unlink(log_filename);
+        snprintf(threads, sizeof(threads), "%d", w->threads);
+        snprintf(accounts, sizeof(accounts), "%d", w->accounts);
+        server_argv[0] = w->server;
+        server_argv[1] = threads;
+        server_argv[2] = accounts;
+        server_argv[3] = log_filename;
+        for (i = 0; i < w->num_extra; i++) {
+                server_argv[4 + i] = w->server_extra[i];
+        }
+        server_argv[4 + w->num_extra] = NULL;
+
+        if (pipe(fds) != 0) {
+                perror("pipe() error");
+                return -1;
+        }
+        pid = fork();
+        if (pid < 0) {
+                perror("fork() error");
+                return -1;
+        }
+        if (pid == 0) {
+                dup2(fds[0], STDIN_FILENO);
+                close(fds[0]);
+                close(fds[1]);
+                freopen("/dev/null", "w", stdout);
+                execv(w->server, server_argv);
+                perror("execv() error");
+                _exit(127);
+        }
+
+        close(fds[0]);
+        signal(SIGPIPE, SIG_IGN);
+        FILE *server_in = fdopen(fds[1], "w");
+        generate(w, server_in);
+        fclose(server_in);
+
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Reads every "<id> ... TIME <begin> <end>" line of the server's output file.
+// Returns 1 if succeeded, 0 if error.
+int parse_log(char *log_filename, struct results *r, int requests)
+{
+        char line[MAX_LINE_LEN];
+        long b_sec, b_usec, e_sec, e_usec;
+        double first_begin = 0, last_end = 0, begin, end;
+        char *time_field;
+        FILE *fp = fopen(log_filename, "r");
+
+        if (fp == NULL) {
+                return 0;
+        }
+        r->completed = 0;
+        r->isf = 0;
+        r->latencies_us = (long*)malloc(sizeof(long)*requests);
+        if (r->latencies_us == NULL) {
+                perror("Failed to allocate latencies");
+                exit(EXIT_FAILURE);
+        }
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                time_field = strstr(line, " TIME ");
+                if (time_field == NULL || r->completed == requests ||
+                    sscanf(time_field, " TIME %ld.%ld %ld.%ld",
+                           &b_sec, &b_usec, &e_sec, &e_usec) != 4) {
+                        continue;
+                }
+                if (strstr(line, " ISF ") != NULL) {
+                        r->isf++;
+                }
+                r->latencies_us[r->completed++] =
+                        (e_sec - b_sec) * 1000000 + (e_usec - b_usec);
+
+                begin = b_sec + b_usec / 1e6;
+                end = e_sec + e_usec / 1e6;
+                if (first_begin == 0 || begin < first_begin) {
+                        first_begin = begin;
+                }
+                if (end > last_end) {
+                        last_end = end;
+                }
+        }
+        fclose(fp);
+
+        r->seconds = last_end - first_begin;
+        qsort(r->latencies_us, r->completed, sizeof(long), compare_long);
+        return 1;
+}
+
+int compare_long(const void *a, const void *b)
+{
+        long x = *(const long *) a;
+        long y = *(const long *) b;
+        return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of the sorted latencies, in microseconds
+long percentile(struct results *r, double p)
+{
+        if (r->completed == 0) {
+                return 0;
+        }
+        int rank = (int) ceil(p * r->completed);
+        if (rank < 1) {
+                rank = 1;
+        }
+        return r->latencies_us[rank - 1];
+}
+
+// Power-of-two latency buckets, one line per non-empty bucket
+void print_histogram(struct results *r)
+{
+        int counts[64] = {0};
+        int i, bucket;
+        long lat;
+
+        for (i = 0; i < r->completed; i++) {
+                lat = r->latencies_us[i];
+                bucket = 0;
+                while (lat > 1 && bucket < 63) {
+                        lat >>= 1;
+                        bucket++;
+                }
+                counts[bucket]++;
+        }
+        fprintf(stderr, "latency_us_upto,count\n");
+        for (i = 0; i < 64; i++) {
+                if (counts[i] > 0) {
+                        fprintf(stderr, "%ld,%d\n", 2L << i, counts[i]);
+                }
+        }
+}
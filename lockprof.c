@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lockprof.h"
+
+
+static long now_ns()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Charges one acquisition to the account, with the time it waited if the
+// lock was not free
+static void record(struct lock_profile *prof, int account_number, long waited_ns)
+{
+        struct lock_profile_entry *e = &prof->entries[account_number - 1];
+        unsigned long max;
+
+        atomic_fetch_add_explicit(&e->acquires, 1, memory_order_relaxed);
+        if (waited_ns < 0) {
+                return;
+        }
+        atomic_fetch_add_explicit(&e->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&e->wait_ns, waited_ns, memory_order_relaxed);
+        max = atomic_load_explicit(&e->max_wait_ns, memory_order_relaxed);
+        while ((unsigned long) waited_ns > max &&
+               !atomic_compare_exchange_weak_explicit(&e->max_wait_ns, &max, waited_ns,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+        }
+}
+
+// Allocates an entry per account; lockprof_report lists the top busiest,
+// which can be no more than every account. top must be at least 1.
+// Returns 1 if succeeded, 0 if error.
+int lockprof_init(struct lock_profile *prof, int num_accts, int top)
+{
+        prof->num_accts = num_accts;
+        prof->top = top < num_accts ? top : num_accts;
+        prof->entries = (struct lock_profile_entry*)calloc(num_accts,
+                        sizeof(struct lock_profile_entry));
+        prof->hot = (int*)malloc(sizeof(int) * prof->top);
+        prof->hot_wait = (unsigned long*)malloc(sizeof(unsigned long) * prof->top);
+        if (prof->entries == NULL || prof->hot == NULL || prof->hot_wait == NULL ||
+            pthread_mutex_init(&prof->report_lock, NULL) != 0) {
+                free(prof->entries);
+                free(prof->hot);
+                free(prof->hot_wait);
+                return 0;
+        }
+        return 1;
+}
+
+// pthread_rwlock_rdlock, counting the acquisition against account_number
+void lockprof_rdlock(struct lock_profile *prof, pthread_rwlock_t *lock, int account_number)
+{
+        long start;
+
+        if (pthread_rwlock_tryrdlock(lock) == 0) {
+                record(prof, account_number, -1);
+                return;
+        }
+        start = now_ns();
+        pthread_rwlock_rdlock(lock);
+        record(prof, account_number, now_ns() - start);
+}
+
+// pthread_rwlock_wrlock, counting the acquisition against account_number
+void lockprof_wrlock(struct lock_profile *prof, pthread_rwlock_t *lock, int account_number)
+{
+        long start;
+
+        if (pthread_rwlock_trywrlock(lock) == 0) {
+                record(prof, account_number, -1);
+                return;
+        }
+        start = now_ns();
+        pthread_rwlock_wrlock(lock);
+        record(prof, account_number, now_ns() - start);
+}
+
+// Lists the accounts that waited longest for their lock, most first, one
+// line each. Returns the length written.
+int lockprof_report(struct lock_profile *prof, char *out, int len)
+{
+        int *hot = prof->hot;
+        unsigned long *hot_wait = prof->hot_wait;
+        unsigned long wait;
+        struct lock_profile_entry *e;
+        int count = 0;
+        int i, j, n;
+
+        pthread_mutex_lock(&prof->report_lock);
+        // Keep the top accounts sorted by wait in one pass over the table
+        for (i = 0; i < prof->num_accts; i++) {
+                e = &prof->entries[i];
+                if (atomic_load_explicit(&e->acquires, memory_order_relaxed) == 0) {
+                        continue;
+                }
+                wait = atomic_load_explicit(&e->wait_ns, memory_order_relaxed);
+                if (count == prof->top && wait <= hot_wait[count - 1]) {
+                        continue;
+                }
+                if (count < prof->top) {
+                        count++;
+                }
+                for (j = count - 1; j > 0 && hot_wait[j - 1] < wait; j--) {
+                        hot[j] = hot[j - 1];
+                        hot_wait[j] = hot_wait[j - 1];
+                }
+                hot[j] = i;
+                hot_wait[j] = wait;
+        }
+
+        n = snprintf(out, len, "LOCKS top %d of %d accounts by lock wait\n"
+                     "%8s %12s %12s %12s %12s", count, prof->num_accts,
+                     "account", "acquires", "contended", "wait_us", "max_wait_us");
+        for (i = 0; i < count && n < len; i++) {
+                e = &prof->entries[hot[i]];
+                n += snprintf(out + n, len - n, "\n%8d %12lu %12lu %12lu %12lu",
+                              hot[i] + 1,
+                              atomic_load_explicit(&e->acquires, memory_order_relaxed),
+                              atomic_load_explicit(&e->contended, memory_order_relaxed),
+                              atomic_load_explicit(&e->wait_ns, memory_order_relaxed) / 1000,
+                              atomic_load_explicit(&e->max_wait_ns, memory_order_relaxed) / 1000);
+        }
+        pthread_mutex_unlock(&prof->report_lock);
+        return n < len ? n : len - 1;
+}
+
+void lockprof_destroy(struct lock_profile *prof)
+{
+        pthread_mutex_destroy(&prof->report_lock);
+        free(prof->hot_wait);
+        free(prof->hot);
+        free(prof->entries);
+}
@@ -0,0 +1,37 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define LOCK_PROFILE_LINE_LEN 64 // Upper bound of one report line
+
+
+// Contention seen by one account's lock. Acquisitions that got the lock
+// straight away only bump acquires; the rest are timed.
+struct lock_profile_entry {
+        atomic_ulong acquires;
+        atomic_ulong contended;   // Acquisitions that had to wait
+        atomic_ulong wait_ns;     // Total time spent waiting
+        atomic_ulong max_wait_ns;
+};
+
+// Opt-in lock contention profile, one entry per account. A stripe lock taken
+// for a command is charged to the account the command needed it for.
+struct lock_profile {
+        struct lock_profile_entry *entries;
+        int num_accts;
+        int top;              // Accounts listed by lockprof_report
+        int *hot;             // lockprof_report's top accounts, in wait order
+        unsigned long *hot_wait;
+        pthread_mutex_t report_lock; // Stdin and clients can both ask for LOCKS
+};
+
+
+int lockprof_init(struct lock_profile *prof, int num_accts, int top);
+void lockprof_rdlock(struct lock_profile *prof, pthread_rwlock_t *lock, int account_number);
+void lockprof_wrlock(struct lock_profile *prof, pthread_rwlock_t *lock, int account_number);
+int lockprof_report(struct lock_profile *prof, char *out, int len);
+void lockprof_destroy(struct lock_profile *prof);
+
+#endif
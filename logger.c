@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "logger.h"
+
+#define RING_MASK (LOG_RING_CAPACITY - 1)
+
+
+static long elapsed_ms(struct timespec *since)
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - since->tv_sec) * 1000 +
+               (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Waits until the batch submitted to io_uring has been written, resubmitting
+// what a short write left over
+static void wait_batch(struct logger *log)
+{
+        unsigned long user_data;
+        int res;
+
+        while (log->writing_len > 0) {
+                if (!uring_completion(&log->ring, &user_data, &res)) {
+                        uring_submit(&log->ring, 1);
+                        continue;
+                }
+                if (res == -EINTR || res == -EAGAIN) {
+                        res = 0;
+                } else if (res < 0) {
+                        errno = -res;
+                        perror("Failed to write log");
+                        log->writing_len = 0;
+                        break;
+                }
+                log->writing += res;
+                log->writing_len -= res;
+                if (log->writing_len > 0) {
+                        uring_sqe(&log->ring, IORING_OP_WRITE, log->fd, log->writing,
+                                  log->writing_len, 0);
+                }
+        }
+}
+
+// Writes the whole batch, retrying on short writes and interrupts. With
+// io_uring the batch is only submitted, after waiting for the previous one,
+// and *batch is swapped for the spare buffer to fill meanwhile.
+static void flush_batch(struct logger *log, char **batch, int *len)
+{
+        int done = 0;
+        ssize_t n;
+        char *submitted;
+
+        if (log->use_uring) {
+                wait_batch(log);
+                if (*len > 0) {
+                        // O_APPEND: the kernel appends whatever the offset
+                        uring_sqe(&log->ring, IORING_OP_WRITE, log->fd, *batch, *len, 0);
+                        uring_submit(&log->ring, 0);
+                        log->writing = *batch;
+                        log->writing_len = *len;
+                        submitted = *batch;
+                        *batch = log->spare;
+                        log->spare = submitted;
+                }
+                *len = 0;
+                return;
+        }
+        while (done < *len) {
+                n = write(log->fd, *batch + done, *len - done);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("Failed to write log");
+                        break;
+                }
+                done += n;
+        }
+        *len = 0;
+}
+
+// Moves every finished line from the ring into the batch, stopping early if
+// the batch is full. Returns the number of lines moved.
+static int drain_ring(struct logger *log, char *batch, int *len, size_t batch_size)
+{
+        struct log_slot *slot;
+        int moved = 0;
+
+        for (;;) {
+                slot = &log->slots[log->head & RING_MASK];
+                if (atomic_load_explicit(&slot->seq, memory_order_acquire) !=
+                    log->head + 1) {
+                        break;
+                }
+                if ((size_t) (*len + slot->len) > batch_size) {
+                        break;
+                }
+                memcpy(batch + *len, slot->line, slot->len);
+                *len += slot->len;
+                atomic_store_explicit(&slot->seq, log->head + LOG_RING_CAPACITY,
+                                      memory_order_release);
+                log->head++;
+                moved++;
+        }
+        return moved;
+}
+
+static void *writer_routine(void *args)
+{
+        struct logger *log = (struct logger*) args;
+        size_t batch_size = log->batch_size;
+        char *batch = log->batch;
+        int len = 0;
+        struct timespec first_line; // When the oldest unflushed line arrived
+        struct timespec nap;
+        long wait_ms;
+
+        for (;;) {
+                int was_empty = (len == 0);
+                int moved = drain_ring(log, batch, &len, batch_size);
+                if (was_empty && len > 0) {
+                        clock_gettime(CLOCK_MONOTONIC, &first_line);
+                }
+
+                if (len >= log->flush_bytes ||
+                    (len > 0 && elapsed_ms(&first_line) >= log->flush_ms)) {
+                        flush_batch(log, &batch, &len);
+                        continue;
+                }
+                if (moved > 0) {
+                        continue;
+                }
+
+                if (atomic_load(&log->closing)) {
+                        // Workers have stopped; anything left is in the batch
+                        drain_ring(log, batch, &len, batch_size);
+                        flush_batch(log, &batch, &len);
+                        if (log->use_uring) {
+                                wait_batch(log);
+                        }
+                        break;
+                }
+
+                if (len > 0) {
+                        // Hold the batch until the flush interval expires
+                        wait_ms = log->flush_ms - elapsed_ms(&first_line);
+                        nap.tv_sec = wait_ms / 1000;
+                        nap.tv_nsec = (wait_ms % 1000) * 1000000;
+                        nanosleep(&nap, NULL);
+                        continue;
+                }
+
+                // Nothing to do: sleep until a worker posts a line. Re-check
+                // the ring after announcing so a concurrent post isn't lost.
+                // The fence pairs with the one in log_line: either this drain
+                // sees the worker's line or the worker sees writer_idle set.
+                atomic_store(&log->writer_idle, 1);
+                atomic_thread_fence(memory_order_seq_cst);
+                if (drain_ring(log, batch, &len, batch_size) > 0 ||
+                    atomic_load(&log->closing)) {
+                        if (atomic_exchange(&log->writer_idle, 0) == 0) {
+                                sem_wait(&log->wake); // consume the post
+                        }
+                        if (len > 0) {
+                                clock_gettime(CLOCK_MONOTONIC, &first_line);
+                        }
+                        continue;
+                }
+                sem_wait(&log->wake);
+        }
+
+        free(batch);
+        free(log->spare);
+        return NULL;
+}
+
+// Opens (creating if needed) the log file for appending and starts the
+// writer thread. A NULL filename gives a logger that drops every line.
+// flush_bytes must be at most LOG_MAX_FLUSH_BYTES.
+// With use_uring the writer submits batches through io_uring if the kernel
+// has it; use_uring is cleared in log if it doesn't.
+// Returns 1 if succeeded, 0 if error.
+int logger_init(struct logger *log, char *filename, int flush_bytes, int flush_ms, int use_uring)
+{
+        unsigned long i;
+
+        if (filename == NULL) {
+                log->fd = -1;
+                return 1;
+        }
+        log->fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (log->fd < 0) {
+                return 0;
+        }
+        log->slots = (struct log_slot*)malloc(sizeof(struct log_slot)*LOG_RING_CAPACITY);
+        if (log->slots == NULL) {
+                close(log->fd);
+                return 0;
+        }
+        for (i = 0; i < LOG_RING_CAPACITY; i++) {
+                atomic_init(&log->slots[i].seq, i);
+        }
+        log->flush_bytes = flush_bytes;
+        log->flush_ms = flush_ms;
+        // Room for a whole ring on top of a batch about to be flushed
+        log->batch_size = (size_t) flush_bytes + LOG_RING_CAPACITY * LOG_LINE_LEN;
+        log->batch = (char*)malloc(log->batch_size);
+        if (log->batch == NULL) {
+                free(log->slots);
+                close(log->fd);
+                return 0;
+        }
+        log->use_uring = use_uring && uring_init(&log->ring, 8);
+        log->writing_len = 0;
+        log->spare = NULL;
+        if (log->use_uring) {
+                log->spare = (char*)malloc(log->batch_size);
+                if (log->spare == NULL) {
+                        uring_destroy(&log->ring);
+                        log->use_uring = 0;
+                }
+        }
+        log->head = 0;
+        atomic_init(&log->tail, 0);
+        atomic_init(&log->writer_idle, 0);
+        atomic_init(&log->closing, 0);
+        if (sem_init(&log->wake, 0, 0) != 0) {
+                if (log->use_uring) {
+                        free(log->spare);
+                        uring_destroy(&log->ring);
+                }
+                free(log->batch);
+                free(log->slots);
+                close(log->fd);
+                return 0;
+        }
+        if (pthread_create(&log->writer, NULL, writer_routine, (void *) log) != 0) {
+                sem_destroy(&log->wake);
+                if (log->use_uring) {
+                        free(log->spare);
+                        uring_destroy(&log->ring);
+                }
+                free(log->batch);
+                free(log->slots);
+                close(log->fd);
+                return 0;
+        }
+        return 1;
+}
+
+// printf-style append of one line to the log. Never touches the file; the
+// line is formatted into a ring slot and the writer thread picks it up.
+// Yields while the ring is full.
+void log_line(struct logger *log, const char *fmt, ...)
+{
+        unsigned long pos = atomic_load_explicit(&log->tail, memory_order_relaxed);
+        struct log_slot *slot;
+        unsigned long seq;
+        va_list ap;
+
+        if (log->fd < 0) {
+                return;
+        }
+        for (;;) {
+                slot = &log->slots[pos & RING_MASK];
+                seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+                if (seq == pos) {
+                        if (atomic_compare_exchange_weak_explicit(&log->tail,
+                                        &pos, pos + 1, memory_order_relaxed,
+                                        memory_order_relaxed)) {
+                                break;
+                        }
+                } else if ((long)(seq - pos) < 0) {
+                        // Ring is full, let the writer catch up
+                        sched_yield();
+                        pos = atomic_load_explicit(&log->tail, memory_order_relaxed);
+                } else {
+                        pos = atomic_load_explicit(&log->tail, memory_order_relaxed);
+                }
+        }
+
+        va_start(ap, fmt);
+        slot->len = vsnprintf(slot->line, LOG_LINE_LEN, fmt, ap);
+        va_end(ap);
+        if (slot->len >= LOG_LINE_LEN) {
+                slot->len = LOG_LINE_LEN - 1;
+        }
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+        // Keep the writer_idle load from moving ahead of the store above,
+        // or the writer could go to sleep without seeing this line
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&log->writer_idle, memory_order_relaxed) &&
+            atomic_exchange(&log->writer_idle, 0) == 1) {
+                sem_post(&log->wake);
+        }
+}
+
+// Flushes every pending line, stops the writer thread and closes the file.
+// Call only after all workers have stopped logging.
+void logger_close(struct logger *log)
+{
+        if (log->fd < 0) {
+                return;
+        }
+        atomic_store(&log->closing, 1);
+        if (atomic_exchange(&log->writer_idle, 0) == 1) {
+                sem_post(&log->wake);
+        }
+        pthread_join(log->writer, NULL);
+        if (log->use_uring) {
+                uring_destroy(&log->ring);
+        }
+        sem_destroy(&log->wake);
+        free(log->slots);
+        close(log->fd);
+}
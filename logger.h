@@ -0,0 +1,57 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "uring.h"
+
+#define LOG_LINE_LEN 128
+#define LOG_RING_CAPACITY 4096          // Must be a power of two
+#define DEFAULT_LOG_FLUSH_BYTES 65536
+#define DEFAULT_LOG_FLUSH_MS 10
+// Largest flush_bytes whose batch, with room for a full ring on top, still
+// has an int length
+#define LOG_MAX_FLUSH_BYTES (INT_MAX - LOG_RING_CAPACITY * LOG_LINE_LEN)
+
+
+// One formatted log line waiting for the writer thread
+struct log_slot {
+        atomic_ulong seq;
+        int len;
+        char line[LOG_LINE_LEN];
+};
+
+// Asynchronous log writer. Workers format their line straight into a slot
+// of a lock-free ring; a single writer thread copies finished lines into a
+// batch and appends it to the (kept open) log file with one write() once the
+// batch reaches flush_bytes or flush_ms has passed since its first line.
+// With io_uring the writer submits the batch and goes on filling a second
+// one instead of waiting for the write.
+struct logger {
+        int fd;
+        int use_uring;
+        struct uring ring;
+        char *batch;          // Batch the writer fills
+        size_t batch_size;    // Bytes in batch and spare
+        char *spare;          // Batch being filled while the other is written
+        char *writing;        // Unwritten part of the submitted batch
+        int writing_len;
+        int flush_bytes;
+        int flush_ms;
+        _Alignas(64) atomic_ulong tail;  // Next slot a worker will claim
+        _Alignas(64) unsigned long head; // Next slot the writer will read
+        atomic_int writer_idle;          // Writer is asleep on wake
+        atomic_int closing;
+        sem_t wake;
+        pthread_t writer;
+        struct log_slot *slots;
+};
+
+
+int logger_init(struct logger *log, char *filename, int flush_bytes, int flush_ms, int use_uring);
+void log_line(struct logger *log, const char *fmt, ...);
+void logger_close(struct logger *log);
+
+#endif
@@ -0,0 +1,292 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+
+static char *stage_names[NUM_STAGES] = {
+        "queue", "lock", "storage", "wal", "log", "service", "total",
+        "queue_check", "queue_trans"
+};
+
+// Shard of the calling thread, NULL for threads that aren't workers
+static __thread struct metrics_shard *local_shard;
+
+
+// Sums every shard's histogram of one stage into merged
+static void merge_stage(struct metrics *m, int stage, unsigned long *count,
+                        unsigned long *sum_us, unsigned long *max_us,
+                        unsigned long buckets[METRICS_BUCKETS])
+{
+        struct stage_histogram *h;
+        unsigned long max;
+        int i, b;
+
+        *count = 0;
+        *sum_us = 0;
+        *max_us = 0;
+        memset(buckets, 0, sizeof(unsigned long) * METRICS_BUCKETS);
+        for (i = 0; i < m->num_shards; i++) {
+                h = &m->shards[i].stages[stage];
+                *count += atomic_load_explicit(&h->count, memory_order_relaxed);
+                *sum_us += atomic_load_explicit(&h->sum_us, memory_order_relaxed);
+                max = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+                if (max > *max_us) {
+                        *max_us = max;
+                }
+                for (b = 0; b < METRICS_BUCKETS; b++) {
+                        buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+                }
+        }
+}
+
+// Upper bound, in microseconds, of the bucket holding the given fraction
+// of the samples
+static unsigned long percentile(unsigned long count,
+                                unsigned long buckets[METRICS_BUCKETS],
+                                double fraction)
+{
+        unsigned long seen = 0;
+        int b;
+
+        for (b = 0; b < METRICS_BUCKETS; b++) {
+                seen += buckets[b];
+                if (seen > 0 && seen >= fraction * count) {
+                        break;
+                }
+        }
+        return 1UL << (b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1);
+}
+
+// Commands waiting for a worker and commands a worker is running
+static void gauges(struct metrics *m, long *queued, long *in_flight)
+{
+        unsigned long started = 0, finished = 0;
+        int i;
+
+        for (i = 0; i < m->num_shards; i++) {
+                started += atomic_load_explicit(&m->shards[i].stages[STAGE_QUEUE].count,
+                                                memory_order_relaxed);
+                finished += atomic_load_explicit(&m->shards[i].stages[STAGE_TOTAL].count,
+                                                 memory_order_relaxed);
+        }
+        *queued = atomic_load(&m->submitted) - (long) started;
+        *in_flight = (long) started - (long) finished;
+        // The counters are read one after another, not at one instant
+        if (*queued < 0) {
+                *queued = 0;
+        }
+        if (*in_flight < 0) {
+                *in_flight = 0;
+        }
+}
+
+// Writes every metric in the Prometheus text format to path, through a
+// temporary file so a scraper never sees half of it.
+// Returns 1 if succeeded, 0 if error.
+static int write_prometheus(struct metrics *m, char *path)
+{
+        char tmp_path[strlen(path) + 5];
+        unsigned long count, sum_us, max_us, buckets[METRICS_BUCKETS];
+        unsigned long cumulative;
+        long queued, in_flight;
+        FILE *f;
+        int s, b;
+
+        sprintf(tmp_path, "%s.tmp", path);
+        f = fopen(tmp_path, "w");
+        if (f == NULL) {
+                return 0;
+        }
+        gauges(m, &queued, &in_flight);
+        fprintf(f, "# HELP appserver_commands_submitted_total Commands handed to the workers.\n"
+                "# TYPE appserver_commands_submitted_total counter\n"
+                "appserver_commands_submitted_total %ld\n",
+                atomic_load(&m->submitted));
+        fprintf(f, "# HELP appserver_queue_depth Commands waiting for a worker.\n"
+                "# TYPE appserver_queue_depth gauge\n"
+                "appserver_queue_depth %ld\n", queued);
+        fprintf(f, "# HELP appserver_in_flight Commands being run by a worker.\n"
+                "# TYPE appserver_in_flight gauge\n"
+                "appserver_in_flight %ld\n", in_flight);
+        fprintf(f, "# HELP appserver_stage_seconds Time commands spend in each stage.\n"
+                "# TYPE appserver_stage_seconds histogram\n");
+        for (s = 0; s < NUM_STAGES; s++) {
+                merge_stage(m, s, &count, &sum_us, &max_us, buckets);
+                cumulative = 0;
+                for (b = 0; b < METRICS_BUCKETS; b++) {
+                        cumulative += buckets[b];
+                        fprintf(f, "appserver_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+                                stage_names[s], (double) (1UL << b) / 1e6, cumulative);
+                }
+                fprintf(f, "appserver_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+                        "appserver_stage_seconds_sum{stage=\"%s\"} %.6f\n"
+                        "appserver_stage_seconds_count{stage=\"%s\"} %lu\n",
+                        stage_names[s], count, stage_names[s], sum_us / 1e6,
+                        stage_names[s], count);
+        }
+
+        if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+                return 0;
+        }
+        return 1;
+}
+
+// Dumper thread: rewrites the metrics file every interval_ms until stopped
+static void *dump_routine(void *arg)
+{
+        struct metrics *m = (struct metrics *) arg;
+        struct timespec deadline;
+
+        pthread_mutex_lock(&m->lock);
+        while (!m->stopping) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += m->interval_ms / 1000;
+                deadline.tv_nsec += (m->interval_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000L;
+                }
+                while (!m->stopping &&
+                       pthread_cond_timedwait(&m->wake, &m->lock, &deadline) != ETIMEDOUT) {
+                }
+                if (m->stopping) {
+                        break;
+                }
+                pthread_mutex_unlock(&m->lock);
+                if (write_prometheus(m, m->path) == 0) {
+                        fprintf(stderr, "Failed to write metrics to %s\n", m->path);
+                }
+                pthread_mutex_lock(&m->lock);
+        }
+        pthread_mutex_unlock(&m->lock);
+        return NULL;
+}
+
+// Allocates one shard per worker thread.
+// Returns 1 if succeeded, 0 if error.
+int metrics_init(struct metrics *m, int num_shards)
+{
+        m->shards = (struct metrics_shard*)aligned_alloc(64,
+                        sizeof(struct metrics_shard) * num_shards);
+        if (m->shards == NULL) {
+                return 0;
+        }
+        memset(m->shards, 0, sizeof(struct metrics_shard) * num_shards);
+        m->num_shards = num_shards;
+        m->path = NULL;
+        m->stopping = 0;
+        atomic_init(&m->submitted, 0);
+        return 1;
+}
+
+// Makes the calling thread record into the given shard
+void metrics_bind(struct metrics *m, int shard)
+{
+        local_shard = &m->shards[shard];
+}
+
+// Current time in microseconds, on the same clock as the command timestamps
+long metrics_now()
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+// Microseconds since tv
+long metrics_since(struct timeval *tv)
+{
+        return metrics_now() - (tv->tv_sec * 1000000L + tv->tv_usec);
+}
+
+// Adds one sample to the calling thread's histogram of the stage. Does
+// nothing on threads that were never bound to a shard.
+void metrics_record(int stage, long us)
+{
+        struct stage_histogram *h;
+        unsigned long value = us > 0 ? us : 0;
+        int b = value == 0 ? 0 : 64 - __builtin_clzl(value);
+
+        if (local_shard == NULL) {
+                return;
+        }
+        if (b >= METRICS_BUCKETS) {
+                b = METRICS_BUCKETS - 1;
+        }
+        // Single writer: plain load and store instead of a locked add
+        h = &local_shard->stages[stage];
+        atomic_store_explicit(&h->count, atomic_load_explicit(&h->count, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        atomic_store_explicit(&h->sum_us, atomic_load_explicit(&h->sum_us, memory_order_relaxed) + value,
+                              memory_order_relaxed);
+        if (value > atomic_load_explicit(&h->max_us, memory_order_relaxed)) {
+                atomic_store_explicit(&h->max_us, value, memory_order_relaxed);
+        }
+        atomic_store_explicit(&h->buckets[b], atomic_load_explicit(&h->buckets[b], memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+}
+
+// Counts one command handed to the workers
+void metrics_submitted(struct metrics *m)
+{
+        atomic_fetch_add_explicit(&m->submitted, 1, memory_order_relaxed);
+}
+
+// Formats the merged metrics as the reply to STATS, one line per stage.
+// Returns the length written.
+int metrics_report(struct metrics *m, char *out, int len)
+{
+        unsigned long count, sum_us, max_us, buckets[METRICS_BUCKETS];
+        long queued, in_flight;
+        int n, s;
+
+        gauges(m, &queued, &in_flight);
+        n = snprintf(out, len, "STATS submitted %ld queued %ld in-flight %ld\n"
+                     "%-11s %10s %10s %10s %10s %10s",
+                     atomic_load(&m->submitted), queued, in_flight,
+                     "stage", "count", "mean_us", "p50_us", "p99_us", "max_us");
+        for (s = 0; s < NUM_STAGES && n < len; s++) {
+                merge_stage(m, s, &count, &sum_us, &max_us, buckets);
+                n += snprintf(out + n, len - n, "\n%-11s %10lu %10lu %10lu %10lu %10lu",
+                              stage_names[s], count, count ? sum_us / count : 0,
+                              count ? percentile(count, buckets, 0.50) : 0,
+                              count ? percentile(count, buckets, 0.99) : 0,
+                              max_us);
+        }
+        return n < len ? n : len - 1;
+}
+
+// Starts rewriting path with the metrics every interval_ms.
+// Returns 1 if succeeded, 0 if error.
+int metrics_start_dump(struct metrics *m, char *path, int interval_ms)
+{
+        m->path = path;
+        m->interval_ms = interval_ms;
+        if (pthread_mutex_init(&m->lock, NULL) != 0 ||
+            pthread_cond_init(&m->wake, NULL) != 0 ||
+            pthread_create(&m->dumper, NULL, dump_routine, m) != 0) {
+                return 0;
+        }
+        return 1;
+}
+
+// Stops the dumper, if any, after writing the metrics file one last time
+void metrics_destroy(struct metrics *m)
+{
+        if (m->path != NULL) {
+                pthread_mutex_lock(&m->lock);
+                m->stopping = 1;
+                pthread_cond_signal(&m->wake);
+                pthread_mutex_unlock(&m->lock);
+                pthread_join(m->dumper, NULL);
+                if (write_prometheus(m, m->path) == 0) {
+                        fprintf(stderr, "Failed to write metrics to %s\n", m->path);
+                }
+                pthread_cond_destroy(&m->wake);
+                pthread_mutex_destroy(&m->lock);
+        }
+        free(m->shards);
+}
@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+// Where a command spends its time, from being read to being logged
+#define STAGE_QUEUE 0    // Waiting in the command buffer for a worker
+#define STAGE_LOCK 1     // Waiting for account locks
+#define STAGE_STORAGE 2  // Reading and writing balances
+#define STAGE_WAL 3      // Waiting for the WAL to be durable
+#define STAGE_LOG 4      // Handing the result line to the logger
+#define STAGE_SERVICE 5  // Picked up by a worker until finished
+#define STAGE_TOTAL 6    // Read until finished
+// STAGE_QUEUE again, split by class, for tuning the lanes (--lanes)
+#define STAGE_QUEUE_CHECK 7
+#define STAGE_QUEUE_TRANS 8
+#define NUM_STAGES 9
+
+// Bucket i counts latencies below 2^i microseconds (and at least 2^(i-1))
+#define METRICS_BUCKETS 32
+#define DEFAULT_METRICS_INTERVAL_MS 1000
+#define METRICS_REPORT_LEN 1024
+
+
+// Latency histogram of one stage. Only the owning thread writes it, so the
+// counters are relaxed atomics just to let STATS read them while it does.
+struct stage_histogram {
+        atomic_ulong count;
+        atomic_ulong sum_us;
+        atomic_ulong max_us;
+        atomic_ulong buckets[METRICS_BUCKETS];
+};
+
+// One per worker thread, on its own cache lines
+struct metrics_shard {
+        _Alignas(64) struct stage_histogram stages[NUM_STAGES];
+};
+
+// Per-thread latency histograms, merged when they are read. Queue depth and
+// in-flight commands follow from the submitted count and the number of
+// commands that entered and left the worker stages.
+struct metrics {
+        struct metrics_shard *shards;
+        int num_shards;
+        atomic_long submitted;
+        char *path;           // Prometheus text file, or NULL
+        int interval_ms;
+        int stopping;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        pthread_t dumper;
+};
+
+
+int metrics_init(struct metrics *m, int num_shards);
+void metrics_bind(struct metrics *m, int shard);
+long metrics_now();
+long metrics_since(struct timeval *tv);
+void metrics_record(int stage, long us);
+void metrics_submitted(struct metrics *m);
+int metrics_report(struct metrics *m, char *out, int len);
+int metrics_start_dump(struct metrics *m, char *path, int interval_ms);
+void metrics_destroy(struct metrics *m);
+
+#endif
@@ -0,0 +1,858 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include "buffer.h" // MAX_CMD_LEN
+#include "wire.h"
+#include "net.h"
+
+#define PROTOCOL_UNKNOWN 0    // Nothing received yet
+#define PROTOCOL_TEXT 1
+#define PROTOCOL_BINARY 2
+
+// io_uring user_data: a client with the operation in the low bits (calloc
+// alignment leaves them clear), or the operation alone for the listener's
+// own file descriptors
+#define URING_RECV 0
+#define URING_SEND 1
+#define URING_ACCEPT 2
+#define URING_WAKE 3
+#define URING_DONE 4
+#define URING_STOP 5
+#define URING_OP_MASK 7UL
+
+
+// Per-client state. Input is collected until a newline (or, for a binary
+// client, a whole frame) arrives; replies are queued in out and flushed
+// whenever the socket is writable. A client that disconnects while results
+// are still owed to it is closed but kept as a zombie (fd -1) until the
+// last of them arrives, so workers never hold a dangling pointer.
+struct client {
+        int fd;
+        int pending;          // Results the workers still have to post
+        int dirty;            // Has results queued in the current batch
+        struct client *dirty_next;
+        int protocol;         // Chosen by the first byte the client sends
+        int in_len;
+        int discarding;       // Current line was too long, skip to newline
+        int closing;          // Close once out has been flushed
+        int failed;           // Out of memory for its output: drop it now
+        int lost;             // Results that couldn't be posted (done_lock)
+        struct client *lost_next;
+        char in[MAX_CMD_LEN]; // Also holds a binary frame, WIRE_REQUEST_MAX bytes
+        char *out;
+        int out_len;
+        int out_cap;
+        int inflight;         // io_uring operations not yet completed
+        char *rbuf;           // io_uring: filled by the pending recv
+        char *send;           // io_uring: output the pending send is sending
+        int send_len;
+        int send_cap;
+        int sent;
+        struct client *prev;  // Every connected client (or zombie) is kept
+        struct client *next;  // in a list so they can be freed on shutdown
+};
+
+
+static int set_nonblocking(int fd)
+{
+        int flags = fcntl(fd, F_GETFL, 0);
+        return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Removes c from the list whose head is *head
+static void unlink_client(struct client **head, struct client *c)
+{
+        if (c->prev != NULL) {
+                c->prev->next = c->next;
+        } else {
+                *head = c->next;
+        }
+        if (c->next != NULL) {
+                c->next->prev = c->prev;
+        }
+}
+
+static void free_client(struct client *c)
+{
+        free(c->out);
+        free(c->send);
+        free(c->rbuf);
+        free(c);
+}
+
+static void drop_client(struct net_listener *net, struct client *c)
+{
+        unlink_client(&net->clients, c);
+        if (net->use_uring) {
+                // Ends the pending recv, whose completion then finds fd -1
+                shutdown(c->fd, SHUT_RDWR);
+        } else {
+                epoll_ctl(net->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        }
+        close(c->fd);
+        net->num_clients--;
+        if (c->pending > 0 || c->inflight > 0) {
+                c->fd = -1;
+                c->prev = NULL;
+                c->next = net->zombies;
+                if (net->zombies != NULL) {
+                        net->zombies->prev = c;
+                }
+                net->zombies = c;
+                return;
+        }
+        free_client(c);
+}
+
+static void free_zombie(struct net_listener *net, struct client *c)
+{
+        unlink_client(&net->zombies, c);
+        free_client(c);
+}
+
+// Frees a zombie once no result or io_uring operation refers to it
+static void release_zombie(struct net_listener *net, struct client *c)
+{
+        if (c->pending == 0 && c->inflight == 0) {
+                free_zombie(net, c);
+        }
+}
+
+static void uring_recv(struct net_listener *net, struct client *c)
+{
+        uring_sqe(&net->ring, IORING_OP_RECV, c->fd, c->rbuf, NET_RECV_LEN,
+                  (unsigned long) c | URING_RECV);
+        c->inflight++;
+}
+
+// Sends what is left of the output handed to the pending send
+static void uring_send(struct net_listener *net, struct client *c)
+{
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_sqe(&net->ring, IORING_OP_SEND, c->fd, c->send + c->sent,
+                        c->send_len - c->sent, (unsigned long) c | URING_SEND);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        c->inflight++;
+}
+
+// io_uring counterpart of flush_client: starts a send of the pending output
+// unless one is under way. Returns -1 if the client should be dropped.
+static int uring_flush(struct net_listener *net, struct client *c)
+{
+        char *out = c->out;
+        int out_cap = c->out_cap;
+
+        if (c->send_len > 0) {
+                return 0;
+        }
+        if (c->out_len == 0) {
+                return c->closing && c->pending == 0 ? -1 : 0;
+        }
+        // The kernel reads send until the send completes, so output queued
+        // meanwhile goes to the other buffer
+        c->out = c->send;
+        c->out_cap = c->send_cap;
+        c->send = out;
+        c->send_cap = out_cap;
+        c->send_len = c->out_len;
+        c->sent = 0;
+        c->out_len = 0;
+        uring_send(net, c);
+        return 0;
+}
+
+// Appends to the output. If it can't grow, the client is marked failed,
+// which makes the next flush_client drop it.
+static void queue_output(struct client *c, char *data, int len)
+{
+        char *out;
+
+        if (c->failed) {
+                return;
+        }
+        if (c->out_len + len > c->out_cap) {
+                out = (char*)realloc(c->out, (c->out_len + len) * 2);
+                if (out == NULL) {
+                        c->failed = 1;
+                        c->closing = 1;
+                        return;
+                }
+                c->out = out;
+                c->out_cap = (c->out_len + len) * 2;
+        }
+        memcpy(c->out + c->out_len, data, len);
+        c->out_len += len;
+}
+
+static void queue_reply(struct client *c, char *reply, int len)
+{
+        queue_output(c, reply, len);
+        queue_output(c, "\n", 1);
+}
+
+// Sends as much of the pending output as the socket takes. Watches for
+// EPOLLOUT only while output is left over. Returns -1 if the client is gone
+// or failed.
+static int flush_client(struct net_listener *net, struct client *c)
+{
+        struct epoll_event ev;
+        ssize_t n;
+        int sent = 0;
+
+        if (c->failed) {
+                return -1;
+        }
+
+        if (net->use_uring) {
+                return uring_flush(net, c);
+        }
+        while (sent < c->out_len) {
+                n = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                break;
+                        }
+                        return -1;
+                }
+                sent += n;
+        }
+        memmove(c->out, c->out + sent, c->out_len - sent);
+        c->out_len -= sent;
+
+        ev.events = EPOLLIN | (c->out_len > 0 ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(net->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+
+        if (c->out_len == 0 && c->closing && c->pending == 0) {
+                return -1;
+        }
+        return 0;
+}
+
+// Collects what a binary client sent into frames and hands each whole one to
+// the binary handler. A frame with an impossible length can't be skipped, so
+// it is answered with WIRE_INVALID and the connection is closed.
+static void handle_binary(struct net_listener *net, struct client *c, char *data, int len)
+{
+        unsigned char reply[WIRE_RESPONSE_LEN];
+        struct wire_response invalid = { .result = WIRE_INVALID };
+        int i = 0;
+        int frame_len, take;
+
+        while (i < len && !c->closing) {
+                // Until the length has arrived, read just the length
+                frame_len = wire_frame_length((unsigned char *) c->in, c->in_len);
+                take = (frame_len == 0 ? 2 : frame_len) - c->in_len;
+                if (take > len - i) {
+                        take = len - i;
+                }
+                memcpy(c->in + c->in_len, data + i, take);
+                c->in_len += take;
+                i += take;
+
+                frame_len = wire_frame_length((unsigned char *) c->in, c->in_len);
+                if (frame_len < 0) {
+                        wire_encode_response(&invalid, reply);
+                        queue_output(c, (char *) reply, WIRE_RESPONSE_LEN);
+                        c->closing = 1;
+                } else if (frame_len > 0 && c->in_len == frame_len) {
+                        if (net->binary_handler(net->ctx, c, (unsigned char *) c->in, reply) < 0) {
+                                c->closing = 1;
+                        }
+                        queue_output(c, (char *) reply, WIRE_RESPONSE_LEN);
+                        c->in_len = 0;
+                }
+        }
+}
+
+// Splits what was read into lines and hands each one to the handler. The
+// first byte of a connection decides whether it is text or binary.
+static void handle_input(struct net_listener *net, struct client *c, char *data, int len)
+{
+        char reply[NET_REPLY_LEN];
+        int i, n;
+
+        if (c->protocol == PROTOCOL_UNKNOWN) {
+                if ((unsigned char) data[0] == WIRE_HELLO) {
+                        c->protocol = PROTOCOL_BINARY;
+                        data++;
+                        len--;
+                } else {
+                        c->protocol = PROTOCOL_TEXT;
+                }
+        }
+        if (c->protocol == PROTOCOL_BINARY) {
+                handle_binary(net, c, data, len);
+                return;
+        }
+
+        for (i = 0; i < len && !c->closing; i++) {
+                if (data[i] != '\n') {
+                        if (c->in_len < MAX_CMD_LEN - 1) {
+                                c->in[c->in_len++] = data[i];
+                        } else {
+                                c->discarding = 1;
+                        }
+                        continue;
+                }
+
+                if (c->discarding) {
+                        n = snprintf(reply, sizeof(reply), "Command too long.");
+                        queue_reply(c, reply, n);
+                } else {
+                        if (c->in_len > 0 && c->in[c->in_len - 1] == '\r') {
+                                c->in_len--;
+                        }
+                        c->in[c->in_len] = '\0';
+                        reply[0] = '\0';
+                        if (net->handler(net->ctx, c, c->in, reply, sizeof(reply)) < 0) {
+                                c->closing = 1;
+                        }
+                        queue_reply(c, reply, strlen(reply));
+                }
+                c->in_len = 0;
+                c->discarding = 0;
+        }
+}
+
+// Sends every result the workers posted since the last call to its client,
+// a frame to a binary client and a line to a text client, with one flush
+// per client for the whole batch. done_fd must have been read first, so a
+// result posted after the batch is taken wakes the thread again. Clients
+// that lost a result because it couldn't be posted are dropped.
+static void deliver_results(struct net_listener *net)
+{
+        struct net_result *results;
+        struct client *c, *next;
+        struct client *dirty = NULL;
+        unsigned char frame[WIRE_RESPONSE_LEN];
+        char line[WIRE_TEXT_LEN];
+        int i, n, cap, len;
+
+        pthread_mutex_lock(&net->done_lock);
+        results = net->done;
+        n = net->done_len;
+        cap = net->done_cap;
+        net->done = net->draining;
+        net->done_cap = net->draining_cap;
+        net->done_len = 0;
+        net->draining = results;
+        net->draining_cap = cap;
+        // Their lost results will never arrive: stop waiting for them
+        c = net->lost;
+        net->lost = NULL;
+        while (c != NULL) {
+                next = c->lost_next;
+                c->pending -= c->lost;
+                c->lost = 0;
+                if (c->fd < 0) {
+                        release_zombie(net, c);
+                } else {
+                        c->failed = 1;
+                        if (!c->dirty) {
+                                c->dirty = 1;
+                                c->dirty_next = dirty;
+                                dirty = c;
+                        }
+                }
+                c = next;
+        }
+        pthread_mutex_unlock(&net->done_lock);
+
+        for (i = 0; i < n; i++) {
+                c = results[i].client;
+                c->pending--;
+                if (c->fd < 0) {
+                        release_zombie(net, c);
+                        continue;
+                }
+                if (c->protocol == PROTOCOL_BINARY) {
+                        wire_encode_response(&results[i].response, frame);
+                        queue_output(c, (char *) frame, WIRE_RESPONSE_LEN);
+                } else {
+                        len = wire_format_text(&results[i].response, line, sizeof(line));
+                        queue_reply(c, line, len);
+                }
+                if (!c->dirty) {
+                        c->dirty = 1;
+                        c->dirty_next = dirty;
+                        dirty = c;
+                }
+        }
+        while (dirty != NULL) {
+                c = dirty;
+                dirty = c->dirty_next;
+                c->dirty = 0;
+                if (flush_client(net, c) < 0) {
+                        drop_client(net, c);
+                }
+        }
+}
+
+// Sets up a connection accepted on the listening socket. Returns 1 if
+// succeeded, 0 if error.
+static int add_client(struct net_listener *net, int fd)
+{
+        struct epoll_event ev;
+        struct client *c;
+        int one = 1;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c = (struct client*)calloc(1, sizeof(struct client));
+        if (c == NULL) {
+                close(fd);
+                return 0;
+        }
+        c->fd = fd;
+        if (net->use_uring) {
+                c->rbuf = (char*)malloc(NET_RECV_LEN);
+                if (c->rbuf == NULL) {
+                        close(fd);
+                        free(c);
+                        return 0;
+                }
+                uring_recv(net, c);
+        } else {
+                set_nonblocking(fd);
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                if (epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                        close(fd);
+                        free(c);
+                        return 0;
+                }
+        }
+        c->next = net->clients;
+        if (net->clients != NULL) {
+                net->clients->prev = c;
+        }
+        net->clients = c;
+        net->num_clients++;
+        return 1;
+}
+
+static void accept_clients(struct net_listener *net)
+{
+        int fd;
+
+        for (;;) {
+                fd = accept(net->listen_fd, NULL, NULL);
+                if (fd < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                perror("accept() error");
+                        }
+                        return;
+                }
+                add_client(net, fd);
+        }
+}
+
+// Returns 1 if a connected client still has output waiting to be sent
+static int output_left(struct net_listener *net)
+{
+        struct client *c;
+
+        for (c = net->clients; c != NULL; c = c->next) {
+                if (c->out_len > 0 || c->send_len > 0) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+// Milliseconds from now until stop_at, 0 if it has passed
+static int ms_until(struct timespec *stop_at)
+{
+        struct timespec now;
+        long ms;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (stop_at->tv_sec - now.tv_sec) * 1000 +
+             (stop_at->tv_nsec - now.tv_nsec) / 1000000;
+        return ms > 0 ? ms : 0;
+}
+
+// Once asked to stop, the thread sends the results still waiting and keeps
+// serving until every client's output has been sent or NET_STOP_MS pass.
+static void *listener_routine(void *args)
+{
+        struct net_listener *net = (struct net_listener*) args;
+        struct epoll_event events[NET_MAX_EVENTS];
+        char data[NET_RECV_LEN];
+        struct client *c;
+        struct timespec stop_at;
+        uint64_t count;
+        int i, n, results;
+        int stopping = 0;
+        int timeout = -1;
+        ssize_t len;
+
+        for (;;) {
+                if (stopping) {
+                        timeout = ms_until(&stop_at);
+                        if (timeout == 0 || !output_left(net)) {
+                                break;
+                        }
+                }
+                n = epoll_wait(net->epoll_fd, events, NET_MAX_EVENTS, timeout);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("epoll_wait() error");
+                        break;
+                }
+                results = 0;
+                for (i = 0; i < n; i++) {
+                        if (events[i].data.ptr == &net->wake_fd) {
+                                read(net->wake_fd, &count, sizeof(count));
+                                clock_gettime(CLOCK_MONOTONIC, &stop_at);
+                                stop_at.tv_sec += NET_STOP_MS / 1000;
+                                stop_at.tv_nsec += (NET_STOP_MS % 1000) * 1000000;
+                                if (stop_at.tv_nsec >= 1000000000) {
+                                        stop_at.tv_sec++;
+                                        stop_at.tv_nsec -= 1000000000;
+                                }
+                                // New connections would only keep it busy
+                                epoll_ctl(net->epoll_fd, EPOLL_CTL_DEL, net->listen_fd, NULL);
+                                stopping = 1;
+                                results = 1;
+                                continue;
+                        }
+                        if (events[i].data.ptr == &net->listen_fd) {
+                                accept_clients(net);
+                                continue;
+                        }
+                        if (events[i].data.ptr == &net->done_fd) {
+                                read(net->done_fd, &count, sizeof(count));
+                                results = 1;
+                                continue;
+                        }
+
+                        c = (struct client*) events[i].data.ptr;
+                        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                                len = recv(c->fd, data, sizeof(data), 0);
+                                if (len == 0 || (len < 0 && errno != EAGAIN &&
+                                                 errno != EINTR)) {
+                                        drop_client(net, c);
+                                        continue;
+                                }
+                                if (len > 0) {
+                                        handle_input(net, c, data, len);
+                                }
+                        }
+                        if (flush_client(net, c) < 0) {
+                                drop_client(net, c);
+                        }
+                }
+                // Only once no event of this batch is left to handle: it may
+                // free clients that later events still point to
+                if (results) {
+                        deliver_results(net);
+                }
+        }
+        return NULL;
+}
+
+static void uring_read_eventfd(struct net_listener *net, int fd, unsigned long *count, unsigned long op)
+{
+        uring_sqe(&net->ring, IORING_OP_READ, fd, count, sizeof(*count), op);
+}
+
+// io_uring counterpart of listener_routine. The accept, the eventfd reads,
+// every client's recv and any sends are all kept in flight; what one pass
+// over the completions queues up is submitted together with the wait for
+// the next completions, in a single system call. Stopping is bounded by a
+// timeout operation.
+static void *uring_routine(void *args)
+{
+        struct net_listener *net = (struct net_listener*) args;
+        struct client *c;
+        unsigned long user_data;
+        int res;
+        int stopping = 0;
+
+        uring_sqe(&net->ring, IORING_OP_ACCEPT, net->listen_fd, NULL, 0, URING_ACCEPT);
+        uring_read_eventfd(net, net->wake_fd, &net->wake_count, URING_WAKE);
+        uring_read_eventfd(net, net->done_fd, &net->done_count, URING_DONE);
+        for (;;) {
+                if (uring_submit(&net->ring, 1) < 0) {
+                        perror("io_uring_enter() error");
+                        break;
+                }
+                while (uring_completion(&net->ring, &user_data, &res)) {
+                        switch (user_data & URING_OP_MASK) {
+                        case URING_WAKE:
+                                net->stop_timeout.tv_sec = NET_STOP_MS / 1000;
+                                net->stop_timeout.tv_nsec = (NET_STOP_MS % 1000) * 1000000;
+                                uring_sqe(&net->ring, IORING_OP_TIMEOUT, -1,
+                                          &net->stop_timeout, 1, URING_STOP);
+                                deliver_results(net);
+                                stopping = 1;
+                                continue;
+                        case URING_STOP:
+                                // Exiting cancels whatever is still in flight
+                                return NULL;
+                        case URING_DONE:
+                                // A client it frees has nothing in flight, so
+                                // no later completion points to it
+                                deliver_results(net);
+                                uring_read_eventfd(net, net->done_fd, &net->done_count, URING_DONE);
+                                continue;
+                        case URING_ACCEPT:
+                                if (res >= 0) {
+                                        add_client(net, res);
+                                } else if (res != -EINTR && res != -EAGAIN) {
+                                        errno = -res;
+                                        perror("accept() error");
+                                }
+                                if (!stopping) {
+                                        uring_sqe(&net->ring, IORING_OP_ACCEPT, net->listen_fd,
+                                                  NULL, 0, URING_ACCEPT);
+                                }
+                                continue;
+                        }
+
+                        c = (struct client*)(user_data & ~URING_OP_MASK);
+                        c->inflight--;
+                        if (c->fd < 0) {
+                                release_zombie(net, c);
+                                continue;
+                        }
+                        if (res == -EINTR || res == -EAGAIN) {
+                                res = 0;
+                        } else if (res < 0 || (res == 0 && (user_data & URING_OP_MASK) == URING_RECV)) {
+                                drop_client(net, c);
+                                continue;
+                        }
+                        if ((user_data & URING_OP_MASK) == URING_RECV) {
+                                if (res > 0) {
+                                        handle_input(net, c, c->rbuf, res);
+                                }
+                                if (!c->closing) {
+                                        uring_recv(net, c);
+                                }
+                        } else {
+                                c->sent += res;
+                                if (c->sent < c->send_len) {
+                                        uring_send(net, c);
+                                        continue;
+                                }
+                                c->send_len = 0;
+                        }
+                        if (flush_client(net, c) < 0) {
+                                drop_client(net, c);
+                        }
+                }
+                if (stopping && !output_left(net)) {
+                        break;
+                }
+        }
+        return NULL;
+}
+
+// Registers the listening socket and the stop eventfd and starts the thread.
+// With use_uring the thread serves clients through io_uring if the kernel
+// has it; use_uring is cleared in net if it doesn't.
+static int start_listener(struct net_listener *net, net_handler handler, net_binary_handler binary_handler, void *ctx, int use_uring)
+{
+        struct epoll_event ev;
+
+        net->handler = handler;
+        net->binary_handler = binary_handler;
+        net->ctx = ctx;
+        net->num_clients = 0;
+        net->clients = NULL;
+        net->zombies = NULL;
+        net->done = NULL;
+        net->done_len = 0;
+        net->done_cap = 0;
+        net->draining = NULL;
+        net->draining_cap = 0;
+        net->lost = NULL;
+        net->stopped = 0;
+        pthread_mutex_init(&net->done_lock, NULL);
+        net->use_uring = use_uring && uring_init(&net->ring, URING_ENTRIES);
+        if (listen(net->listen_fd, NET_BACKLOG) != 0) {
+                return 0;
+        }
+
+        // io_uring polls on its own; the descriptors it reads stay blocking
+        if (net->use_uring) {
+                net->wake_fd = eventfd(0, 0);
+                net->done_fd = eventfd(0, 0);
+                if (net->wake_fd < 0 || net->done_fd < 0) {
+                        return 0;
+                }
+                return pthread_create(&net->thread, NULL, uring_routine, (void *) net) == 0;
+        }
+        set_nonblocking(net->listen_fd);
+
+        net->epoll_fd = epoll_create1(0);
+        net->wake_fd = eventfd(0, EFD_NONBLOCK);
+        net->done_fd = eventfd(0, EFD_NONBLOCK);
+        if (net->epoll_fd < 0 || net->wake_fd < 0 || net->done_fd < 0) {
+                return 0;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &net->listen_fd;
+        epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, net->listen_fd, &ev);
+        ev.data.ptr = &net->wake_fd;
+        epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, net->wake_fd, &ev);
+        ev.data.ptr = &net->done_fd;
+        epoll_ctl(net->epoll_fd, EPOLL_CTL_ADD, net->done_fd, &ev);
+
+        return pthread_create(&net->thread, NULL, listener_routine, (void *) net) == 0;
+}
+
+// Listens on every interface on the given TCP port.
+// Returns 1 if succeeded, 0 if error.
+int net_listen_tcp(struct net_listener *net, int port, net_handler handler, net_binary_handler binary_handler, void *ctx, int use_uring)
+{
+        struct sockaddr_in addr;
+        int one = 1;
+
+        net->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (net->listen_fd < 0) {
+                return 0;
+        }
+        setsockopt(net->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(net->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+                close(net->listen_fd);
+                return 0;
+        }
+        return start_listener(net, handler, binary_handler, ctx, use_uring);
+}
+
+// Listens on a Unix domain socket at path, replacing any stale socket file.
+// Returns 1 if succeeded, 0 if error.
+int net_listen_unix(struct net_listener *net, char *path, net_handler handler, net_binary_handler binary_handler, void *ctx, int use_uring)
+{
+        struct sockaddr_un addr;
+
+        net->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (net->listen_fd < 0) {
+                return 0;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        unlink(path);
+        if (bind(net->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+                close(net->listen_fd);
+                return 0;
+        }
+        return start_listener(net, handler, binary_handler, ctx, use_uring);
+}
+
+// Notes that a worker will post the result of a command client just sent.
+// Call from a handler, on the listener thread.
+void net_expect_result(struct client *client)
+{
+        client->pending++;
+}
+
+// Doubles the room for posted results. Returns 1 if succeeded, 0 if error.
+// Called with done_lock held.
+static int grow_done(struct net_listener *net)
+{
+        struct net_result *done;
+        int cap = net->done_cap ? net->done_cap * 2 : NET_MAX_EVENTS;
+
+        done = (struct net_result*)realloc(net->done, sizeof(struct net_result) * cap);
+        if (done == NULL) {
+                return 0;
+        }
+        net->done = done;
+        net->done_cap = cap;
+        return 1;
+}
+
+// Hands the result of a command to the listener thread to send to client,
+// which must have been passed to net_expect_result. Safe to call from any
+// thread; results posted after net_stop are dropped. If there is no memory
+// to hold the result, the client is dropped instead.
+void net_post_result(struct net_listener *net, struct client *client, struct wire_response *response)
+{
+        uint64_t one = 1;
+        int wake;
+
+        pthread_mutex_lock(&net->done_lock);
+        if (net->stopped) {
+                pthread_mutex_unlock(&net->done_lock);
+                return;
+        }
+        wake = net->done_len == 0 && net->lost == NULL;
+        if (net->done_len == net->done_cap && !grow_done(net)) {
+                perror("Failed to post a result, dropping its client");
+                if (client->lost++ == 0) {
+                        client->lost_next = net->lost;
+                        net->lost = client;
+                }
+        } else {
+                net->done[net->done_len].client = client;
+                net->done[net->done_len++].response = *response;
+        }
+        pthread_mutex_unlock(&net->done_lock);
+
+        // Only the first result of a batch needs to wake the thread
+        if (wake) {
+                write(net->done_fd, &one, sizeof(one));
+        }
+}
+
+// Sends every result posted so far, waiting up to NET_STOP_MS for clients to
+// take their output, then stops accepting, disconnects every client and joins
+// the listener thread. Call once the workers have posted their last result;
+// any posted later is dropped.
+void net_stop(struct net_listener *net)
+{
+        uint64_t one = 1;
+
+        write(net->wake_fd, &one, sizeof(one));
+        pthread_join(net->thread, NULL);
+
+        // Workers may still post, so done_lock is left for them to find
+        // stopped set
+        pthread_mutex_lock(&net->done_lock);
+        net->stopped = 1;
+        pthread_mutex_unlock(&net->done_lock);
+        while (net->clients != NULL) {
+                drop_client(net, net->clients);
+        }
+        while (net->zombies != NULL) {
+                free_zombie(net, net->zombies);
+        }
+        free(net->done);
+        free(net->draining);
+        close(net->listen_fd);
+        close(net->wake_fd);
+        close(net->done_fd);
+        if (net->use_uring) {
+                uring_destroy(&net->ring);
+        } else {
+                close(net->epoll_fd);
+        }
+}
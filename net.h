@@ -0,0 +1,76 @@
+#ifndef NET_H
+#define NET_H
+
+#include <pthread.h>
+#include "uring.h"
+#include "wire.h"
+
+struct client;
+
+#define NET_REPLY_LEN 1024 // Room for a STATS report
+#define NET_MAX_EVENTS 256
+#define NET_BACKLOG 1024
+#define NET_RECV_LEN 4096 // Bytes read from a client at a time
+#define NET_STOP_MS 1000  // How long net_stop waits for clients to take their output
+
+
+// Called by the listener thread for every complete line a client sends (the
+// newline already stripped). The handler writes the text to send back into
+// reply (without a newline) and returns 0 to keep the connection open or -1
+// to close it once the reply has been sent. client identifies the sender for
+// net_expect_result and net_post_result.
+typedef int (*net_handler)(void *ctx, struct client *client, char *line, char *reply, int reply_len);
+
+// The same for every complete request frame a binary client (see wire.h)
+// sends. The handler encodes the response into reply.
+typedef int (*net_binary_handler)(void *ctx, struct client *client, unsigned char *frame, unsigned char reply[WIRE_RESPONSE_LEN]);
+
+// A finished command's result on its way back to the client that sent it
+struct net_result {
+        struct client *client;
+        struct wire_response response;
+};
+
+// epoll driven listener on a TCP port or a Unix domain socket. A single
+// thread accepts clients and reads and writes every connection without
+// blocking, so thousands of clients can be connected at once. With io_uring
+// the same thread keeps an accept, a recv per client and a send per client
+// with output in flight instead, and submits them all and collects their
+// completions in one system call per pass.
+struct net_listener {
+        int listen_fd;
+        int epoll_fd;
+        int use_uring;
+        struct uring ring;
+        unsigned long wake_count; // io_uring reads of wake_fd and done_fd
+        unsigned long done_count;
+        struct __kernel_timespec stop_timeout; // io_uring: bounds the final flush
+        int wake_fd;          // eventfd used to ask the thread to stop
+        int num_clients;
+        struct client *clients; // Connected clients, listener thread only
+        // Results posted by the workers, handed to the listener thread in
+        // batches: it swaps the two arrays and sends them all at once
+        pthread_mutex_t done_lock;
+        struct net_result *done;
+        int done_len;
+        int done_cap;
+        struct net_result *draining;
+        int draining_cap;
+        int done_fd;          // eventfd written when done becomes non-empty
+        int stopped;          // Set by net_stop, later results are dropped
+        struct client *lost;  // Clients a result couldn't be posted for
+        struct client *zombies; // Disconnected, but results still owed
+        net_handler handler;
+        net_binary_handler binary_handler;
+        void *ctx;
+        pthread_t thread;
+};
+
+
+int net_listen_tcp(struct net_listener *net, int port, net_handler handler, net_binary_handler binary_handler, void *ctx, int use_uring);
+int net_listen_unix(struct net_listener *net, char *path, net_handler handler, net_binary_handler binary_handler, void *ctx, int use_uring);
+void net_expect_result(struct client *client);
+void net_post_result(struct net_listener *net, struct client *client, struct wire_response *response);
+void net_stop(struct net_listener *net);
+
+#endif
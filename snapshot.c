@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "storage.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_CHUNK 16384 // Balances per write
+
+
+// Writes every balance to tmp_path, syncs it and renames it over path, so a
+// crash at any point leaves either the old snapshot or the new one. Runs in
+// the forked child, so it sticks to system calls and the storage it inherited.
+// Returns 1 if succeeded, 0 if error.
+static int write_snapshot(char *path, char *tmp_path, char *dir,
+                          int num_accts, unsigned long wal_offset)
+{
+        struct snapshot_header header;
+        int chunk[SNAPSHOT_CHUNK];
+        off_t offset = SNAPSHOT_HEADER_SIZE;
+        int fd, i, n, dir_fd;
+        ssize_t size, done, written;
+
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                return 0;
+        }
+        memset(&header, 0, sizeof(header));
+        header.magic = SNAPSHOT_MAGIC;
+        header.num_accts = num_accts;
+        header.wal_offset = wal_offset;
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+                close(fd);
+                return 0;
+        }
+
+        for (i = 0; i < num_accts; i += n) {
+                n = num_accts - i < SNAPSHOT_CHUNK ? num_accts - i : SNAPSHOT_CHUNK;
+                int j;
+                for (j = 0; j < n; j++) {
+                        chunk[j] = storage_peek(i + j + 1);
+                }
+                size = n * sizeof(int);
+                for (done = 0; done < size; done += written) {
+                        written = pwrite(fd, (char *) chunk + done, size - done,
+                                         offset + done);
+                        if (written < 0 && errno != EINTR) {
+                                close(fd);
+                                return 0;
+                        }
+                        if (written < 0) {
+                                written = 0;
+                        }
+                }
+                offset += size;
+        }
+
+        if (fsync(fd) != 0 || close(fd) != 0 || rename(tmp_path, path) != 0) {
+                return 0;
+        }
+        // Make the rename itself durable
+        dir_fd = open(dir, O_RDONLY);
+        if (dir_fd >= 0) {
+                fsync(dir_fd);
+                close(dir_fd);
+        }
+        return 1;
+}
+
+// Takes one snapshot. The gate is held exclusive only until the fork returns;
+// the child then writes the balances as they were while workers carry on.
+// Returns 1 if succeeded, 0 if error.
+static int take_snapshot(struct snapshotter *snap)
+{
+        char tmp_path[strlen(snap->path) + 5];
+        char dir[strlen(snap->path) + 2];
+        char *slash;
+        unsigned long wal_offset = snap->wal_offset;
+        pid_t pid;
+        int status;
+
+        sprintf(tmp_path, "%s.tmp", snap->path);
+        strcpy(dir, snap->path);
+        slash = strrchr(dir, '/');
+        if (slash == NULL) {
+                strcpy(dir, ".");
+        } else {
+                slash[1] = '\0';
+        }
+
+        pthread_rwlock_wrlock(&snap->gate);
+        if (snap->wal != NULL) {
+                wal_offset = wal_position(snap->wal);
+        }
+        pid = fork();
+        pthread_rwlock_unlock(&snap->gate);
+
+        if (pid == 0) {
+                _exit(write_snapshot(snap->path, tmp_path, dir, snap->num_accts,
+                                     wal_offset) ? EXIT_SUCCESS : EXIT_FAILURE);
+        } else if (pid < 0) {
+                return 0;
+        }
+        while (waitpid(pid, &status, 0) < 0) {
+                if (errno != EINTR) {
+                        return 0;
+                }
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                return 0;
+        }
+        snap->taken++;
+        return 1;
+}
+
+// Snapshot thread: one snapshot every interval seconds until stopped
+static void *snapshot_routine(void *arg)
+{
+        struct snapshotter *snap = (struct snapshotter *) arg;
+        struct timespec deadline;
+
+        pthread_mutex_lock(&snap->lock);
+        while (!snap->stopping) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += snap->interval;
+                while (!snap->stopping &&
+                       pthread_cond_timedwait(&snap->wake, &snap->lock, &deadline) != ETIMEDOUT) {
+                }
+                if (snap->stopping) {
+                        break;
+                }
+                pthread_mutex_unlock(&snap->lock);
+                if (take_snapshot(snap) == 0) {
+                        fprintf(stderr, "Failed to take snapshot %s\n", snap->path);
+                }
+                pthread_mutex_lock(&snap->lock);
+        }
+        pthread_mutex_unlock(&snap->lock);
+        return NULL;
+}
+
+// Maps the snapshot at path, if there is one, privately: balances are paged
+// in as they are touched and changes never reach the file, so startup costs
+// the same for any number of accounts. Sets balances and the WAL offset the
+// snapshot was taken at.
+// Returns 1 if mapped, 0 if there is no snapshot, -1 if it can't be used.
+int snapshot_map(char *path, int num_accts, int **balances, unsigned long *wal_offset)
+{
+        struct snapshot_header header;
+        struct stat st;
+        size_t size = SNAPSHOT_HEADER_SIZE + (size_t) num_accts * sizeof(int);
+        char *map;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                return errno == ENOENT ? 0 : -1;
+        }
+        if (fstat(fd, &st) != 0 ||
+            read(fd, &header, sizeof(header)) != sizeof(header) ||
+            header.magic != SNAPSHOT_MAGIC) {
+                fprintf(stderr, "%s is not a snapshot.\n", path);
+                close(fd);
+                errno = EINVAL;
+                return -1;
+        }
+        if (header.num_accts != num_accts || st.st_size < (off_t) size) {
+                fprintf(stderr, "Snapshot %s holds %d accounts, not %d.\n",
+                        path, header.num_accts, num_accts);
+                close(fd);
+                errno = EINVAL;
+                return -1;
+        }
+
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+                return -1;
+        }
+        *balances = (int *) (map + SNAPSHOT_HEADER_SIZE);
+        *wal_offset = header.wal_offset;
+        return 1;
+}
+
+// Starts taking a snapshot to path every interval seconds, or only at
+// snapshot_stop if interval is 0. Without a WAL every snapshot records
+// wal_offset: the offset of the snapshot it started from, so a later run with
+// the WAL replays only what that snapshot lacks, or SNAPSHOT_NO_WAL.
+// Returns 1 if succeeded, 0 if error.
+int snapshot_start(struct snapshotter *snap, char *path, int num_accts, int interval,
+                   struct wal *wal, unsigned long wal_offset)
+{
+        pthread_rwlockattr_t attr;
+
+        snap->path = path;
+        snap->num_accts = num_accts;
+        snap->interval = interval;
+        snap->wal = wal;
+        snap->wal_offset = wal_offset;
+        snap->stopping = 0;
+        snap->taken = 0;
+
+        // Prefer the snapshotter so a steady stream of commits can't starve it
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        if (pthread_rwlock_init(&snap->gate, &attr) != 0 ||
+            pthread_mutex_init(&snap->lock, NULL) != 0 ||
+            pthread_cond_init(&snap->wake, NULL) != 0) {
+                return 0;
+        }
+        pthread_rwlockattr_destroy(&attr);
+
+        if (interval > 0 &&
+            pthread_create(&snap->thread, NULL, snapshot_routine, snap) != 0) {
+                return 0;
+        }
+        return 1;
+}
+
+// Called by a TRANS before it logs and applies its new balances
+void snapshot_commit_begin(struct snapshotter *snap)
+{
+        pthread_rwlock_rdlock(&snap->gate);
+}
+
+// snapshot_commit_begin that never waits, for --async workers that may
+// already hold the gate for another TRANS while a snapshot is waiting for it.
+// Returns 1 if the gate was taken, 0 if a snapshot is being taken or waited for.
+int snapshot_commit_try(struct snapshotter *snap)
+{
+        return pthread_rwlock_tryrdlock(&snap->gate) == 0;
+}
+
+// Called by a TRANS once its new balances are all written
+void snapshot_commit_end(struct snapshotter *snap)
+{
+        pthread_rwlock_unlock(&snap->gate);
+}
+
+// Stops the snapshot thread and takes a final snapshot. Workers must have
+// finished and the WAL must still be open.
+void snapshot_stop(struct snapshotter *snap)
+{
+        pthread_mutex_lock(&snap->lock);
+        snap->stopping = 1;
+        pthread_cond_signal(&snap->wake);
+        pthread_mutex_unlock(&snap->lock);
+        if (snap->interval > 0) {
+                pthread_join(snap->thread, NULL);
+        }
+
+        if (take_snapshot(snap) == 0) {
+                fprintf(stderr, "Failed to take snapshot %s\n", snap->path);
+        }
+        printf("Snapshots: %ld written to %s\n", snap->taken, snap->path);
+        pthread_cond_destroy(&snap->wake);
+        pthread_mutex_destroy(&snap->lock);
+        pthread_rwlock_destroy(&snap->gate);
+}
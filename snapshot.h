@@ -0,0 +1,51 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "wal.h"
+
+#define SNAPSHOT_MAGIC 0x31504e53 // "SNP1"
+#define SNAPSHOT_HEADER_SIZE 4096 // Balances start on a page boundary
+#define DEFAULT_SNAPSHOT_INTERVAL 60 // Seconds
+#define SNAPSHOT_NO_WAL UINT64_MAX // wal_offset of a snapshot never run with --wal
+
+
+// Start of a snapshot file, followed at SNAPSHOT_HEADER_SIZE by num_accts
+// int balances in account order, so the file can be mapped and used as is.
+struct snapshot_header {
+        uint32_t magic;
+        int32_t num_accts;
+        uint64_t wal_offset;  // WAL bytes already reflected in the balances
+};
+
+// Takes a snapshot of every balance every interval seconds. The balances are
+// written by a forked child that sees the bank frozen at the moment of the
+// fork (copy-on-write), so workers only wait for the fork itself. Committing
+// TRANS hold gate shared from before their WAL record to after their last
+// balance write; the snapshotter takes it exclusive around the fork, so the
+// snapshot and its WAL offset agree on which TRANS it contains.
+struct snapshotter {
+        char *path;
+        int num_accts;
+        int interval;
+        struct wal *wal;      // NULL without --wal
+        unsigned long wal_offset; // Recorded when there is no WAL
+        pthread_rwlock_t gate;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        int stopping;
+        long taken;
+        pthread_t thread;
+};
+
+
+int snapshot_map(char *path, int num_accts, int **balances, unsigned long *wal_offset);
+int snapshot_start(struct snapshotter *snap, char *path, int num_accts, int interval,
+                   struct wal *wal, unsigned long wal_offset);
+void snapshot_commit_begin(struct snapshotter *snap);
+int snapshot_commit_try(struct snapshotter *snap);
+void snapshot_commit_end(struct snapshotter *snap);
+void snapshot_stop(struct snapshotter *snap);
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include "steal.h"
+
+
+static int ring_init(struct ring *r, unsigned long capacity)
+{
+        unsigned long i;
+
+        r->slots = (struct ring_slot*)malloc(sizeof(struct ring_slot)*capacity);
+        if (r->slots == NULL) {
+                return 0;
+        }
+        for (i = 0; i < capacity; i++) {
+                atomic_init(&r->slots[i].seq, i);
+        }
+        r->mask = capacity - 1;
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        atomic_init(&r->steals, 0);
+        return 1;
+}
+
+// Returns 1 if the command was placed in the ring, 0 if the ring is full.
+// Only the main thread pushes, so the tail needs no compare-and-swap.
+static int ring_push(struct ring *r, struct node *cmd)
+{
+        unsigned long pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        struct ring_slot *slot = &r->slots[pos & r->mask];
+
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos) {
+                return 0;
+        }
+        slot->cmd = *cmd;
+        atomic_store_explicit(&r->tail, pos + 1, memory_order_relaxed);
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        return 1;
+}
+
+// Returns 1 if a command was taken from the ring, 0 if the ring is empty.
+// Safe to call from any number of threads at once.
+static int ring_pop(struct ring *r, struct node *out)
+{
+        unsigned long pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        struct ring_slot *slot;
+        unsigned long seq;
+
+        for (;;) {
+                slot = &r->slots[pos & r->mask];
+                seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+                if (seq != pos + 1) {
+                        if ((long)(seq - (pos + 1)) < 0) {
+                                return 0; // Not filled yet
+                        }
+                        // Another consumer already took it, catch up
+                        pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+                } else if (atomic_compare_exchange_weak_explicit(&r->head,
+                                &pos, pos + 1, memory_order_relaxed,
+                                memory_order_relaxed)) {
+                        break;
+                }
+        }
+        *out = slot->cmd;
+        atomic_store_explicit(&slot->seq, pos + r->mask + 1, memory_order_release);
+        return 1;
+}
+
+// Splits capacity evenly across num_workers rings (each rounded up to a
+// power of two, at least 2 so a freed slot never looks filled).
+// Returns 1 if succeeded, 0 if error.
+int steal_init(struct steal_pool *pool, int num_workers, int capacity)
+{
+        unsigned long per_ring = 2;
+        int i;
+
+        while (per_ring * num_workers < (unsigned long)capacity) {
+                per_ring <<= 1;
+        }
+
+        pool->rings = (struct ring*)aligned_alloc(CACHE_LINE,
+                        sizeof(struct ring)*num_workers);
+        if (pool->rings == NULL) {
+                return 0;
+        }
+        for (i = 0; i < num_workers; i++) {
+                if (ring_init(&pool->rings[i], per_ring) == 0) {
+                        return 0;
+                }
+        }
+        pool->num_rings = num_workers;
+        pool->next_ring = 0;
+        atomic_init(&pool->closed, 0);
+        if (sem_init(&pool->items, 0, 0) != 0 ||
+            sem_init(&pool->free_slots, 0, per_ring * num_workers) != 0) {
+                return 0;
+        }
+        return 1;
+}
+
+// No more commands will be pushed. Wakes every worker once so that each
+// can notice the rings are drained and exit.
+void steal_close(struct steal_pool *pool)
+{
+        int i;
+
+        atomic_store(&pool->closed, 1);
+        for (i = 0; i < pool->num_rings; i++) {
+                sem_post(&pool->items);
+        }
+}
+
+void steal_destroy(struct steal_pool *pool)
+{
+        int i;
+
+        for (i = 0; i < pool->num_rings; i++) {
+                free(pool->rings[i].slots);
+        }
+        free(pool->rings);
+        sem_destroy(&pool->items);
+        sem_destroy(&pool->free_slots);
+}
+
+// Total number of commands executed by a worker other than the ring's owner
+long steal_count(struct steal_pool *pool)
+{
+        long total = 0;
+        int i;
+
+        for (i = 0; i < pool->num_rings; i++) {
+                total += atomic_load(&pool->rings[i].steals);
+        }
+        return total;
+}
+
+// Returns 1 if a command was extracted into curr_cmd_info, 0 once the pool
+// is closed and every ring is drained. The worker's own ring is tried first,
+// then its peers' rings in order.
+int steal_pop(struct steal_pool *pool, int worker_id, struct node *curr_cmd_info)
+{
+        int i, victim, closed;
+
+        sem_wait(&pool->items);
+        for (;;) {
+                // Every push happens before close, so a full empty pass
+                // after seeing closed means nothing is left.
+                closed = atomic_load(&pool->closed);
+                for (i = 0; i < pool->num_rings; i++) {
+                        victim = (worker_id + i) % pool->num_rings;
+                        if (ring_pop(&pool->rings[victim], curr_cmd_info)) {
+                                if (i != 0) {
+                                        atomic_fetch_add_explicit(
+                                                &pool->rings[victim].steals, 1,
+                                                memory_order_relaxed);
+                                }
+                                sem_post(&pool->free_slots);
+                                return 1;
+                        }
+                }
+                if (closed) {
+                        return 0;
+                }
+        }
+}
+
+// Places the command in the next worker's ring, moving on to the following
+// ring if that one is full. Blocks while every ring is full.
+// Should only be called by the main thread.
+void steal_push(struct steal_pool *pool, struct node *node_to_add)
+{
+        sem_wait(&pool->free_slots);
+        while (!ring_push(&pool->rings[pool->next_ring], node_to_add)) {
+                pool->next_ring = (pool->next_ring + 1) % pool->num_rings;
+        }
+        pool->next_ring = (pool->next_ring + 1) % pool->num_rings;
+        sem_post(&pool->items);
+}
@@ -0,0 +1,48 @@
+#ifndef STEAL_H
+#define STEAL_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include "buffer.h"
+
+#define CACHE_LINE 64
+
+
+// One slot of a worker's ring. seq tells producers and consumers whose turn
+// it is to touch the slot (Vyukov bounded queue), so no lock is needed.
+struct ring_slot {
+        atomic_ulong seq;
+        struct node cmd;
+};
+
+// A bounded lock-free ring owned by one worker. The main thread is the only
+// producer; the owner and any idle peer may consume from it.
+struct ring {
+        _Alignas(CACHE_LINE) atomic_ulong head; // Next slot to consume
+        _Alignas(CACHE_LINE) atomic_ulong tail; // Next slot to fill
+        unsigned long mask;                     // capacity - 1
+        struct ring_slot *slots;
+        atomic_long steals;                     // Commands peers took from us
+};
+
+// Per-worker rings fed round-robin by the main thread. Workers consume from
+// their own ring first and steal from busy peers when it runs dry.
+struct steal_pool {
+        struct ring *rings;
+        int num_rings;
+        int next_ring;        // Round-robin cursor, main thread only
+        atomic_int closed;
+        sem_t items;          // Commands queued across all rings
+        sem_t free_slots;     // Free slots across all rings
+};
+
+
+int steal_init(struct steal_pool *pool, int num_workers, int capacity);
+void steal_close(struct steal_pool *pool);
+void steal_destroy(struct steal_pool *pool);
+long steal_count(struct steal_pool *pool);
+int steal_pop(struct steal_pool *pool, int worker_id, struct node *curr_cmd_info);
+void steal_push(struct steal_pool *pool, struct node *node_to_add);
+
+#endif
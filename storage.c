@@ -0,0 +1,419 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "Bank.h"
+#include "storage.h"
+
+
+extern int *BANK_accounts;            // "bank" backend, owned by Bank.c
+static int *plain_accounts;          // "memory" and "latency" backends
+// "atomic" backend. The low 32 bits of each word are the balance; HELD is
+// set while a locked TRANS owns the account so lock-free updates back off.
+static atomic_llong *atomic_accounts;
+#define HELD (1LL << 32)
+#define BALANCE(word) ((int) (unsigned int) (word))
+static int model_latency_us;
+static int model_jitter_us;
+static __thread unsigned int jitter_seed;
+
+// Optional write-through balance cache in front of every backend. Direct
+// mapped: account a may only live in slot (a - 1) & cache_mask. A slot packs
+// the account number in its high half and the balance in its low half, so it
+// is read and replaced in one atomic access and 8 slots share a cache line.
+// 0 is never a valid account, so a zeroed slot is empty.
+static atomic_ulong *cache_slots;
+static unsigned long cache_mask;
+#define CACHE_WORD(ID, value) (((unsigned long) (ID) << 32) | (unsigned int) (value))
+#define CACHE_STRIPES 64
+// Hit/miss counters, spread over cache lines by thread so they don't bounce
+static struct cache_counters {
+        _Alignas(64) atomic_ulong hits;
+        atomic_ulong misses;
+} cache_counters[CACHE_STRIPES];
+static atomic_int cache_next_stripe;
+static __thread int cache_stripe = -1;
+
+
+// Latency-free accessors used for recovery and snapshots. Bank.c only offers
+// the slow read_account/write_account, so its array is reached directly.
+static int bank_peek(int ID)
+{
+        return BANK_accounts[ID - 1];
+}
+
+static void bank_poke(int ID, int value)
+{
+        BANK_accounts[ID - 1] = value;
+}
+
+static void bank_attach(int *balances)
+{
+        BANK_accounts = balances;
+}
+
+static void memory_attach(int *balances)
+{
+        plain_accounts = balances;
+}
+
+static int memory_initialize(int n)
+{
+        plain_accounts = (int*)calloc(n, sizeof(int));
+        return plain_accounts != NULL;
+}
+
+static int memory_read(int ID)
+{
+        return plain_accounts[ID - 1];
+}
+
+static void memory_write(int ID, int value)
+{
+        plain_accounts[ID - 1] = value;
+}
+
+// Microseconds one access takes: the configured latency plus up to
+// jitter_us extra
+static int model_delay_us()
+{
+        int delay = model_latency_us;
+
+        if (model_jitter_us > 0) {
+                if (jitter_seed == 0) {
+                        jitter_seed = (unsigned int) pthread_self() | 1;
+                }
+                delay += rand_r(&jitter_seed) % (model_jitter_us + 1);
+        }
+        return delay;
+}
+
+// Sleeps for as long as one access takes
+static void model_delay()
+{
+        int delay = model_delay_us();
+
+        if (delay > 0) {
+                usleep(delay);
+        }
+}
+
+static int latency_read(int ID)
+{
+        model_delay();
+        return plain_accounts[ID - 1];
+}
+
+static void latency_write(int ID, int value)
+{
+        model_delay();
+        plain_accounts[ID - 1] = value;
+}
+
+static int atomic_initialize(int n)
+{
+        int i;
+
+        atomic_accounts = (atomic_llong*)malloc(sizeof(atomic_llong)*n);
+        if (atomic_accounts == NULL) {
+                return 0;
+        }
+        for (i = 0; i < n; i++) {
+                atomic_init(&atomic_accounts[i], 0);
+        }
+        return 1;
+}
+
+static int atomic_read(int ID)
+{
+        return BALANCE(atomic_load_explicit(&atomic_accounts[ID - 1],
+                                            memory_order_acquire));
+}
+
+// Only the account's lock holder writes, so the HELD bit can't change under us
+static void atomic_write(int ID, int value)
+{
+        long long word = atomic_load_explicit(&atomic_accounts[ID - 1],
+                                              memory_order_relaxed);
+        atomic_store_explicit(&atomic_accounts[ID - 1],
+                              (word & HELD) | (unsigned int) value,
+                              memory_order_release);
+}
+
+static struct storage_backend backends[] = {
+        {"bank", "Bank.c, 100 ms per read and write",
+         initialize_accounts, read_account, write_account,
+         bank_peek, bank_poke, bank_attach},
+        {"memory", "in-memory array, no latency",
+         memory_initialize, memory_read, memory_write,
+         memory_read, memory_write, memory_attach},
+        {"latency", "in-memory array with --storage-latency-us/-jitter-us delays",
+         memory_initialize, latency_read, latency_write,
+         memory_read, memory_write, memory_attach},
+        {"atomic", "array of atomics, no latency, safe to read without locks",
+         atomic_initialize, atomic_read, atomic_write,
+         atomic_read, atomic_write, NULL},
+};
+
+static struct storage_backend *storage = &backends[0];
+
+
+// Chooses the backend every storage_ call goes to. latency_us and jitter_us
+// are only used by the "latency" backend.
+// Returns 1 if succeeded, 0 if there is no backend with that name.
+int storage_select(char *name, int latency_us, int jitter_us)
+{
+        unsigned long i;
+
+        for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+                if (strcmp(backends[i].name, name) == 0) {
+                        storage = &backends[i];
+                        model_latency_us = latency_us;
+                        model_jitter_us = jitter_us;
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+char *storage_name()
+{
+        return storage->name;
+}
+
+void storage_print_backends()
+{
+        unsigned long i;
+
+        for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+                printf("                            %-8s %s\n",
+                       backends[i].name, backends[i].description);
+        }
+}
+
+// Returns 1 if the selected backend supports storage_try_add
+int storage_has_cas()
+{
+        return storage->initialize == atomic_initialize;
+}
+
+// Adds value to the balance with a compare-and-swap loop unless the result
+// would be negative. Returns STORAGE_ADDED, STORAGE_ISF, or STORAGE_HELD if a
+// locked TRANS currently owns the account (nothing is changed).
+// "atomic" backend only.
+int storage_try_add(int ID, int value)
+{
+        atomic_llong *account = &atomic_accounts[ID - 1];
+        long long word = atomic_load_explicit(account, memory_order_acquire);
+
+        for (;;) {
+                if (word & HELD) {
+                        return STORAGE_HELD;
+                }
+                if ((long long) BALANCE(word) + value < 0) {
+                        return STORAGE_ISF;
+                }
+                if (atomic_compare_exchange_weak_explicit(account, &word,
+                                (unsigned int) (BALANCE(word) + value),
+                                memory_order_acq_rel, memory_order_acquire)) {
+                        return STORAGE_ADDED;
+                }
+        }
+}
+
+// Marks the account as owned by a locked TRANS until storage_release, making
+// storage_try_add back off. The caller must already hold the account's lock.
+// "atomic" backend only.
+void storage_hold(int ID)
+{
+        atomic_fetch_or_explicit(&atomic_accounts[ID - 1], HELD, memory_order_acq_rel);
+}
+
+void storage_release(int ID)
+{
+        atomic_fetch_and_explicit(&atomic_accounts[ID - 1], ~HELD, memory_order_release);
+}
+
+int storage_initialize(int n)
+{
+        return storage->initialize(n);
+}
+
+static struct cache_counters *cache_counter()
+{
+        if (cache_stripe < 0) {
+                cache_stripe = atomic_fetch_add(&cache_next_stripe, 1) % CACHE_STRIPES;
+        }
+        return &cache_counters[cache_stripe];
+}
+
+// Turns on the balance cache with room for at least size accounts, rounded up
+// to a power of two of at least one cache line. Must be called before any
+// worker starts; balances set up to then are read from the backend on first
+// use.
+// Returns 1 if succeeded, 0 if error.
+int storage_cache_init(int size)
+{
+        unsigned long slots = 8;
+
+        while (slots < (unsigned long) size) {
+                slots <<= 1;
+        }
+        cache_slots = (atomic_ulong*)aligned_alloc(64, sizeof(atomic_ulong) * slots);
+        if (cache_slots == NULL) {
+                return 0;
+        }
+        memset(cache_slots, 0, sizeof(atomic_ulong) * slots);
+        cache_mask = slots - 1;
+        return 1;
+}
+
+// Returns the number of slots, 0 if the cache is off
+unsigned long storage_cache_size()
+{
+        return cache_slots == NULL ? 0 : cache_mask + 1;
+}
+
+void storage_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+        int i;
+
+        *hits = 0;
+        *misses = 0;
+        for (i = 0; i < CACHE_STRIPES; i++) {
+                *hits += atomic_load_explicit(&cache_counters[i].hits, memory_order_relaxed);
+                *misses += atomic_load_explicit(&cache_counters[i].misses, memory_order_relaxed);
+        }
+}
+
+// Sets *value to the cached balance of ID without touching the backend.
+// Returns 1 on a hit, 0 if ID isn't cached or the cache is off.
+int storage_lookup(int ID, int *value)
+{
+        unsigned long word;
+
+        if (cache_slots == NULL) {
+                return 0;
+        }
+        word = atomic_load_explicit(&cache_slots[(ID - 1) & cache_mask], memory_order_relaxed);
+        if ((word >> 32) != (unsigned long) ID) {
+                return 0;
+        }
+        *value = (int) (unsigned int) word;
+        atomic_fetch_add_explicit(&cache_counter()->hits, 1, memory_order_relaxed);
+        return 1;
+}
+
+// Counts a miss and fills the account's slot with the balance just read
+static void cache_miss(int ID, int value)
+{
+        atomic_fetch_add_explicit(&cache_counter()->misses, 1, memory_order_relaxed);
+        atomic_store_explicit(&cache_slots[(ID - 1) & cache_mask],
+                              CACHE_WORD(ID, value), memory_order_relaxed);
+}
+
+// With the cache on, callers must hold the account's lock (shared for reads,
+// exclusive for writes) or otherwise be the only thread using the account,
+// so a miss can't fill its slot with a balance a writer just replaced.
+int storage_read(int ID)
+{
+        int value;
+
+        if (cache_slots == NULL) {
+                return storage->read(ID);
+        }
+        if (storage_lookup(ID, &value)) {
+                return value;
+        }
+        value = storage->read(ID);
+        cache_miss(ID, value);
+        return value;
+}
+
+// Writes through: the backend is always up to date, and the cache then holds
+// the new balance
+void storage_write(int ID, int value)
+{
+        storage->write(ID, value);
+        if (cache_slots != NULL) {
+                atomic_store_explicit(&cache_slots[(ID - 1) & cache_mask],
+                                      CACHE_WORD(ID, value), memory_order_relaxed);
+        }
+}
+
+// Returns 1 if the selected backend's latency can be waited out by the
+// caller through storage_read_deferred and storage_write_deferred. Bank.c
+// sleeps inside read_account and write_account, so "bank" can't.
+int storage_can_defer()
+{
+        return storage->read != read_account;
+}
+
+// storage_read for --async workers, which wait out the modelled latency on a
+// timer instead of sleeping in the backend. Sets *value at once and returns
+// how many microseconds the read stands for; the caller keeps the account
+// locked and holds back anything that depends on it until they have passed.
+// Same locking rules as storage_read.
+int storage_read_deferred(int ID, int *value)
+{
+        if (storage_lookup(ID, value)) {
+                return 0;
+        }
+        *value = storage->peek(ID);
+        if (cache_slots != NULL) {
+                cache_miss(ID, *value);
+        }
+        return storage->read == latency_read ? model_delay_us() : 0;
+}
+
+// storage_write counterpart of storage_read_deferred: the balance is written
+// at once and the write is only complete once the returned microseconds
+// have passed
+int storage_write_deferred(int ID, int value)
+{
+        storage->poke(ID, value);
+        if (cache_slots != NULL) {
+                atomic_store_explicit(&cache_slots[(ID - 1) & cache_mask],
+                                      CACHE_WORD(ID, value), memory_order_relaxed);
+        }
+        return storage->write == latency_write ? model_delay_us() : 0;
+}
+
+// Initializes storage from an existing array of n balances, such as a mapped
+// snapshot. Backends that keep plain int arrays use it in place, without
+// touching it; the others are initialized and then copied into.
+// Returns 1 if succeeded, 0 if error.
+int storage_initialize_from(int *balances, int n)
+{
+        int i;
+
+        if (storage->attach != NULL) {
+                storage->attach(balances);
+                return 1;
+        }
+        if (storage->initialize(n) == 0) {
+                return 0;
+        }
+        for (i = 0; i < n; i++) {
+                storage->poke(i + 1, balances[i]);
+        }
+        return 1;
+}
+
+// Reads a balance without the backend's modelled latency. For recovery and
+// snapshots only; callers handle any locking themselves.
+int storage_peek(int ID)
+{
+        return storage->peek(ID);
+}
+
+// Sets a balance without the backend's modelled latency. For recovery only.
+void storage_poke(int ID, int value)
+{
+        storage->poke(ID, value);
+        if (cache_slots != NULL) {
+                atomic_store_explicit(&cache_slots[(ID - 1) & cache_mask], 0, memory_order_relaxed);
+        }
+}
@@ -0,0 +1,51 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+// Pluggable account storage. Every backend keeps Bank.h's contract: accounts
+// are numbered 1 to n, start at 0 and are accessed with no error checking.
+// The "bank" backend is Bank.c itself and stays the default.
+// storage_cache_init puts a write-through balance cache in front of it.
+
+#define DEFAULT_STORAGE "bank"
+#define DEFAULT_STORAGE_LATENCY_US 100000
+
+// Results of storage_try_add
+#define STORAGE_ADDED 0
+#define STORAGE_ISF 1
+#define STORAGE_HELD 2
+
+
+struct storage_backend {
+        char *name;
+        char *description;
+        int (*initialize)(int n);
+        int (*read)(int ID);
+        void (*write)(int ID, int value);
+        int (*peek)(int ID);              // read with no modelled latency
+        void (*poke)(int ID, int value);  // write with no modelled latency
+        void (*attach)(int *balances);    // adopt an existing array, or NULL
+};
+
+
+int storage_select(char *name, int latency_us, int jitter_us);
+char *storage_name();
+void storage_print_backends();
+int storage_initialize(int n);
+int storage_initialize_from(int *balances, int n);
+int storage_read(int ID);
+void storage_write(int ID, int value);
+int storage_can_defer();
+int storage_read_deferred(int ID, int *value);
+int storage_write_deferred(int ID, int value);
+int storage_peek(int ID);
+void storage_poke(int ID, int value);
+int storage_cache_init(int size);
+unsigned long storage_cache_size();
+void storage_cache_stats(unsigned long *hits, unsigned long *misses);
+int storage_lookup(int ID, int *value);
+int storage_has_cas();
+int storage_try_add(int ID, int value);
+void storage_hold(int ID);
+void storage_release(int ID);
+
+#endif
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Checks the lock-free path for single-account TRANS (-F) without the WAL,
+# which turns it off: concurrent TRANS must leave the same balances and ISF
+# count as running them one at a time, and every TRANS must be counted on
+# exactly one path.
+# Run from the top of the repo after `make`, or with `make test`.
+
+SERVER=./appserver
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+SINGLES=400   # TRANS k 10 on accounts 1-4, lock-free unless one is held
+MULTIS=40     # TRANS 1 5 2 5, always locked
+WITHDRAWS=150 # TRANS 3 -10 once account 3 holds 1000: 100 OK, 50 ISF
+EXPECTED='1200 1200 0 1000'
+
+# Deposits, racing the locked TRANS on accounts 1 and 2
+commands() {
+        i=0
+        while [ $i -lt $SINGLES ]; do
+                echo "TRANS $((i % 4 + 1)) 10"
+                if [ $((i % 10)) -eq 0 ]; then
+                        echo "TRANS 1 5 2 5"
+                fi
+                i=$((i + 1))
+        done
+        sleep 0.5
+        i=0
+        while [ $i -lt $WITHDRAWS ]; do
+                echo "TRANS 3 -10"
+                i=$((i + 1))
+        done
+        sleep 0.5
+        printf 'CHECK 1\nCHECK 2\nCHECK 3\nCHECK 4\nEND\n'
+}
+
+commands | $SERVER 8 4 "$DIR/out.txt" -s atomic -F > "$DIR/stdout.txt"
+
+status=0
+balances=$(sort -n "$DIR/out.txt" |
+           awk '$2 == "BAL" { printf "%s%s", sep, $3; sep = " " }')
+isf=$(grep -c ' ISF ' "$DIR/out.txt")
+if [ "$balances" != "$EXPECTED" ] || [ "$isf" != 50 ]; then
+        echo "FAIL -F balances: $balances with $isf ISF, expected $EXPECTED with 50 ISF"
+        status=1
+else
+        echo "ok   -F balances"
+fi
+
+# TRANS lock-free path: <n>, locked path: <n> (<n> fell back from lock-free)
+set -- $(sed -n 's/^TRANS lock-free path: \([0-9]*\), locked path: \([0-9]*\) (\([0-9]*\) fell.*/\1 \2 \3/p' "$DIR/stdout.txt")
+singles=$((SINGLES + WITHDRAWS))
+if [ $# -ne 3 ] || [ $(($1 + $3)) -ne $singles ] ||
+   [ $(($2 - $3)) -ne $MULTIS ]; then
+        echo "FAIL -F paths: lock-free ${1:-?}, locked ${2:-?}, fell back ${3:-?};" \
+             "expected $singles single-account and $MULTIS locked"
+        status=1
+else
+        echo "ok   -F paths: lock-free $1, locked $2, fell back $3"
+fi
+exit $status
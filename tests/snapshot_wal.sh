@@ -0,0 +1,43 @@
+#!/bin/sh
+# Checks that a snapshot taken without --wal never has the WAL replayed on
+# top of balances that already include it.
+# Run from the top of the repo after `make`, or with `make test`.
+
+SERVER=./appserver
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# Runs the server on the commands in $1 with the options that follow
+run() {
+        commands=$1
+        shift
+        { echo "$commands"; echo END; } |
+                $SERVER 2 4 "$DIR/out.txt" -s memory -C 0 "$@" > /dev/null 2>&1
+}
+
+status=0
+
+# WAL and snapshot, snapshot only, then both: the WAL was already in the
+# snapshot, so only what came after it may be replayed
+run 'TRANS 1 100' -w "$DIR/wal" -c "$DIR/snap"
+run 'TRANS 1 50' -c "$DIR/snap"
+run 'CHECK 1' -c "$DIR/snap" -w "$DIR/wal"
+balance=$(awk '$2 == "BAL" { print $3 }' "$DIR/out.txt")
+if [ "$balance" != 150 ]; then
+        echo "FAIL snapshot kept across a run without --wal: BAL $balance, expected 150"
+        status=1
+else
+        echo "ok   snapshot kept across a run without --wal"
+fi
+
+# A snapshot that never saw the WAL can't be used with one
+rm -f "$DIR"/*
+run 'TRANS 1 100' -w "$DIR/wal"
+run 'TRANS 1 50' -c "$DIR/snap"
+if run 'CHECK 1' -c "$DIR/snap" -w "$DIR/wal"; then
+        echo "FAIL snapshot without a WAL position accepted with --wal"
+        status=1
+else
+        echo "ok   snapshot without a WAL position refused with --wal"
+fi
+exit $status
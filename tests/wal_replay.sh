@@ -0,0 +1,56 @@
+#!/bin/sh
+# Checks that the balances a server ends up with match what replaying its
+# write-ahead log rebuilds, for every way TRANS can be run.
+# Run from the top of the repo after `make`, or with `make test`.
+
+SERVER=./appserver
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+COMMANDS='TRANS 1 50 2 100
+TRANS 2 -40 3 5
+TRANS 3 10
+TRANS 1 -40
+TRANS 4 -5
+TRANS 1 -5 1 10'
+CHECKS='CHECK 1
+CHECK 2
+CHECK 3
+CHECK 4'
+EXPECTED='10 60 15 0'
+
+# Prints each line of $1 with a pause after it, so TRANS that depend on the
+# ones before them aren't raced against them by another worker
+paced() {
+        echo "$1" | while read -r line; do
+                echo "$line"
+                sleep 0.1
+        done
+}
+
+# Prints the balances CHECKed in log, in account order
+balances() {
+        sort -n "$1" | awk '$2 == "BAL" { printf "%s%s", sep, $3; sep = " " }'
+}
+
+status=0
+for mode in "" "-d steal" "-d epoch" "-d shard" "-o -s atomic" "-x" "-i 2" "-a 4"; do
+        rm -f "$DIR"/*
+
+        # Live: wait for the TRANS to finish before CHECKing
+        { paced "$COMMANDS"; sleep 0.5; echo "$CHECKS"; echo END; } |
+                $SERVER 2 4 "$DIR/live.txt" -s memory -w "$DIR/wal" $mode > /dev/null
+        # Replayed: only the log tells the new server about the TRANS
+        { echo "$CHECKS"; echo END; } |
+                $SERVER 2 4 "$DIR/replay.txt" -s memory -w "$DIR/wal" > /dev/null
+
+        live=$(balances "$DIR/live.txt")
+        replay=$(balances "$DIR/replay.txt")
+        if [ "$live" != "$EXPECTED" ] || [ "$replay" != "$EXPECTED" ]; then
+                echo "FAIL ${mode:-default}: live $live, replayed $replay, expected $EXPECTED"
+                status=1
+        else
+                echo "ok   ${mode:-default}"
+        fi
+done
+exit $status
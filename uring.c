@@ -0,0 +1,140 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+
+// Sets up a ring with room for entries submissions. Returns 1 if succeeded,
+// 0 if the kernel has no io_uring (or it is disabled) or setting up failed;
+// callers then keep to their ordinary system calls.
+int uring_init(struct uring *ring, unsigned int entries)
+{
+        struct io_uring_params params;
+        char *base;
+
+        memset(ring, 0, sizeof(struct uring));
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring->fd < 0) {
+                return 0;
+        }
+        // Kernels with fast poll (5.7) have every opcode used here, poll
+        // sockets instead of blocking a kernel thread on them, keep
+        // completions that overflow the ring and map both rings at once
+        if (!(params.features & IORING_FEAT_FAST_POLL)) {
+                close(ring->fd);
+                return 0;
+        }
+
+        ring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->rings_size) {
+                ring->rings_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        }
+        ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size,
+                                                PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE,
+                                                ring->fd, IORING_OFF_SQES);
+        if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED) {
+                close(ring->fd);
+                return 0;
+        }
+
+        base = (char*) ring->rings;
+        ring->sq_head = (unsigned int*)(base + params.sq_off.head);
+        ring->sq_tail = (unsigned int*)(base + params.sq_off.tail);
+        ring->sq_array = (unsigned int*)(base + params.sq_off.array);
+        ring->sq_mask = *(unsigned int*)(base + params.sq_off.ring_mask);
+        ring->sq_entries = params.sq_entries;
+        ring->sq_local_tail = *ring->sq_tail;
+        ring->cq_head = (unsigned int*)(base + params.cq_off.head);
+        ring->cq_tail = (unsigned int*)(base + params.cq_off.tail);
+        ring->cq_mask = *(unsigned int*)(base + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+        return 1;
+}
+
+void uring_destroy(struct uring *ring)
+{
+        munmap(ring->sqes, ring->sqes_size);
+        munmap(ring->rings, ring->rings_size);
+        close(ring->fd);
+}
+
+// Fills in the next submission: op on fd with the buffer addr of len bytes
+// (offset 0), tagged with user_data for its completion. The caller may
+// adjust the entry further before the next uring_submit. If the ring is
+// full, what is queued is submitted first.
+struct io_uring_sqe *uring_sqe(struct uring *ring, int op, int fd, void *addr, unsigned int len, unsigned long user_data)
+{
+        struct io_uring_sqe *sqe;
+        unsigned int index;
+
+        while (ring->sq_local_tail -
+               atomic_load_explicit((_Atomic unsigned int *) ring->sq_head,
+                                    memory_order_acquire) == ring->sq_entries) {
+                uring_submit(ring, 0);
+        }
+        index = ring->sq_local_tail & ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = op;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long) addr;
+        sqe->len = len;
+        sqe->user_data = user_data;
+        ring->sq_array[index] = index;
+        ring->sq_local_tail++;
+        return sqe;
+}
+
+// Hands every queued submission to the kernel and, if wait_nr > 0, waits
+// until at least that many completions are ready, all in one system call.
+// Returns 0 if succeeded, -1 if error.
+int uring_submit(struct uring *ring, unsigned int wait_nr)
+{
+        unsigned int to_submit;
+        int ret;
+
+        atomic_store_explicit((_Atomic unsigned int *) ring->sq_tail,
+                              ring->sq_local_tail, memory_order_release);
+        for (;;) {
+                // Entries the kernel took before an interruption stay taken
+                to_submit = ring->sq_local_tail -
+                            atomic_load_explicit((_Atomic unsigned int *) ring->sq_head,
+                                                 memory_order_acquire);
+                ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                              wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+                if (ret >= 0) {
+                        return 0;
+                }
+                if (errno != EINTR) {
+                        return -1;
+                }
+        }
+}
+
+// Takes the oldest completion, if there is one, storing its user_data and
+// result (a byte count, or a negative errno). Returns 1 if one was taken,
+// 0 if the completion ring is empty.
+int uring_completion(struct uring *ring, unsigned long *user_data, int *res)
+{
+        unsigned int head = *ring->cq_head;
+        struct io_uring_cqe *cqe;
+
+        if (head == atomic_load_explicit((_Atomic unsigned int *) ring->cq_tail,
+                                         memory_order_acquire)) {
+                return 0;
+        }
+        cqe = &ring->cqes[head & ring->cq_mask];
+        *user_data = cqe->user_data;
+        *res = cqe->res;
+        atomic_store_explicit((_Atomic unsigned int *) ring->cq_head, head + 1,
+                              memory_order_release);
+        return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024    // Submission queue entries of each ring
+
+
+// A minimal io_uring instance driven through the raw system calls, so it
+// doesn't depend on liburing being installed. The submission and completion
+// rings are shared with the kernel through mmap. A ring belongs to the one
+// thread that fills and reaps it: entries are only handed to the kernel by
+// uring_submit, so any number can be batched into one system call.
+struct uring {
+        int fd;
+        // Submission ring
+        unsigned int *sq_head;
+        unsigned int *sq_tail;
+        unsigned int *sq_array;
+        unsigned int sq_mask;
+        unsigned int sq_entries;
+        unsigned int sq_local_tail; // Entries filled in, published on submit
+        struct io_uring_sqe *sqes;
+        // Completion ring
+        unsigned int *cq_head;
+        unsigned int *cq_tail;
+        unsigned int cq_mask;
+        struct io_uring_cqe *cqes;
+        // Mappings, for uring_destroy
+        void *rings;          // Both rings share one
+        size_t rings_size;
+        size_t sqes_size;
+};
+
+
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_destroy(struct uring *ring);
+struct io_uring_sqe *uring_sqe(struct uring *ring, int op, int fd, void *addr, unsigned int len, unsigned long user_data);
+int uring_submit(struct uring *ring, unsigned int wait_nr);
+int uring_completion(struct uring *ring, unsigned long *user_data, int *res);
+
+#endif
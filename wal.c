@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "storage.h"
+#include "wal.h"
+
+
+// FNV-1a, enough to spot a record torn by a crash
+static uint32_t checksum(uint32_t num_legs, struct wal_leg *legs)
+{
+        uint32_t hash = 2166136261u;
+        unsigned char *bytes = (unsigned char *) legs;
+        size_t i;
+
+        hash = (hash ^ num_legs) * 16777619u;
+        for (i = 0; i < num_legs * sizeof(struct wal_leg); i++) {
+                hash = (hash ^ bytes[i]) * 16777619u;
+        }
+        return hash;
+}
+
+// Adds every intact record from offset start on to the balances in storage
+// and cuts off a torn tail, leaving the end of the log in *end.
+// Returns the number of records replayed, -1 if error.
+static long replay(int fd, int num_accts, off_t start, off_t *end)
+{
+        struct wal_header header;
+        struct wal_leg legs[WAL_MAX_LEGS];
+        long *balances = (long*)calloc(num_accts, sizeof(long));
+        off_t good = start;
+        long records = 0;
+        int i;
+
+        if (balances == NULL || lseek(fd, start, SEEK_SET) < 0) {
+                free(balances);
+                return -1;
+        }
+        for (;;) {
+                if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+                    header.magic != WAL_MAGIC ||
+                    header.num_legs < 1 || header.num_legs > WAL_MAX_LEGS) {
+                        break;
+                }
+                size_t size = header.num_legs * sizeof(struct wal_leg);
+                if (read(fd, legs, size) != (ssize_t) size ||
+                    checksum(header.num_legs, legs) != header.checksum) {
+                        break;
+                }
+                for (i = 0; i < (int) header.num_legs; i++) {
+                        if (legs[i].account >= 1 && legs[i].account <= num_accts) {
+                                balances[legs[i].account - 1] += legs[i].delta;
+                        } else {
+                                fprintf(stderr, "WAL names account %d, which "
+                                        "is not in the bank; skipped.\n",
+                                        legs[i].account);
+                        }
+                }
+                good += sizeof(header) + size;
+                records++;
+        }
+
+        if (ftruncate(fd, good) != 0 || lseek(fd, good, SEEK_SET) < 0) {
+                free(balances);
+                return -1;
+        }
+        for (i = 0; i < num_accts; i++) {
+                if (balances[i] != 0) {
+                        storage_poke(i + 1, storage_peek(i + 1) + (int) balances[i]);
+                }
+        }
+        free(balances);
+        *end = good;
+        return records;
+}
+
+// Opens (creating if needed) the log at path, replays the records from byte
+// start on into storage, which must already be initialized (from a snapshot
+// taken at start, or zeroed with start 0), and gets it ready for appending.
+// Returns 1 if succeeded, 0 if error.
+int wal_open(struct wal *wal, char *path, int durability, int num_accts, unsigned long start)
+{
+        long replayed;
+        off_t end, size;
+
+        wal->fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (wal->fd < 0) {
+                return 0;
+        }
+        size = lseek(wal->fd, 0, SEEK_END);
+        if (size >= 0 && start > (unsigned long) size) {
+                fprintf(stderr, "WAL %s is shorter than the snapshot expects; "
+                        "nothing replayed.\n", path);
+                start = size;
+        }
+        replayed = replay(wal->fd, num_accts, start, &end);
+        if (replayed < 0) {
+                close(wal->fd);
+                return 0;
+        }
+        printf("Replayed %ld transactions from %s\n", replayed, path);
+
+        wal->durability = durability;
+        wal->cap = 4096;
+        wal->spare_cap = 4096;
+        wal->buf = (char*)malloc(wal->cap);
+        wal->spare = (char*)malloc(wal->spare_cap);
+        wal->len = 0;
+        wal->appended = end; // LSNs are offsets in the file
+        wal->durable = end;
+        wal->flushing = 0;
+        wal->records = 0;
+        wal->flushes = 0;
+        if (wal->buf == NULL || wal->spare == NULL ||
+            pthread_mutex_init(&wal->lock, NULL) != 0 ||
+            pthread_cond_init(&wal->flushed, NULL) != 0) {
+                close(wal->fd);
+                return 0;
+        }
+        return 1;
+}
+
+// Buffers the record of a committed TRANS. Returns its log sequence number,
+// to be passed to wal_wait before the TRANS is reported OK. Callers must hold
+// the locks of the accounts involved.
+unsigned long wal_append(struct wal *wal, int *IDs, int *deltas, int n)
+{
+        struct wal_header header;
+        struct wal_leg legs[WAL_MAX_LEGS];
+        int size = sizeof(header) + n * sizeof(struct wal_leg);
+        unsigned long lsn;
+        char *buf;
+        int i;
+
+        for (i = 0; i < n; i++) {
+                legs[i].account = IDs[i];
+                legs[i].delta = deltas[i];
+        }
+        header.magic = WAL_MAGIC;
+        header.num_legs = n;
+        header.checksum = checksum(n, legs);
+
+        pthread_mutex_lock(&wal->lock);
+        if (wal->len + size > wal->cap) {
+                // Like a failed write: a committed TRANS can't go unlogged
+                buf = (char*)realloc(wal->buf, (wal->len + size) * 2);
+                if (buf == NULL) {
+                        perror("Failed to grow WAL buffer");
+                        exit(EXIT_FAILURE);
+                }
+                wal->buf = buf;
+                wal->cap = (wal->len + size) * 2;
+        }
+        memcpy(wal->buf + wal->len, &header, sizeof(header));
+        memcpy(wal->buf + wal->len + sizeof(header), legs, n * sizeof(struct wal_leg));
+        wal->len += size;
+        wal->appended += size;
+        wal->records++;
+        lsn = wal->appended;
+        pthread_mutex_unlock(&wal->lock);
+
+        return lsn;
+}
+
+// Returns the end of the log, the offset the next record will be written at
+unsigned long wal_position(struct wal *wal)
+{
+        unsigned long position;
+
+        pthread_mutex_lock(&wal->lock);
+        position = wal->appended;
+        pthread_mutex_unlock(&wal->lock);
+        return position;
+}
+
+// Writes (and syncs) everything buffered so far as the group leader and
+// wakes every waiter it covered. Called with the lock held and no flush in
+// progress; drops the lock during the I/O and returns with it held again.
+static void flush_locked(struct wal *wal)
+{
+        char *batch;
+        int len, batch_cap, done;
+        unsigned long target;
+        ssize_t n;
+
+        // Take everything buffered so far; later appends go to spare
+        wal->flushing = 1;
+        batch = wal->buf;
+        len = wal->len;
+        target = wal->appended;
+        batch_cap = wal->cap;
+        wal->buf = wal->spare;
+        wal->cap = wal->spare_cap;
+        wal->len = 0;
+        pthread_mutex_unlock(&wal->lock);
+
+        for (done = 0; done < len; done += n) {
+                n = write(wal->fd, batch + done, len - done);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                n = 0;
+                                continue;
+                        }
+                        perror("Failed to write WAL");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (wal->durability == DURABILITY_SYNC && fdatasync(wal->fd) != 0) {
+                perror("Failed to sync WAL");
+                exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&wal->lock);
+        wal->spare = batch;
+        wal->spare_cap = batch_cap;
+        wal->durable = target;
+        wal->flushing = 0;
+        wal->flushes++;
+        pthread_cond_broadcast(&wal->flushed);
+}
+
+// Blocks until the log is durable up to lsn, flushing it as the group
+// leader if no other thread is already doing so
+void wal_wait(struct wal *wal, unsigned long lsn)
+{
+        pthread_mutex_lock(&wal->lock);
+        while (wal->durable < lsn) {
+                if (wal->flushing) {
+                        pthread_cond_wait(&wal->flushed, &wal->lock);
+                        continue;
+                }
+                flush_locked(wal);
+        }
+        pthread_mutex_unlock(&wal->lock);
+}
+
+// wal_wait for callers that must not wait on another thread's flush: leads a
+// flush if lsn isn't durable yet and none is in progress, but otherwise
+// returns at once. Returns 1 once the log is durable up to lsn, 0 if the
+// caller should poll again later.
+int wal_poll(struct wal *wal, unsigned long lsn)
+{
+        int durable;
+
+        pthread_mutex_lock(&wal->lock);
+        if (wal->durable < lsn && !wal->flushing) {
+                flush_locked(wal);
+        }
+        durable = wal->durable >= lsn;
+        pthread_mutex_unlock(&wal->lock);
+        return durable;
+}
+
+// Flushes anything still buffered and closes the log
+void wal_close(struct wal *wal)
+{
+        wal_wait(wal, wal->appended);
+        printf("WAL: %ld transactions in %ld flushes\n", wal->records, wal->flushes);
+        close(wal->fd);
+        free(wal->buf);
+        free(wal->spare);
+        pthread_cond_destroy(&wal->flushed);
+        pthread_mutex_destroy(&wal->lock);
+}
@@ -0,0 +1,59 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define WAL_MAGIC 0x314c4157 // "WAL1"
+#define WAL_MAX_LEGS 10
+
+// How far wal_wait goes before a TRANS is reported OK
+#define DURABILITY_WRITE 1 // Handed to the kernel: survives a server crash
+#define DURABILITY_SYNC 2  // fdatasync'd: survives a machine crash
+
+
+// On-disk record of one committed TRANS: the header is followed by num_legs
+// (account, delta) pairs. Deltas rather than balances are logged, so replay
+// does not depend on the order concurrent TRANS reached the log.
+struct wal_header {
+        uint32_t magic;
+        uint32_t num_legs;
+        uint32_t checksum;    // Over num_legs and the legs
+};
+
+struct wal_leg {
+        int32_t account;
+        int32_t delta;
+};
+
+// Write-ahead log with group commit. Committing TRANS append their record to
+// an in-memory buffer; whichever one then finds no flush in progress becomes
+// the leader, writes (and syncs) everything buffered so far and wakes every
+// TRANS whose record that covered. All others wait on flushed, so one
+// fdatasync is shared by everything that committed while the last one ran.
+struct wal {
+        int fd;
+        int durability;
+        pthread_mutex_t lock;
+        pthread_cond_t flushed;
+        char *buf;            // Records appended but not yet written
+        int len;
+        int cap;
+        char *spare;          // Swapped with buf by the flushing leader
+        int spare_cap;
+        unsigned long appended; // Offset of the end of the log
+        unsigned long durable;  // Offset written/synced up to
+        int flushing;
+        long records;
+        long flushes;
+};
+
+
+int wal_open(struct wal *wal, char *path, int durability, int num_accts, unsigned long start);
+unsigned long wal_append(struct wal *wal, int *IDs, int *deltas, int n);
+unsigned long wal_position(struct wal *wal);
+void wal_wait(struct wal *wal, unsigned long lsn);
+int wal_poll(struct wal *wal, unsigned long lsn);
+void wal_close(struct wal *wal);
+
+#endif
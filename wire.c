@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include "wire.h"
+
+
+static unsigned int get16(unsigned char *p)
+{
+        return p[0] | p[1] << 8;
+}
+
+static unsigned int get32(unsigned char *p)
+{
+        return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+        p[0] = v;
+        p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+        p[0] = v;
+        p[1] = v >> 8;
+        p[2] = v >> 16;
+        p[3] = v >> 24;
+}
+
+static void put64(unsigned char *p, unsigned long v)
+{
+        put32(p, v);
+        put32(p + 4, v >> 32);
+}
+
+// Given the first len bytes received of a request, returns the length of the
+// whole frame, 0 if its header hasn't fully arrived yet, or -1 if the length
+// can't belong to a valid request.
+int wire_frame_length(unsigned char *data, int len)
+{
+        unsigned int length;
+
+        if (len < 2) {
+                return 0;
+        }
+        length = get16(data);
+        if (length < WIRE_HEADER_LEN || length > WIRE_REQUEST_MAX ||
+            (length - WIRE_HEADER_LEN) % WIRE_PAIR_LEN != 0) {
+                return -1;
+        }
+        return length;
+}
+
+// Decodes a whole request frame into cmd, sorting a TRANS's pairs by account
+// as appserver expects, and sets *tag. Returns the op, or -1 if the frame is
+// malformed or a TRANS names an account twice. Account numbers aren't checked.
+int wire_decode_request(unsigned char *frame, struct command *cmd, unsigned int *tag)
+{
+        struct transaction t;
+        int length = get16(frame);
+        int op = frame[2];
+        int pairs = frame[3];
+        int i, j;
+
+        *tag = get32(frame + 4);
+        if (length != WIRE_HEADER_LEN + WIRE_PAIR_LEN * pairs ||
+            (op == WIRE_CHECK && pairs != 1) || (op == WIRE_TRANS && pairs < 1) ||
+            (op != WIRE_CHECK && op != WIRE_TRANS && op != WIRE_END)) {
+                return -1;
+        }
+        cmd->op = op;
+        cmd->num_transactions = pairs;
+        cmd->deadline_ms = 0;
+        for (i = 0; i < pairs; i++) {
+                t.account_number = (int) get32(frame + WIRE_HEADER_LEN + WIRE_PAIR_LEN * i);
+                t.value = op == WIRE_CHECK ? 0 :
+                          (int) get32(frame + WIRE_HEADER_LEN + WIRE_PAIR_LEN * i + 4);
+                for (j = i; j > 0 && cmd->transactions[j - 1].account_number > t.account_number; j--) {
+                        cmd->transactions[j] = cmd->transactions[j - 1];
+                }
+                if (j > 0 && cmd->transactions[j - 1].account_number == t.account_number) {
+                        return -1;
+                }
+                cmd->transactions[j] = t;
+        }
+        return op;
+}
+
+// Client side: encodes a request into out. Returns its length, or -1 if a
+// CHECK or TRANS has no pairs or it has too many.
+int wire_encode_request(int op, unsigned int tag, struct transaction *transactions, int num_transactions, unsigned char out[WIRE_REQUEST_MAX])
+{
+        int length = WIRE_HEADER_LEN + WIRE_PAIR_LEN * num_transactions;
+        int i;
+
+        if (num_transactions < (op == WIRE_END ? 0 : 1) || num_transactions > MAX_TRANSACTIONS) {
+                return -1;
+        }
+        put16(out, length);
+        out[2] = op;
+        out[3] = num_transactions;
+        put32(out + 4, tag);
+        for (i = 0; i < num_transactions; i++) {
+                put32(out + WIRE_HEADER_LEN + WIRE_PAIR_LEN * i, transactions[i].account_number);
+                put32(out + WIRE_HEADER_LEN + WIRE_PAIR_LEN * i + 4, transactions[i].value);
+        }
+        return length;
+}
+
+void wire_encode_response(struct wire_response *response, unsigned char out[WIRE_RESPONSE_LEN])
+{
+        put16(out, WIRE_RESPONSE_LEN);
+        out[2] = response->op;
+        out[3] = response->result;
+        put32(out + 4, response->tag);
+        put32(out + 8, response->request_id);
+        put32(out + 12, response->value);
+        put64(out + 16, response->begin_us);
+        put64(out + 24, response->end_us);
+}
+
+// Client side: decodes a response
+void wire_decode_response(unsigned char in[WIRE_RESPONSE_LEN], struct wire_response *response)
+{
+        response->op = in[2];
+        response->result = in[3];
+        response->tag = get32(in + 4);
+        response->request_id = (int) get32(in + 8);
+        response->value = (int) get32(in + 12);
+        response->begin_us = (long) (get32(in + 16) | (unsigned long) get32(in + 20) << 32);
+        response->end_us = (long) (get32(in + 24) | (unsigned long) get32(in + 28) << 32);
+}
+
+// Formats a finished command's result the way it appears in the output file,
+// without the newline: "<id> BAL <balance>", "<id> OK" or "<id> ISF <account>"
+// followed by "TIME <begin> <end>". Returns the length, like snprintf.
+int wire_format_text(struct wire_response *response, char *out, int len)
+{
+        long begin_s = response->begin_us / 1000000, begin_us = response->begin_us % 1000000;
+        long end_s = response->end_us / 1000000, end_us = response->end_us % 1000000;
+
+        if (response->result == WIRE_BAL) {
+                return snprintf(out, len, "%d BAL %d TIME %ld.%06ld %ld.%06ld",
+                                response->request_id, response->value,
+                                begin_s, begin_us, end_s, end_us);
+        } else if (response->result == WIRE_ISF) {
+                return snprintf(out, len, "%d ISF %d TIME %ld.%06ld %ld.%06ld",
+                                response->request_id, response->value,
+                                begin_s, begin_us, end_s, end_us);
+        }
+        return snprintf(out, len, "%d OK TIME %ld.%06ld %ld.%06ld",
+                        response->request_id, begin_s, begin_us, end_s, end_us);
+}
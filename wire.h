@@ -0,0 +1,70 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "command.h"
+
+// Compact binary encoding of commands and their results for network clients
+// that would rather not pay for text parsing and formatting. A connection
+// whose first byte is WIRE_HELLO speaks it for the rest of its life; any
+// other connection is a text connection. Every field is little-endian.
+//
+// Request, 8 + 8 * pairs bytes:
+//   u16 length     whole frame, header included
+//   u8  op         WIRE_CHECK, WIRE_TRANS or WIRE_END
+//   u8  pairs      account/amount pairs that follow, 1 for a CHECK, 0 for END
+//   u32 tag        chosen by the client, echoed in the response
+//   pairs * (i32 account, i32 amount), the amount of a CHECK is ignored
+//
+// Response, WIRE_RESPONSE_LEN bytes. Every request gets one straight away;
+// with --results a CHECK or TRANS that was queued gets a second one, with
+// the same tag, once it has run:
+//   u16 length     WIRE_RESPONSE_LEN
+//   u8  op         op of the request
+//   u8  result     one of the WIRE_ results
+//   u32 tag
+//   i32 request_id assigned by the server, 0 if the command was rejected
+//   i32 value      balance for WIRE_BAL, account for WIRE_ISF, otherwise 0
+//   i64 begin_us   when the server received the request, µs since the epoch
+//   i64 end_us     when it finished, 0 until then
+
+#define WIRE_HELLO 0xb1
+#define WIRE_HEADER_LEN 8
+#define WIRE_PAIR_LEN 8
+#define WIRE_REQUEST_MAX (WIRE_HEADER_LEN + WIRE_PAIR_LEN * MAX_TRANSACTIONS)
+#define WIRE_RESPONSE_LEN 32
+#define WIRE_TEXT_LEN 96      // Room for any line wire_format_text writes
+
+// Ops
+#define WIRE_CHECK CMD_CHECK
+#define WIRE_TRANS CMD_TRANS
+#define WIRE_END 3
+
+// Results
+#define WIRE_QUEUED 0         // Accepted; request_id and begin_us are set
+#define WIRE_OK 1
+#define WIRE_ISF 2
+#define WIRE_BAL 3
+#define WIRE_BAD_ACCOUNT 4    // An account that doesn't exist
+#define WIRE_INVALID 5        // Malformed frame or unknown op
+#define WIRE_CLOSED 6         // The server is shutting down and took no more
+
+
+struct wire_response {
+        int op;
+        int result;
+        unsigned int tag;
+        int request_id;
+        int value;
+        long begin_us;
+        long end_us;
+};
+
+
+int wire_frame_length(unsigned char *data, int len);
+int wire_decode_request(unsigned char *frame, struct command *cmd, unsigned int *tag);
+int wire_encode_request(int op, unsigned int tag, struct transaction *transactions, int num_transactions, unsigned char out[WIRE_REQUEST_MAX]);
+void wire_encode_response(struct wire_response *response, unsigned char out[WIRE_RESPONSE_LEN]);
+void wire_decode_response(unsigned char in[WIRE_RESPONSE_LEN], struct wire_response *response);
+int wire_format_text(struct wire_response *response, char *out, int len);
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "command.h"
+#include "wire.h"
+
+
+// Measures what a request costs to take in and a result to send back in the
+// text protocol (command_parse, then wire_format_text for the result line)
+// and in the binary protocol (wire_decode_request, then
+// wire_encode_response), for a CHECK and TRANS of a few sizes.
+
+#define DEFAULT_ITERATIONS 1000000
+#define NUM_CASES 4
+
+
+// FUNCTION PROTOTYPES
+long now_ns();
+void bench_case(char *name, int op, int legs, long iterations);
+
+// Keeps the compiler from dropping the work being timed
+volatile long sink;
+
+int main(int argc, char **argv)
+{
+        long iterations = DEFAULT_ITERATIONS;
+
+        if (argc > 2 || (argc == 2 && (iterations = atol(argv[1])) < 1)) {
+                printf("Usage: %s [iterations (default %d)]\n", argv[0],
+                       DEFAULT_ITERATIONS);
+                exit(EXIT_FAILURE);
+        }
+
+        printf("%ld iterations, ns per request\n", iterations);
+        printf("%-10s %10s %10s %10s %10s %10s %10s %8s\n", "command",
+               "text_in", "text_out", "text", "bin_in", "bin_out", "binary",
+               "saved");
+        bench_case("CHECK", CMD_CHECK, 1, iterations);
+        bench_case("TRANS x1", CMD_TRANS, 1, iterations);
+        bench_case("TRANS x3", CMD_TRANS, 3, iterations);
+        bench_case("TRANS x10", CMD_TRANS, 10, iterations);
+        exit(EXIT_SUCCESS);
+}
+
+long now_ns()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Times both protocols on one command with legs account/amount pairs and
+// prints a row
+void bench_case(char *name, int op, int legs, long iterations)
+{
+        struct transaction transactions[MAX_TRANSACTIONS];
+        struct command cmd;
+        struct wire_response response;
+        unsigned char frame[WIRE_REQUEST_MAX];
+        unsigned char out[WIRE_RESPONSE_LEN];
+        char line[MAX_TRANSACTIONS * 24 + 8];
+        char reply[WIRE_TEXT_LEN];
+        unsigned int tag;
+        long started, text_in, text_out, bin_in, bin_out;
+        long i;
+        int j, n;
+
+        // Accounts in descending order, so both sides have sorting to do
+        n = sprintf(line, op == CMD_CHECK ? "CHECK" : "TRANS");
+        for (j = 0; j < legs; j++) {
+                transactions[j].account_number = 100000 - 7919 * j;
+                transactions[j].value = op == CMD_CHECK ? 0 : -250 + 97 * j;
+                n += sprintf(line + n, op == CMD_CHECK ? " %d" : " %d %d",
+                             transactions[j].account_number, transactions[j].value);
+        }
+        wire_encode_request(op, 42, transactions, legs, frame);
+        response.op = op;
+        response.result = op == CMD_CHECK ? WIRE_BAL : WIRE_OK;
+        response.tag = 42;
+        response.request_id = 123456;
+        response.value = op == CMD_CHECK ? 987654 : 0;
+        response.begin_us = 1700000000123456L;
+        response.end_us = 1700000000234567L;
+
+        started = now_ns();
+        for (i = 0; i < iterations; i++) {
+                sink += command_parse(line, &cmd) + cmd.transactions[0].account_number;
+        }
+        text_in = now_ns() - started;
+
+        started = now_ns();
+        for (i = 0; i < iterations; i++) {
+                sink += wire_format_text(&response, reply, sizeof(reply));
+        }
+        text_out = now_ns() - started;
+
+        started = now_ns();
+        for (i = 0; i < iterations; i++) {
+                sink += wire_decode_request(frame, &cmd, &tag) + cmd.transactions[0].account_number;
+        }
+        bin_in = now_ns() - started;
+
+        started = now_ns();
+        for (i = 0; i < iterations; i++) {
+                wire_encode_response(&response, out);
+                sink += out[3];
+        }
+        bin_out = now_ns() - started;
+
+        printf("%-10s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %7.1fx\n", name,
+               (double) text_in / iterations, (double) text_out / iterations,
+               (double) (text_in + text_out) / iterations,
+               (double) bin_in / iterations, (double) bin_out / iterations,
+               (double) (bin_in + bin_out) / iterations,
+               (double) (text_in + text_out) / (bin_in + bin_out));
+}